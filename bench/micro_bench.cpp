@@ -0,0 +1,305 @@
+/*
+CPU cost of the encode and decode paths, no redis server needed. Replies are
+parsed once from RESP with a hiredis reader and decoded again and again, so the
+decode numbers are GetFromReply only; the parse/ cases measure the reader.
+
+micro_bench [filter]    runs the cases whose name contains filter
+*/
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "redisfmt/redisfmt.hpp"
+
+using namespace rdsfmt;
+
+static uint64_t g_allocs = 0;
+
+void* operator new(size_t size) {
+    g_allocs++;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+// hiredis allocates with malloc, through these once main installs them
+static void* CountedMalloc(size_t size) {
+    g_allocs++;
+    return std::malloc(size);
+}
+static void* CountedCalloc(size_t count, size_t size) {
+    g_allocs++;
+    return std::calloc(count, size);
+}
+static void* CountedRealloc(void* p, size_t size) {
+    g_allocs++;
+    return std::realloc(p, size);
+}
+static char* CountedStrdup(const char* str) {
+    g_allocs++;
+    return strdup(str);
+}
+
+template <typename T>
+inline void Keep(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r"(&value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+static const char* g_filter = nullptr;
+
+// doubles the batch until it runs for 200ms, then reports the last batch
+template <typename F>
+void Bench(const std::string& name, F&& f) {
+    if (g_filter && name.find(g_filter) == std::string::npos)
+        return;
+    for (size_t i = 0; i < 16; i++)
+        f();
+    for (size_t iters = 16;; iters *= 2) {
+        uint64_t allocs = g_allocs;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iters; i++)
+            f();
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        if (ns >= 200 * 1000 * 1000 || iters >= (size_t(1) << 30)) {
+            printf("%-48s %12.1f ns/op %8.2f allocs/op\n", name.c_str(), static_cast<double>(ns) / iters,
+                static_cast<double>(g_allocs - allocs) / iters);
+            return;
+        }
+    }
+}
+
+namespace bench {
+struct Profile {
+    std::string name;
+    std::string city;
+    int64_t score = 0;
+    int level = 0;
+    double ratio = 0;
+    bool vip = false;
+};
+REDIS_STRUCT(Profile, name, city, score, level, ratio, vip)
+}
+
+// RESP of an array of bulk strings is what RespWriter writes for a command
+template <typename... Args>
+std::string Resp(const Args&... args) {
+    fmt::memory_buffer buffer;
+    detail::RespWriter(buffer).Command("", args...);
+    return fmt::to_string(buffer);
+}
+
+std::string Bulk(const std::string& value) {
+    fmt::memory_buffer buffer;
+    detail::RespWriter(buffer).Bulk(value.data(), value.size());
+    return fmt::to_string(buffer);
+}
+
+RedisReply Parse(const std::string& resp) {
+    redisReader* reader = redisReaderCreate();
+    redisReaderFeed(reader, resp.data(), resp.size());
+    void* reply = nullptr;
+    if (redisReaderGetReply(reader, &reply) != REDIS_OK || !reply) {
+        fprintf(stderr, "bad RESP\n");
+        std::exit(1);
+    }
+    redisReaderFree(reader);
+    return RedisReply(reply);
+}
+
+std::vector<std::string> Strings(size_t count, size_t size) {
+    std::vector<std::string> values;
+    for (size_t i = 0; i < count; i++) {
+        std::string value = fmt::format("v{}", i);
+        value.resize(size, 'x');
+        values.push_back(std::move(value));
+    }
+    return values;
+}
+
+void EncodeBenches() {
+    fmt::memory_buffer buffer;
+    std::string key = "user:1000";
+    std::string field = "profile.nickname";
+
+    Bench("encode/RespWriter HGET", [&] {
+        static constexpr auto cmd = detail::MakeRespCommand<std::string_view, std::string_view>("HGET");
+        buffer.clear();
+        detail::RespWriter(buffer).Command(cmd, std::string_view(key), std::string_view(field));
+        Keep(buffer);
+    });
+    Bench("encode/fmt+redisFormatCommand HGET", [&] {
+        std::string format = fmt::format("HGET {} {}", key, field);
+        char* out = nullptr;
+        int len = redisFormatCommand(&out, format.c_str());
+        Keep(len);
+        redisFreeCommand(out);
+    });
+
+    for (size_t size : { 16, 1024, 64 * 1024 }) {
+        std::string value(size, 'x');
+        Bench(fmt::format("encode/RespWriter SET {}B", size), [&] {
+            static constexpr auto cmd = detail::MakeRespCommand<std::string_view, std::string_view>("SET");
+            buffer.clear();
+            detail::RespWriter(buffer).Command(cmd, std::string_view(key), std::string_view(value));
+            Keep(buffer);
+        });
+        Bench(fmt::format("encode/fmt+redisFormatCommand SET {}B", size), [&] {
+            std::string format = fmt::format("SET {} %b", key);
+            char* out = nullptr;
+            int len = redisFormatCommand(&out, format.c_str(), value.data(), value.size());
+            Keep(len);
+            redisFreeCommand(out);
+        });
+        Bench(fmt::format("encode/redisFormatCommandArgv SET {}B", size), [&] {
+            const char* argv[] = { "SET", key.data(), value.data() };
+            size_t argvlen[] = { 3, key.size(), value.size() };
+            char* out = nullptr;
+            long long len = redisFormatCommandArgv(&out, 3, argv, argvlen);
+            Keep(len);
+            redisFreeCommand(out);
+        });
+    }
+
+    for (size_t count : { 10, 1000 }) {
+        std::map<std::string, std::string> fields;
+        for (auto& value : Strings(count, 16))
+            fields[value] = value;
+        Bench(fmt::format("encode/RespWriter HSET map {}", count), [&] {
+            static constexpr auto cmd = detail::MakeRespCommand<std::string_view, decltype(fields)>("HSET");
+            buffer.clear();
+            detail::RespWriter(buffer).Command(cmd, std::string_view(key), fields);
+            Keep(buffer);
+        });
+    }
+
+    bench::Profile profile{ "nickname", "somewhere", 123456, 42, 0.75, true };
+    Bench("encode/RespWriter HSET struct", [&] {
+        static constexpr auto cmd = detail::MakeRespCommand<std::string_view, bench::Profile>("HSET");
+        buffer.clear();
+        detail::RespWriter(buffer).Command(cmd, std::string_view(key), profile);
+        Keep(buffer);
+    });
+    if (buffer.capacity() > 1024 * 1024)
+        fprintf(stderr, "unexpected buffer growth\n");
+}
+
+void DecodeBenches() {
+    for (size_t size : { 16, 1024, 64 * 1024 }) {
+        RedisReply reply = Parse(Bulk(std::string(size, 'x')));
+        Bench(fmt::format("decode/string {}B", size), [&] {
+            auto value = GetFromReply<std::string>(reply);
+            Keep(value);
+        });
+        Bench(fmt::format("decode/ReplyView<string_view> {}B", size), [&] {
+            auto value = GetFromReply<ReplyView<std::string_view>>(reply);
+            Keep(value);
+        });
+    }
+
+    RedisReply integer = Parse(":1234567890\r\n");
+    Bench("decode/int64 from integer", [&] {
+        auto value = GetFromReply<int64_t>(integer);
+        Keep(value);
+    });
+    RedisReply number = Parse(Bulk("1234567890"));
+    Bench("decode/int64 from bulk string", [&] {
+        auto value = GetFromReply<int64_t>(number);
+        Keep(value);
+    });
+    RedisReply score = Parse(Bulk("3.14159"));
+    Bench("decode/double from bulk string", [&] {
+        auto value = GetFromReply<double>(score);
+        Keep(value);
+    });
+
+    for (size_t count : { 10, 1000 }) {
+        auto values = Strings(count, 16);
+        RedisReply array = Parse(Resp(values));
+        Bench(fmt::format("decode/vector<string> {}", count), [&] {
+            auto value = GetFromReply<std::vector<std::string>>(array);
+            Keep(value);
+        });
+        Bench(fmt::format("decode/ReplyView<vector<string_view>> {}", count), [&] {
+            auto value = GetFromReply<ReplyView<std::vector<std::string_view>>>(array);
+            Keep(value);
+        });
+        Bench(fmt::format("decode/map<string,string> {}", count), [&] {
+            auto value = GetFromReply<std::map<std::string, std::string>>(array);
+            Keep(value);
+        });
+        Bench(fmt::format("decode/unordered_map<string,string> {}", count), [&] {
+            auto value = GetFromReply<std::unordered_map<std::string, std::string>>(array);
+            Keep(value);
+        });
+        RedisReply page = Parse("*2\r\n" + Bulk("17") + Resp(values));
+        Bench(fmt::format("decode/pair<uint64,vector<string>> {}", count), [&] {
+            auto value = GetFromReply<std::pair<uint64_t, std::vector<std::string>>>(page);
+            Keep(value);
+        });
+    }
+
+    RedisReply hash = Parse(Resp("name", "nickname", "city", "somewhere", "score", "123456", "level", "42",
+        "ratio", "0.75", "vip", "1"));
+    Bench("decode/REDIS_STRUCT 6 fields", [&] {
+        auto value = GetFromReply<bench::Profile>(hash);
+        Keep(value);
+    });
+}
+
+void ParseBenches() {
+    for (size_t count : { 1, 1000 }) {
+        std::string resp = Resp(Strings(count, 16));
+        // one reader for the whole run on both sides, as a connection has
+        redisReader* plain = redisReaderCreate();
+        Bench(fmt::format("parse/hiredis reader array {}", count), [&] {
+            redisReaderFeed(plain, resp.data(), resp.size());
+            void* reply = nullptr;
+            redisReaderGetReply(plain, &reply);
+            RedisReply owned(reply);
+            Keep(owned);
+        });
+        redisReaderFree(plain);
+
+        redisReader* reader = redisReaderCreate();
+        redisContext context{};
+        context.reader = reader;
+        detail::ReplyArena arena;
+        detail::ReplyArena::Install(&context, &arena);
+        Bench(fmt::format("parse/arena reader array {}", count), [&] {
+            arena.Rewind();
+            redisReaderFeed(reader, resp.data(), resp.size());
+            void* reply = nullptr;
+            redisReaderGetReply(reader, &reply);
+            RedisReply adopted = arena.Adopt(reply);
+            Keep(adopted);
+        });
+        redisReaderFree(reader);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1)
+        g_filter = argv[1];
+    hiredisAllocFuncs counted = { CountedMalloc, CountedCalloc, CountedRealloc, CountedStrdup, std::free };
+    hiredisSetAllocators(&counted);
+    EncodeBenches();
+    DecodeBenches();
+    ParseBenches();
+    return 0;
+}
@@ -0,0 +1,254 @@
+/*
+Load generator in the manner of redis-benchmark, driving the real RedisMgr API.
+Without --host it starts the loopback RespServer, so the whole client stack can
+be measured on a machine without redis.
+
+redisfmt-bench [--host=127.0.0.1 --port=6379 --auth=...] [--threads=4]
+    [--connections=4] [--pipeline=1] [--requests=200000] [--keys=10000]
+    [--value-size=64] [--mix=get:50,set:30,hgetall:10,zadd:10]
+
+Commands of the mix: get set hget hset hgetall hmget incrby sadd sismember zadd
+zscore zrevrange. With --pipeline above 1 a batch is sent with RedisPipeline and
+each command in it is recorded with the latency of the whole batch.
+*/
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "redisfmt/redisfmt.hpp"
+#include "resp_server.hpp"
+
+using namespace rdsfmt;
+
+enum class Op { GET, SET, HGET, HSET, HGETALL, HMGET, INCRBY, SADD, SISMEMBER, ZADD, ZSCORE, ZREVRANGE };
+
+static const std::pair<const char*, Op> kOps[] = {
+    { "get", Op::GET }, { "set", Op::SET }, { "hget", Op::HGET }, { "hset", Op::HSET },
+    { "hgetall", Op::HGETALL }, { "hmget", Op::HMGET }, { "incrby", Op::INCRBY }, { "sadd", Op::SADD },
+    { "sismember", Op::SISMEMBER }, { "zadd", Op::ZADD }, { "zscore", Op::ZSCORE }, { "zrevrange", Op::ZREVRANGE },
+};
+
+struct Options {
+    std::string host;
+    int port = 6379;
+    std::string auth;
+    int threads = 4;
+    int connections = 4;
+    int pipeline = 1;
+    long long requests = 200000;
+    long long keys = 10000;
+    size_t value_size = 64;
+    std::vector<std::pair<Op, int>> mix;
+};
+
+static const char* OpName(Op op) {
+    for (auto& [name, value] : kOps) {
+        if (value == op)
+            return name;
+    }
+    return "?";
+}
+
+static bool ParseMix(const std::string& text, std::vector<std::pair<Op, int>>& mix) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find(',', pos);
+        std::string item = text.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        pos = end == std::string::npos ? text.size() : end + 1;
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        int weight = colon == std::string::npos ? 1 : std::atoi(item.c_str() + colon + 1);
+        bool found = false;
+        for (auto& [op_name, op] : kOps) {
+            if (name == op_name) {
+                mix.emplace_back(op, weight);
+                found = true;
+            }
+        }
+        if (!found || weight <= 0) {
+            fprintf(stderr, "bad mix entry: %s\n", item.c_str());
+            return false;
+        }
+    }
+    return !mix.empty();
+}
+
+static bool ParseArgs(int argc, char** argv, Options& options) {
+    std::string mix = "get:50,set:30,hgetall:10,zadd:10";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (name == "--host") options.host = value;
+        else if (name == "--port") options.port = std::atoi(value.c_str());
+        else if (name == "--auth") options.auth = value;
+        else if (name == "--threads") options.threads = std::max(std::atoi(value.c_str()), 1);
+        else if (name == "--connections") options.connections = std::max(std::atoi(value.c_str()), 1);
+        else if (name == "--pipeline") options.pipeline = std::max(std::atoi(value.c_str()), 1);
+        else if (name == "--requests") options.requests = std::max(std::atoll(value.c_str()), 1LL);
+        else if (name == "--keys") options.keys = std::max(std::atoll(value.c_str()), 1LL);
+        else if (name == "--value-size") options.value_size = static_cast<size_t>(std::max(std::atoll(value.c_str()), 1LL));
+        else if (name == "--mix") mix = value;
+        else {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return ParseMix(mix, options.mix);
+}
+
+// queue or run one command, C is RedisMgr or RedisPipeline
+template <typename C>
+auto Issue(C& c, Op op, long long n, const std::string& value) {
+    // one prefix per type, a real server answers WRONGTYPE otherwise
+    const char* prefix = "string";
+    if (op == Op::HGET || op == Op::HSET || op == Op::HGETALL || op == Op::HMGET)
+        prefix = "hash";
+    else if (op == Op::SADD || op == Op::SISMEMBER)
+        prefix = "set";
+    else if (op == Op::ZADD || op == Op::ZSCORE || op == Op::ZREVRANGE)
+        prefix = "zset";
+    else if (op == Op::INCRBY)
+        prefix = "counter";
+    char key[32];
+    auto len = fmt::format_to_n(key, sizeof(key), "{}:{}", prefix, n).size;
+    std::string_view k(key, std::min(len, sizeof(key)));
+    char field[16];
+    auto flen = fmt::format_to_n(field, sizeof(field), "f{}", n % 8).size;
+    std::string_view f(field, std::min(flen, sizeof(field)));
+
+    using R = decltype(c.INCRBY(k, 1));
+    auto error = [](const auto& result) {
+        if constexpr (std::is_same_v<R, tl::expected<int64_t, int>>)
+            return result ? 0 : result.error();
+        else
+            return 0;
+    };
+    switch (op) {
+    case Op::GET: return error(c.template GET<std::string>(k));
+    case Op::SET: return error(c.SET(k, value));
+    case Op::HGET: return error(c.template HGET<std::string>(k, f));
+    case Op::HSET: return error(c.HSET(k, f, value));
+    case Op::HGETALL: return error(c.template HGETALL<std::map<std::string, std::string>>(k));
+    case Op::HMGET: return error(c.HMGET(k, "f0", "f1", "f2", "f3"));
+    case Op::INCRBY: return error(c.INCRBY(k, 1));
+    case Op::SADD: return error(c.SADD(k, f));
+    case Op::SISMEMBER: return error(c.SISMEMBER(k, f));
+    case Op::ZADD: return error(c.ZADD(k, n % 1000, f));
+    case Op::ZSCORE: return error(c.template ZSCORE<double>(k, f));
+    case Op::ZREVRANGE: return error(c.template ZREVRANGE<double>(k, 0, 9));
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!ParseArgs(argc, argv, options))
+        return 1;
+
+    bench::RespServer server;
+    if (options.host.empty()) {
+        options.host = "127.0.0.1";
+        options.port = server.Start();
+        if (options.port < 0) {
+            fprintf(stderr, "can not start the loopback server\n");
+            return 1;
+        }
+        printf("loopback server on port %d\n", options.port);
+    }
+
+    RedisInitParam param;
+    param.host = options.host;
+    param.port = options.port;
+    param.auth = options.auth;
+    param.context_count = options.connections;
+    param.checkout_timeout = 1000;
+    param.slow_log_threshold = 0;
+    RedisMgr mgr;
+    if (mgr.Initialize(param) != 0) {
+        fprintf(stderr, "can not connect to %s:%d\n", options.host.c_str(), options.port);
+        return 1;
+    }
+
+    std::vector<Op> table;
+    for (auto& [op, weight] : options.mix)
+        table.insert(table.end(), static_cast<size_t>(weight), op);
+    std::string value(options.value_size, 'x');
+
+    // fill the keyspace with every type of the mix so reads hit
+    {
+        auto pipeline = mgr.Pipeline();
+        for (long long n = 0; n < options.keys; n++) {
+            for (auto& [op, weight] : options.mix) {
+                Op fill = op == Op::GET ? Op::SET : op == Op::HGET || op == Op::HGETALL || op == Op::HMGET ? Op::HSET
+                    : op == Op::SISMEMBER ? Op::SADD : op == Op::ZSCORE || op == Op::ZREVRANGE ? Op::ZADD : op;
+                if (fill != Op::INCRBY)
+                    Issue(pipeline, fill, n, value);
+            }
+            if (n % 1000 == 999 && pipeline.Exec() != 0) {
+                fprintf(stderr, "preload failed\n");
+                return 1;
+            }
+        }
+        pipeline.Exec();
+    }
+
+    RedisMetrics metrics;
+    std::atomic<long long> remaining{ options.requests };
+    std::atomic<long long> errors{ 0 };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < options.threads; t++) {
+        threads.emplace_back([&, t] {
+            std::mt19937_64 rng(static_cast<uint64_t>(t) * 7919 + 1);
+            std::uniform_int_distribution<long long> key(0, options.keys - 1);
+            std::uniform_int_distribution<size_t> pick(0, table.size() - 1);
+            std::vector<Op> batch;
+            for (;;) {
+                long long n = remaining.fetch_sub(options.pipeline);
+                if (n <= 0)
+                    break;
+                size_t depth = static_cast<size_t>(std::min<long long>(n, options.pipeline));
+                batch.clear();
+                for (size_t i = 0; i < depth; i++)
+                    batch.push_back(table[pick(rng)]);
+
+                auto begin = std::chrono::steady_clock::now();
+                if (depth == 1) {
+                    int error = Issue(mgr, batch[0], key(rng), value);
+                    metrics.Record(OpName(batch[0]), std::chrono::steady_clock::now() - begin, 0, 0,
+                        error == REDIS_REPLY_NIL ? 0 : error);
+                    if (error != 0 && error != REDIS_REPLY_NIL)
+                        errors++;
+                    continue;
+                }
+                auto pipeline = mgr.Pipeline();
+                for (Op op : batch)
+                    Issue(pipeline, op, key(rng), value);
+                int error = pipeline.Exec();
+                auto latency = std::chrono::steady_clock::now() - begin;
+                for (Op op : batch)
+                    metrics.Record(OpName(op), latency, 0, 0, error);
+                if (error != 0)
+                    errors += static_cast<long long>(depth);
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%lld requests in %.2fs, %.0f requests/s, %lld errors\n", options.requests, seconds,
+        static_cast<double>(options.requests) / seconds, errors.load());
+    printf("threads=%d connections=%d pipeline=%d keys=%lld value=%zuB\n", options.threads, options.connections,
+        options.pipeline, options.keys, options.value_size);
+    printf("%s", metrics.Snapshot().Format().c_str());
+    mgr.UnInit();
+    return 0;
+}
@@ -0,0 +1,357 @@
+#ifndef __REDISFMT_BENCH_RESP_SERVER_H__
+#define __REDISFMT_BENCH_RESP_SERVER_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <charconv>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace rdsfmt {
+namespace bench {
+
+/*
+A loopback stand-in for redis, enough of it to load test the client without a
+server: strings, hashes, sets and sorted sets in memory, no expiry, no
+persistence. One thread per connection, pipelined requests are answered with one
+write. The keyspace is split over shards with their own lock so the server
+scales with the client threads instead of becoming the bottleneck.
+*/
+class RespServer {
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::string> strings;
+        std::unordered_map<std::string, std::map<std::string, std::string>> hashes;
+        std::unordered_map<std::string, std::set<std::string>> sets;
+        std::unordered_map<std::string, std::map<std::string, double>> zsets;
+    };
+    static constexpr size_t kShards = 64;
+
+public:
+    ~RespServer() { Stop(); }
+
+    // listen on 127.0.0.1, port 0 picks a free one, returns the port or -1
+    int Start(int port = 0) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0)
+            return -1;
+        int one = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        socklen_t len = sizeof(addr);
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd_, 128) != 0 ||
+            getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+            close(listen_fd_);
+            listen_fd_ = -1;
+            return -1;
+        }
+        running_ = true;
+        acceptor_ = std::thread([this] { Accept(); });
+        return ntohs(addr.sin_port);
+    }
+
+    void Stop() {
+        if (!running_.exchange(false))
+            return;
+        shutdown(listen_fd_, SHUT_RDWR);
+        close(listen_fd_);
+        acceptor_.join();
+        // Serve() takes mutex_ on its way out, the workers are joined without it. The
+        // shutdowns stay under it, a client closed by Serve() may have its fd reused
+        std::vector<std::thread> workers;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (int fd : clients_) {
+                if (fd >= 0)
+                    shutdown(fd, SHUT_RDWR);
+            }
+            clients_.clear();
+            workers.swap(workers_);
+        }
+        for (auto& t : workers)
+            t.join();
+    }
+
+private:
+    void Accept() {
+        while (running_) {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_) {
+                close(fd);
+                break;
+            }
+            clients_.push_back(fd);
+            workers_.emplace_back([this, fd] { Serve(fd); });
+        }
+    }
+
+    void Serve(int fd) {
+        std::string in;
+        std::string out;
+        std::vector<std::string_view> argv;
+        char buf[64 * 1024];
+        for (;;) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0)
+                break;
+            in.append(buf, static_cast<size_t>(n));
+            size_t pos = 0;
+            while (Parse(in, pos, argv))
+                Execute(argv, out);
+            in.erase(0, pos);
+            if (!out.empty() && !WriteAll(fd, out))
+                break;
+            out.clear();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& client : clients_) {
+            if (client == fd)
+                client = -1;
+        }
+        close(fd);
+    }
+
+    static bool WriteAll(int fd, const std::string& data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = write(fd, data.data() + done, data.size() - done);
+            if (n <= 0)
+                return false;
+            done += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // one complete "*argc\r\n$len\r\narg\r\n..." request starting at pos, false when more bytes are needed
+    static bool Parse(const std::string& in, size_t& pos, std::vector<std::string_view>& argv) {
+        argv.clear();
+        size_t p = pos;
+        long long argc = 0;
+        if (!Line(in, p, '*', argc))
+            return false;
+        for (long long i = 0; i < argc; i++) {
+            long long len = 0;
+            if (!Line(in, p, '$', len) || in.size() < p + static_cast<size_t>(len) + 2)
+                return false;
+            argv.emplace_back(in.data() + p, static_cast<size_t>(len));
+            p += static_cast<size_t>(len) + 2;
+        }
+        pos = p;
+        return true;
+    }
+
+    static bool Line(const std::string& in, size_t& p, char type, long long& value) {
+        size_t end = in.find("\r\n", p);
+        if (end == std::string::npos || p >= in.size() || in[p] != type)
+            return false;
+        std::from_chars(in.data() + p + 1, in.data() + end, value);
+        p = end + 2;
+        return true;
+    }
+
+    static void Status(std::string& out, std::string_view s) { out.append("+").append(s).append("\r\n"); }
+    static void Error(std::string& out, std::string_view s) { out.append("-").append(s).append("\r\n"); }
+    static void Nil(std::string& out) { out.append("$-1\r\n"); }
+    static void Integer(std::string& out, long long v) { out.append(":").append(std::to_string(v)).append("\r\n"); }
+    static void Array(std::string& out, size_t n) { out.append("*").append(std::to_string(n)).append("\r\n"); }
+    static void Bulk(std::string& out, std::string_view s) {
+        out.append("$").append(std::to_string(s.size())).append("\r\n").append(s).append("\r\n");
+    }
+    static void Double(std::string& out, double v) {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "%.17g", v);
+        Bulk(out, std::string_view(buf, static_cast<size_t>(n)));
+    }
+
+    Shard& ShardOf(std::string_view key) { return shards_[std::hash<std::string_view>{}(key) % kShards]; }
+
+    static bool Is(std::string_view a, std::string_view b) {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); i++) {
+            if (toupper(static_cast<unsigned char>(a[i])) != b[i])
+                return false;
+        }
+        return true;
+    }
+
+    void Execute(const std::vector<std::string_view>& argv, std::string& out) {
+        if (argv.empty())
+            return Error(out, "ERR empty command");
+        std::string_view cmd = argv[0];
+        size_t argc = argv.size();
+        if (Is(cmd, "PING"))
+            return Status(out, "PONG");
+        if (Is(cmd, "AUTH") || Is(cmd, "SELECT") || Is(cmd, "ASKING"))
+            return Status(out, "OK");
+        if (argc < 2)
+            return Error(out, "ERR wrong number of arguments");
+
+        std::string key(argv[1]);
+        Shard& shard = ShardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (Is(cmd, "GET")) {
+            auto it = shard.strings.find(key);
+            return it == shard.strings.end() ? Nil(out) : Bulk(out, it->second);
+        }
+        if (Is(cmd, "SET") && argc >= 3) {
+            shard.strings[key] = std::string(argv[2]);
+            return Status(out, "OK");
+        }
+        if (Is(cmd, "INCRBY") && argc >= 3) {
+            long long value = 0, by = 0;
+            auto& str = shard.strings[key];
+            std::from_chars(str.data(), str.data() + str.size(), value);
+            std::from_chars(argv[2].data(), argv[2].data() + argv[2].size(), by);
+            str = std::to_string(value + by);
+            return Integer(out, value + by);
+        }
+        if (Is(cmd, "DEL") || Is(cmd, "EXISTS")) {
+            // keys of other shards would need their locks, the bench only sends one key
+            bool found = shard.strings.count(key) || shard.hashes.count(key) || shard.sets.count(key) || shard.zsets.count(key);
+            if (Is(cmd, "DEL")) {
+                shard.strings.erase(key);
+                shard.hashes.erase(key);
+                shard.sets.erase(key);
+                shard.zsets.erase(key);
+            }
+            return Integer(out, found ? 1 : 0);
+        }
+        if (Is(cmd, "EXPIRE"))
+            return Integer(out, 1);
+        if (Is(cmd, "TTL"))
+            return Integer(out, -1);
+        if (Is(cmd, "HSET") && argc >= 4 && argc % 2 == 0) {
+            auto& hash = shard.hashes[key];
+            long long added = 0;
+            for (size_t i = 2; i + 1 < argc; i += 2)
+                added += hash.insert_or_assign(std::string(argv[i]), std::string(argv[i + 1])).second ? 1 : 0;
+            return Integer(out, added);
+        }
+        if (Is(cmd, "HGET") && argc >= 3) {
+            auto it = shard.hashes.find(key);
+            if (it == shard.hashes.end())
+                return Nil(out);
+            auto field = it->second.find(std::string(argv[2]));
+            return field == it->second.end() ? Nil(out) : Bulk(out, field->second);
+        }
+        if (Is(cmd, "HMGET")) {
+            auto it = shard.hashes.find(key);
+            Array(out, argc - 2);
+            for (size_t i = 2; i < argc; i++) {
+                if (it == shard.hashes.end()) {
+                    Nil(out);
+                    continue;
+                }
+                auto field = it->second.find(std::string(argv[i]));
+                if (field == it->second.end())
+                    Nil(out);
+                else
+                    Bulk(out, field->second);
+            }
+            return;
+        }
+        if (Is(cmd, "HGETALL")) {
+            auto it = shard.hashes.find(key);
+            if (it == shard.hashes.end())
+                return Array(out, 0);
+            Array(out, it->second.size() * 2);
+            for (auto& [field, value] : it->second) {
+                Bulk(out, field);
+                Bulk(out, value);
+            }
+            return;
+        }
+        if (Is(cmd, "SADD")) {
+            auto& set = shard.sets[key];
+            long long added = 0;
+            for (size_t i = 2; i < argc; i++)
+                added += set.insert(std::string(argv[i])).second ? 1 : 0;
+            return Integer(out, added);
+        }
+        if (Is(cmd, "SISMEMBER") && argc >= 3) {
+            auto it = shard.sets.find(key);
+            return Integer(out, it != shard.sets.end() && it->second.count(std::string(argv[2])) ? 1 : 0);
+        }
+        if (Is(cmd, "ZADD") && argc >= 4 && argc % 2 == 0) {
+            auto& zset = shard.zsets[key];
+            long long added = 0;
+            for (size_t i = 2; i + 1 < argc; i += 2) {
+                double score = 0;
+                std::from_chars(argv[i].data(), argv[i].data() + argv[i].size(), score);
+                added += zset.insert_or_assign(std::string(argv[i + 1]), score).second ? 1 : 0;
+            }
+            return Integer(out, added);
+        }
+        if (Is(cmd, "ZSCORE") && argc >= 3) {
+            auto it = shard.zsets.find(key);
+            if (it == shard.zsets.end())
+                return Nil(out);
+            auto member = it->second.find(std::string(argv[2]));
+            return member == it->second.end() ? Nil(out) : Double(out, member->second);
+        }
+        if (Is(cmd, "ZCARD")) {
+            auto it = shard.zsets.find(key);
+            return Integer(out, it == shard.zsets.end() ? 0 : static_cast<long long>(it->second.size()));
+        }
+        if (Is(cmd, "ZREVRANGE") && argc >= 4) {
+            std::vector<std::pair<double, std::string_view>> sorted;
+            if (auto it = shard.zsets.find(key); it != shard.zsets.end()) {
+                for (auto& [member, score] : it->second)
+                    sorted.emplace_back(score, member);
+            }
+            std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a > b; });
+            long long start = 0, stop = 0, n = static_cast<long long>(sorted.size());
+            std::from_chars(argv[2].data(), argv[2].data() + argv[2].size(), start);
+            std::from_chars(argv[3].data(), argv[3].data() + argv[3].size(), stop);
+            if (start < 0) start = std::max(n + start, 0LL);
+            if (stop < 0) stop = n + stop;
+            stop = std::min(stop, n - 1);
+            bool scores = argc >= 5 && Is(argv[4], "WITHSCORES");
+            long long count = start <= stop ? stop - start + 1 : 0;
+            Array(out, static_cast<size_t>(count) * (scores ? 2 : 1));
+            for (long long i = start; i <= stop; i++) {
+                Bulk(out, sorted[static_cast<size_t>(i)].second);
+                if (scores)
+                    Double(out, sorted[static_cast<size_t>(i)].first);
+            }
+            return;
+        }
+        Error(out, "ERR unknown command");
+    }
+
+    int listen_fd_ = -1;
+    std::atomic<bool> running_{ false };
+    std::thread acceptor_;
+    std::mutex mutex_;
+    std::vector<int> clients_;
+    std::vector<std::thread> workers_;
+    Shard shards_[kShards];
+};
+
+}
+}
+
+#endif // !__REDISFMT_BENCH_RESP_SERVER_H__
@@ -0,0 +1,575 @@
+#ifndef __REDISFMT_ASYNC_H__
+#define __REDISFMT_ASYNC_H__
+
+#include <future>
+#include <unordered_set>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "async.h"
+
+#include "redisfmt/redisfmt.hpp"
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define REDISFMT_HAS_COROUTINE 1
+#endif
+
+namespace rdsfmt {
+
+/*
+A single threaded epoll loop that drives redisAsyncContext, it plays the part of
+the adapters shipped with hiredis (ae, libevent...). Everything attached to the
+loop is only touched from the loop thread, other threads hand work over with
+Post().
+*/
+class RedisEpollLoop {
+    struct Events {
+        RedisEpollLoop* loop = nullptr;
+        redisAsyncContext* ac = nullptr;
+        int fd = -1;
+        uint32_t mask = 0;
+        bool registered = false;
+        bool timer_set = false;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    struct Timer {
+        std::chrono::steady_clock::time_point deadline;
+        std::function<void()> task;
+    };
+
+public:
+    RedisEpollLoop() {}
+    ~RedisEpollLoop() { Stop(); }
+    RedisEpollLoop(const RedisEpollLoop&) = delete;
+    RedisEpollLoop& operator=(const RedisEpollLoop&) = delete;
+
+    int Start() {
+        epfd_ = epoll_create1(EPOLL_CLOEXEC);
+        wakefd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epfd_ < 0 || wakefd_ < 0) {
+            LOG_ERROR("%s: epoll/eventfd failed, errno[%d]", __FUNCTION__, errno);
+            Close();
+            return -1;
+        }
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev);
+
+        stop_ = false;
+        thread_ = std::thread([this] { Run(); });
+        return 0;
+    }
+
+    // run the tasks posted so far and stop the loop thread
+    void Stop() {
+        if (!thread_.joinable())
+            return;
+        Post([this] { stop_ = true; });
+        thread_.join();
+        Close();
+    }
+
+    void Post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        uint64_t one = 1;
+        [[maybe_unused]] auto n = write(wakefd_, &one, sizeof(one));
+    }
+
+    // loop thread only
+    void RunAfter(std::chrono::milliseconds delay, std::function<void()> task) {
+        timers_.push_back({ std::chrono::steady_clock::now() + delay, std::move(task) });
+    }
+
+    bool InLoopThread() const { return std::this_thread::get_id() == thread_.get_id(); }
+
+    // loop thread only, hook the context into the loop like the hiredis adapters do
+    int Attach(redisAsyncContext* ac) {
+        if (ac->ev.data != nullptr)
+            return REDIS_ERR;
+
+        auto events = new Events();
+        events->loop = this;
+        events->ac = ac;
+        events->fd = ac->c.fd;
+        live_.insert(events);
+
+        ac->ev.data = events;
+        ac->ev.addRead = [](void* data) { Update(data, EPOLLIN, true); };
+        ac->ev.delRead = [](void* data) { Update(data, EPOLLIN, false); };
+        ac->ev.addWrite = [](void* data) { Update(data, EPOLLOUT, true); };
+        ac->ev.delWrite = [](void* data) { Update(data, EPOLLOUT, false); };
+        ac->ev.cleanup = [](void* data) {
+            auto events = static_cast<Events*>(data);
+            events->mask = 0;
+            Update(data, 0, false);
+            events->loop->live_.erase(events);
+            // events of the current epoll_wait batch may still point to it
+            events->loop->retired_.push_back(events);
+        };
+        ac->ev.scheduleTimer = [](void* data, struct timeval tv) {
+            auto events = static_cast<Events*>(data);
+            events->timer_set = true;
+            events->deadline = std::chrono::steady_clock::now() +
+                std::chrono::seconds(tv.tv_sec) + std::chrono::microseconds(tv.tv_usec);
+        };
+        return REDIS_OK;
+    }
+
+private:
+    static void Update(void* data, uint32_t flag, bool add) {
+        auto events = static_cast<Events*>(data);
+        uint32_t mask = add ? (events->mask | flag) : (events->mask & ~flag);
+        if (mask == events->mask && (mask != 0 || !events->registered))
+            return;
+        events->mask = mask;
+
+        struct epoll_event ev = {};
+        ev.events = mask;
+        ev.data.ptr = events;
+        int epfd = events->loop->epfd_;
+        if (mask == 0) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, events->fd, &ev);
+            events->registered = false;
+        }
+        else if (events->registered) {
+            epoll_ctl(epfd, EPOLL_CTL_MOD, events->fd, &ev);
+        }
+        else {
+            epoll_ctl(epfd, EPOLL_CTL_ADD, events->fd, &ev);
+            events->registered = true;
+        }
+    }
+
+    void Run() {
+        constexpr int kMaxEvents = 128;
+        struct epoll_event evs[kMaxEvents];
+        while (!stop_) {
+            int n = epoll_wait(epfd_, evs, kMaxEvents, NextTimeout());
+            for (int i = 0; i < n; i++) {
+                auto events = static_cast<Events*>(evs[i].data.ptr);
+                if (!events) {
+                    uint64_t count;
+                    [[maybe_unused]] auto r = read(wakefd_, &count, sizeof(count));
+                    continue;
+                }
+                if (!live_.count(events))
+                    continue;
+                if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    redisAsyncHandleRead(events->ac);
+                if (live_.count(events) && (evs[i].events & EPOLLOUT))
+                    redisAsyncHandleWrite(events->ac);
+            }
+            RunTasks();
+            RunTimers();
+            for (auto events : retired_)
+                delete events;
+            retired_.clear();
+        }
+    }
+
+    void RunTasks() {
+        std::vector<std::function<void()>> tasks;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks.swap(tasks_);
+        }
+        for (auto& task : tasks)
+            task();
+    }
+
+    void RunTimers() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto events : std::vector<Events*>(live_.begin(), live_.end())) {
+            if (live_.count(events) && events->timer_set && events->deadline <= now) {
+                events->timer_set = false;
+                redisAsyncHandleTimeout(events->ac);
+            }
+        }
+        std::vector<Timer> due;
+        for (auto it = timers_.begin(); it != timers_.end();) {
+            if (it->deadline <= now) {
+                due.push_back(std::move(*it));
+                it = timers_.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        for (auto& timer : due)
+            timer.task();
+    }
+
+    int NextTimeout() const {
+        auto now = std::chrono::steady_clock::now();
+        auto next = now + std::chrono::seconds(1);
+        for (auto events : live_) {
+            if (events->timer_set)
+                next = std::min(next, events->deadline);
+        }
+        for (auto& timer : timers_)
+            next = std::min(next, timer.deadline);
+        if (next <= now)
+            return 0;
+        return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count()) + 1;
+    }
+
+    void Close() {
+        if (epfd_ >= 0)
+            close(epfd_);
+        if (wakefd_ >= 0)
+            close(wakefd_);
+        epfd_ = wakefd_ = -1;
+    }
+
+    int epfd_ = -1;
+    int wakefd_ = -1;
+    bool stop_ = false;
+    std::thread thread_;
+
+    std::mutex mutex_;
+    std::vector<std::function<void()>> tasks_;
+
+    std::unordered_set<Events*> live_;
+    std::vector<Events*> retired_;
+    std::vector<Timer> timers_;
+};
+
+namespace detail {
+struct AsyncRequestBase {
+    virtual ~AsyncRequestBase() {}
+    // reply is null when the command could not be sent or the connection dropped
+    virtual void Complete(redisReply* reply) = 0;
+
+    fmt::memory_buffer command;
+};
+
+template <typename T, typename F>
+struct AsyncRequest : AsyncRequestBase {
+    template <typename U>
+    explicit AsyncRequest(U&& f) : callback(std::forward<U>(f)) {}
+
+    void Complete(redisReply* reply) override {
+        if (!reply) {
+            callback(tl::unexpected{ -1 });
+            return;
+        }
+        callback(GetFromReply<T>(reply));
+    }
+
+    F callback;
+};
+}
+
+#ifdef REDISFMT_HAS_COROUTINE
+class AsyncRedisCoroutine;
+#endif
+
+/*
+Non-blocking counterpart of RedisMgr on redisAsyncContext. It has the same typed
+command surface, every command returns a std::future<tl::expected<T, int>> and
+is decoded through GetFromReply<T>. All the contexts are driven by one
+RedisEpollLoop thread, so a single thread keeps any number of commands in
+flight:
+
+    AsyncRedisMgr mgr;
+    mgr.Initialize(param);
+    auto name = mgr.HGET<std::string>("user:1", "name");
+    auto visits = mgr.HINCRBY("user:1", "visits", 1);
+    fmt::print("{} {}\n", name.get().value_or(""), visits.get().value_or(0));
+
+Callbacks given to Submit() and coroutines resumed through Co() run on the loop
+thread and must not block.
+*/
+class AsyncRedisMgr : public RedisCommands<AsyncRedisMgr> {
+    struct Connection {
+        AsyncRedisMgr* mgr = nullptr;
+        redisAsyncContext* ac = nullptr;
+    };
+
+public:
+    AsyncRedisMgr() {}
+    virtual ~AsyncRedisMgr() {
+        UnInit();
+    }
+
+    int Initialize(const RedisInitParam& param) {
+        if (param.use_ssl) {
+            LOG_ERROR("%s: ssl is not supported", __FUNCTION__);
+            return -1;
+        }
+        param_ = param;
+        if (loop_.Start() != 0)
+            return -1;
+
+        int count = std::max(param.context_count, 1);
+        for (int i = 0; i < count; i++) {
+            conns_.emplace_back(std::make_unique<Connection>());
+            conns_.back()->mgr = this;
+        }
+        loop_.Post([this] {
+            for (auto& conn : conns_)
+                Connect(*conn);
+        });
+        running_ = true;
+        return 0;
+    }
+
+    void UnInit() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_)
+                return;
+            running_ = false;
+        }
+        loop_.Post([this] {
+            stopping_ = true;
+            Drain();
+            // pending callbacks are called with a null reply
+            for (auto& conn : conns_) {
+                if (conn->ac)
+                    redisAsyncFree(std::exchange(conn->ac, nullptr));
+            }
+        });
+        loop_.Stop();
+        conns_.clear();
+    }
+
+    template <typename T, typename Cmd, typename... Args>
+    std::future<tl::expected<T, int>> ExcuteCommand(const Cmd& cmd, const Args&... args) {
+        auto promise = std::make_shared<std::promise<tl::expected<T, int>>>();
+        auto future = promise->get_future();
+        Submit<T>([promise](tl::expected<T, int> result) { promise->set_value(std::move(result)); },
+            cmd, args...);
+        return future;
+    }
+
+    // callback flavour of ExcuteCommand, callback runs on the loop thread
+    template <typename T, typename F, typename Cmd, typename... Args>
+    void Submit(F&& callback, const Cmd& cmd, const Args&... args) {
+        static_assert(!detail::is_reply_view<T>::value && !detail::is_borrowed<T>::value,
+            "async replies are freed once decoded, views into them are not supported.");
+        fmt::memory_buffer command;
+        detail::RespWriter(command).Command(cmd, args...);
+        SubmitEncoded<T>(std::forward<F>(callback), std::move(command));
+    }
+
+    // command is already RESP encoded, see detail::RespWriter
+    template <typename T, typename F>
+    void SubmitEncoded(F&& callback, fmt::memory_buffer&& command) {
+        auto request = std::make_unique<detail::AsyncRequest<T, std::decay_t<F>>>(std::forward<F>(callback));
+        request->command = std::move(command);
+        Enqueue(std::move(request));
+    }
+
+#ifdef REDISFMT_HAS_COROUTINE
+    // the typed commands as awaitables: co_await mgr.Co().GET<std::string>("key")
+    AsyncRedisCoroutine Co();
+#endif
+
+private:
+    void Enqueue(std::unique_ptr<detail::AsyncRequestBase> request) {
+        bool wake = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_) {
+                request->Complete(nullptr);
+                return;
+            }
+            wake = pending_.empty();
+            pending_.push_back(std::move(request));
+        }
+        // one wakeup per batch, the loop drains everything queued until then
+        if (wake)
+            loop_.Post([this] { Drain(); });
+    }
+
+    // loop thread
+    void Drain() {
+        std::vector<std::unique_ptr<detail::AsyncRequestBase>> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending.swap(pending_);
+        }
+        for (auto& request : pending) {
+            redisAsyncContext* ac = stopping_ ? nullptr : NextContext();
+            if (!ac) {
+                request->Complete(nullptr);
+                continue;
+            }
+            auto raw = request.release();
+            if (redisAsyncFormattedCommand(ac, OnReply, raw, raw->command.data(), raw->command.size()) != REDIS_OK) {
+                LOG_ERROR("%s: send failed, %s", __FUNCTION__, ac->errstr ? ac->errstr : "");
+                raw->Complete(nullptr);
+                delete raw;
+            }
+        }
+    }
+
+    redisAsyncContext* NextContext() {
+        for (size_t i = 0; i < conns_.size(); i++) {
+            auto& conn = conns_[next_++ % conns_.size()];
+            if (conn->ac)
+                return conn->ac;
+        }
+        return nullptr;
+    }
+
+    static void OnReply(redisAsyncContext*, void* reply, void* privdata) {
+        std::unique_ptr<detail::AsyncRequestBase> request(static_cast<detail::AsyncRequestBase*>(privdata));
+        request->Complete(static_cast<redisReply*>(reply));
+    }
+
+    // loop thread, commands sent before the connection is up are buffered by hiredis
+    void Connect(Connection& conn) {
+        redisOptions options = {};
+        REDIS_OPTIONS_SET_TCP(&options, param_.host.c_str(), param_.port);
+        struct timeval tv;
+        if (param_.connect_timeout > 0) {
+            tv.tv_sec = param_.connect_timeout / 1000;
+            tv.tv_usec = (param_.connect_timeout % 1000) * 1000;
+            options.connect_timeout = &tv;
+        }
+        redisAsyncContext* ac = redisAsyncConnectWithOptions(&options);
+        if (!ac || ac->err) {
+            LOG_ERROR("%s: connect %s:%d failed, %s", __FUNCTION__, param_.host.c_str(), param_.port,
+                ac ? ac->errstr : "can't allocate redis context");
+            if (ac)
+                redisAsyncFree(ac);
+            ScheduleReconnect(conn);
+            return;
+        }
+        ac->data = &conn;
+        loop_.Attach(ac);
+        redisAsyncSetConnectCallback(ac, OnConnect);
+        redisAsyncSetDisconnectCallback(ac, OnDisconnect);
+        conn.ac = ac;
+
+        if (!param_.auth.empty()) {
+            fmt::memory_buffer buf;
+            detail::RespWriter(buf).Command("AUTH", param_.auth);
+            redisAsyncFormattedCommand(ac, OnSetupReply, nullptr, buf.data(), buf.size());
+        }
+        if (param_.db_index != 0) {
+            fmt::memory_buffer buf;
+            detail::RespWriter(buf).Command("SELECT", param_.db_index);
+            redisAsyncFormattedCommand(ac, OnSetupReply, nullptr, buf.data(), buf.size());
+        }
+        if (param_.protocol == 3) {
+            fmt::memory_buffer buf;
+            detail::RespWriter(buf).Command("HELLO", 3);
+            redisAsyncFormattedCommand(ac, OnSetupReply, nullptr, buf.data(), buf.size());
+        }
+    }
+
+    void ScheduleReconnect(Connection& conn) {
+        if (stopping_)
+            return;
+        loop_.RunAfter(std::chrono::milliseconds(kReconnectInterval), [this, &conn] {
+            if (!stopping_ && !conn.ac)
+                Connect(conn);
+        });
+    }
+
+    static void OnSetupReply(redisAsyncContext*, void* reply, void*) {
+        auto r = static_cast<redisReply*>(reply);
+        if (r && r->type == REDIS_REPLY_ERROR) {
+            LOG_ERROR("AsyncRedisMgr: AUTH/SELECT/HELLO failed, %s", r->str);
+        }
+    }
+
+    // hiredis frees the context after both callbacks
+    static void OnConnect(const redisAsyncContext* ac, int status) {
+        if (status == REDIS_OK)
+            return;
+        auto conn = static_cast<Connection*>(ac->data);
+        LOG_ERROR("AsyncRedisMgr: connect failed, %s", ac->errstr ? ac->errstr : "");
+        conn->ac = nullptr;
+        conn->mgr->ScheduleReconnect(*conn);
+    }
+
+    static void OnDisconnect(const redisAsyncContext* ac, int status) {
+        auto conn = static_cast<Connection*>(ac->data);
+        if (status != REDIS_OK) {
+            LOG_ERROR("AsyncRedisMgr: disconnected, %s", ac->errstr ? ac->errstr : "");
+        }
+        conn->ac = nullptr;
+        conn->mgr->ScheduleReconnect(*conn);
+    }
+
+    static constexpr int kReconnectInterval = 1000;
+
+    RedisInitParam param_;
+    RedisEpollLoop loop_;
+    std::vector<std::unique_ptr<Connection>> conns_;
+    size_t next_ = 0;
+    bool stopping_ = false;
+
+    std::mutex mutex_;
+    bool running_ = false;
+    std::vector<std::unique_ptr<detail::AsyncRequestBase>> pending_;
+};
+
+#ifdef REDISFMT_HAS_COROUTINE
+/*
+co_await on a command sends it and suspends the coroutine until the reply is
+decoded, the coroutine is resumed on the loop thread of the AsyncRedisMgr.
+Nothing is sent for an awaitable that is never awaited.
+*/
+template <typename T>
+class RedisAwaitable {
+public:
+    explicit RedisAwaitable(AsyncRedisMgr& mgr) : mgr_(mgr) {}
+
+    template <typename Cmd, typename... Args>
+    void Prepare(const Cmd& cmd, const Args&... args) {
+        detail::RespWriter(command_).Command(cmd, args...);
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        mgr_.SubmitEncoded<T>([this, handle](tl::expected<T, int> result) {
+            result_ = std::move(result);
+            handle.resume();
+        }, std::move(command_));
+    }
+
+    tl::expected<T, int> await_resume() { return std::move(*result_); }
+
+private:
+    AsyncRedisMgr& mgr_;
+    fmt::memory_buffer command_;
+    std::optional<tl::expected<T, int>> result_;
+};
+
+class AsyncRedisCoroutine : public RedisCommands<AsyncRedisCoroutine> {
+public:
+    explicit AsyncRedisCoroutine(AsyncRedisMgr& mgr) : mgr_(mgr) {}
+
+    template <typename T, typename Cmd, typename... Args>
+    RedisAwaitable<T> ExcuteCommand(const Cmd& cmd, const Args&... args) {
+        RedisAwaitable<T> awaitable(mgr_);
+        awaitable.Prepare(cmd, args...);
+        return awaitable;
+    }
+
+private:
+    AsyncRedisMgr& mgr_;
+};
+
+inline AsyncRedisCoroutine AsyncRedisMgr::Co() {
+    return AsyncRedisCoroutine(*this);
+}
+#endif
+
+} // namespace rdsfmt
+
+#endif // !__REDISFMT_ASYNC_H__
@@ -0,0 +1,318 @@
+#ifndef __REDISFMT_BULK_H__
+#define __REDISFMT_BULK_H__
+
+#include <cctype>
+#include <deque>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "redisfmt/redisfmt.hpp"
+
+namespace rdsfmt {
+
+/*
+Input formats of the bulk loader, one record per command:
+TSV     a line of tab separated arguments, the first is the command name
+JSONL   a line holding a JSON array of strings and numbers, ["HSET","user:1","name","tom"]
+RESP    commands as redis receives them, what redis-cli --pipe reads
+*/
+enum class BulkFormat { TSV, JSONL, RESP };
+
+namespace detail {
+
+// read only mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    bool Open(const std::string& path) {
+        Close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            LOG_ERROR("%s: can not open %s", __FUNCTION__, path.c_str());
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                LOG_ERROR("%s: mmap %s failed", __FUNCTION__, path.c_str());
+                ::close(fd);
+                size_ = 0;
+                return false;
+            }
+            data_ = static_cast<const char*>(data);
+            // the loader reads it once from front to back
+            madvise(data, size_, MADV_SEQUENTIAL);
+        }
+        ::close(fd);
+        return true;
+    }
+
+    void Close() {
+        if (data_)
+            munmap(const_cast<char*>(data_), size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    std::string_view View() const { return { data_, size_ }; }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// calls f with every line that is not empty, without its \r\n
+template <typename F>
+void ForEachLine(std::string_view data, F&& f) {
+    while (!data.empty()) {
+        size_t end = data.find('\n');
+        std::string_view line = data.substr(0, end);
+        data.remove_prefix(end == std::string_view::npos ? data.size() : end + 1);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (!line.empty())
+            f(line);
+    }
+}
+
+inline void AppendUtf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    }
+    else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+/*
+A JSON array of strings, numbers and booleans into argv. A string without
+escapes points into line, one with escapes is decoded into scratch, whose
+elements never move. Numbers and booleans are kept as written.
+*/
+inline bool ParseJsonArgv(std::string_view line, std::vector<std::string_view>& argv, std::deque<std::string>& scratch) {
+    argv.clear();
+    scratch.clear();
+    size_t pos = 0;
+    auto skip = [&] {
+        while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t'))
+            pos++;
+    };
+    auto hex4 = [&](uint32_t& cp) {
+        if (pos + 4 > line.size())
+            return false;
+        cp = 0;
+        for (size_t i = 0; i < 4; i++) {
+            char c = line[pos++];
+            cp <<= 4;
+            if (c >= '0' && c <= '9') cp |= c - '0';
+            else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+            else return false;
+        }
+        return true;
+    };
+
+    skip();
+    if (pos >= line.size() || line[pos++] != '[')
+        return false;
+    skip();
+    if (pos < line.size() && line[pos] == ']')
+        return false;
+    for (;;) {
+        skip();
+        if (pos >= line.size())
+            return false;
+        if (line[pos] == '"') {
+            size_t start = ++pos;
+            while (pos < line.size() && line[pos] != '"' && line[pos] != '\\')
+                pos++;
+            if (pos >= line.size())
+                return false;
+            if (line[pos] == '"') {
+                argv.push_back(line.substr(start, pos++ - start));
+            }
+            else {
+                std::string& out = scratch.emplace_back(line.substr(start, pos - start));
+                while (pos < line.size() && line[pos] != '"') {
+                    if (line[pos] != '\\') {
+                        out += line[pos++];
+                        continue;
+                    }
+                    if (++pos >= line.size())
+                        return false;
+                    char c = line[pos++];
+                    uint32_t cp = 0;
+                    switch (c) {
+                    case '"': case '\\': case '/': out += c; break;
+                    case 'b': out += '\b'; break;
+                    case 'f': out += '\f'; break;
+                    case 'n': out += '\n'; break;
+                    case 'r': out += '\r'; break;
+                    case 't': out += '\t'; break;
+                    case 'u':
+                        if (!hex4(cp))
+                            return false;
+                        if (cp >= 0xD800 && cp < 0xDC00) {
+                            uint32_t low = 0;
+                            if (pos + 2 > line.size() || line[pos] != '\\' || line[pos + 1] != 'u')
+                                return false;
+                            pos += 2;
+                            if (!hex4(low) || low < 0xDC00 || low > 0xDFFF)
+                                return false;
+                            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        }
+                        AppendUtf8(out, cp);
+                        break;
+                    default:
+                        return false;
+                    }
+                }
+                if (pos++ >= line.size())
+                    return false;
+                argv.push_back(out);
+            }
+        }
+        else {
+            size_t start = pos;
+            while (pos < line.size() && (std::isalnum(static_cast<unsigned char>(line[pos])) ||
+                line[pos] == '-' || line[pos] == '+' || line[pos] == '.'))
+                pos++;
+            std::string_view token = line.substr(start, pos - start);
+            if (token.empty() || token == "null")
+                return false;
+            argv.push_back(token);
+        }
+        skip();
+        if (pos >= line.size())
+            return false;
+        if (line[pos] == ']') {
+            pos++;
+            skip();
+            return pos == line.size();
+        }
+        if (line[pos++] != ',')
+            return false;
+    }
+}
+
+// bytes of the first RESP command of data, 0 when it is malformed or cut short
+inline size_t RespCommandSize(std::string_view data) {
+    size_t pos = 0;
+    auto number = [&](char type, size_t& value) {
+        if (pos >= data.size() || data[pos] != type)
+            return false;
+        size_t end = data.find("\r\n", pos);
+        if (end == std::string_view::npos)
+            return false;
+        auto [ptr, ec] = std::from_chars(data.data() + pos + 1, data.data() + end, value);
+        if (ec != std::errc() || ptr != data.data() + end)
+            return false;
+        pos = end + 2;
+        return true;
+    };
+    size_t argc = 0;
+    if (!number('*', argc) || argc == 0)
+        return 0;
+    for (size_t i = 0; i < argc; i++) {
+        size_t len = 0;
+        if (!number('$', len) || data.size() - pos < len + 2 || data.compare(pos + len, 2, "\r\n") != 0)
+            return 0;
+        pos += len + 2;
+    }
+    return pos;
+}
+}
+
+// every line of data as a command, false when the connection was lost
+inline bool LoadTsv(BulkLoader& loader, std::string_view data) {
+    std::vector<std::string_view> argv;
+    bool ok = true;
+    detail::ForEachLine(data, [&](std::string_view line) {
+        argv.clear();
+        size_t pos = 0;
+        for (;;) {
+            size_t end = line.find('\t', pos);
+            argv.push_back(line.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos));
+            if (end == std::string_view::npos)
+                break;
+            pos = end + 1;
+        }
+        ok = loader.AddArgv(argv) && ok;
+    });
+    return ok;
+}
+
+// a line that is not a JSON array is rejected and loading goes on
+inline bool LoadJsonl(BulkLoader& loader, std::string_view data) {
+    std::vector<std::string_view> argv;
+    std::deque<std::string> scratch;
+    bool ok = true;
+    detail::ForEachLine(data, [&](std::string_view line) {
+        if (detail::ParseJsonArgv(line, argv, scratch))
+            ok = loader.AddArgv(argv) && ok;
+        else
+            loader.Reject("not a JSON array of strings and numbers");
+    });
+    return ok;
+}
+
+// the commands are sent as they are, malformed RESP ends the load since the next command can't be found
+inline bool LoadResp(BulkLoader& loader, std::string_view data) {
+    bool ok = true;
+    size_t offset = 0;
+    while (offset < data.size()) {
+        size_t size = detail::RespCommandSize(data.substr(offset));
+        if (size == 0) {
+            loader.Reject(fmt::format("malformed RESP at byte {}", offset));
+            return false;
+        }
+        ok = loader.Add(data.substr(offset, size)) && ok;
+        offset += size;
+    }
+    return ok;
+}
+
+inline bool Load(BulkLoader& loader, std::string_view data, BulkFormat format) {
+    switch (format) {
+    case BulkFormat::TSV: return LoadTsv(loader, data);
+    case BulkFormat::JSONL: return LoadJsonl(loader, data);
+    case BulkFormat::RESP: return LoadResp(loader, data);
+    }
+    return false;
+}
+
+// the file is mapped and read in place, false when it can't be opened or the load failed
+inline bool LoadFile(BulkLoader& loader, const std::string& path, BulkFormat format) {
+    detail::MappedFile file;
+    if (!file.Open(path))
+        return false;
+    return Load(loader, file.View(), format);
+}
+
+} // namespace rdsfmt
+
+#endif // !__REDISFMT_BULK_H__
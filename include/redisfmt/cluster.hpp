@@ -0,0 +1,447 @@
+#ifndef __REDISFMT_CLUSTER_H__
+#define __REDISFMT_CLUSTER_H__
+
+#include <future>
+#include <shared_mutex>
+
+#include "redisfmt/redisfmt.hpp"
+
+namespace rdsfmt {
+
+namespace detail {
+
+constexpr size_t kClusterSlots = 16384;
+
+// CRC16/XMODEM as used by redis cluster, the table is built at compile time
+struct Crc16Table {
+    uint16_t value[256] = {};
+    constexpr Crc16Table() {
+        for (int i = 0; i < 256; i++) {
+            uint16_t crc = static_cast<uint16_t>(i << 8);
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+            value[i] = crc;
+        }
+    }
+};
+
+inline constexpr Crc16Table kCrc16Table{};
+
+constexpr uint16_t Crc16(std::string_view data) {
+    uint16_t crc = 0;
+    for (char c : data)
+        crc = static_cast<uint16_t>((crc << 8) ^ kCrc16Table.value[((crc >> 8) ^ static_cast<uint8_t>(c)) & 0xff]);
+    return crc;
+}
+
+// only the part inside the first non empty {...} is hashed, so "{user1}.name" and "{user1}.age" share a slot
+constexpr uint16_t HashSlot(std::string_view key) {
+    return Crc16(HashTag(key)) & (kClusterSlots - 1);
+}
+
+static_assert(Crc16("123456789") == 0x31c3, "crc16 xmodem");
+
+template <typename T>
+int ArgSlot(const T& arg) {
+    char buf[32];
+    return HashSlot(ArgBytes(arg, buf));
+}
+}
+
+/*
+Redis Cluster client. The slot map is read with CLUSTER SLOTS and every node gets
+its own RedisPool, built from the seed RedisInitParam with host and port replaced.
+Typed commands are routed by the hash slot of their key (the first argument, or
+every argument for detail::kCmdMultiKey commands), MOVED and ASK replies are
+followed and a MOVED refreshes the slot map.
+*/
+class RedisClusterMgr : public RedisCommands<RedisClusterMgr> {
+public:
+    RedisClusterMgr() : slots_(detail::kClusterSlots, nullptr) {}
+    virtual ~RedisClusterMgr() {
+        UnInit();
+    }
+
+    int Initialize(const RedisInitParam& param) {
+        return Initialize(std::vector<RedisInitParam>{ param });
+    }
+
+    // any of the seeds is enough to load the slot map
+    int Initialize(const std::vector<RedisInitParam>& seeds) {
+        if (seeds.empty())
+            return -1;
+        param_ = seeds.front();
+        for (auto& seed : seeds) {
+            if (Node(seed.host, seed.port) && RefreshSlots() == 0)
+                return 0;
+        }
+        LOG_ERROR("%s: can not load the cluster slot map", __FUNCTION__);
+        return -1;
+    }
+
+    void UnInit() {
+        std::unique_lock<std::shared_mutex> slots_lock(slots_mutex_);
+        std::lock_guard<std::mutex> lock(nodes_mutex_);
+        std::fill(slots_.begin(), slots_.end(), nullptr);
+        nodes_.clear();
+    }
+
+    // reload the slot map from the first node that answers CLUSTER SLOTS
+    int RefreshSlots() {
+        std::unique_lock<std::mutex> refresh(refresh_mutex_, std::try_to_lock);
+        if (!refresh)
+            return 0;   // another thread is already at it
+        refresh_pending_ = false;
+
+        static constexpr auto cmd = detail::MakeRespCommand("CLUSTER SLOTS", detail::kCmdNoKey);
+        for (RedisPool* node : Nodes()) {
+            auto context = node->Get();
+            if (!context)
+                continue;
+            detail::RespWriter(context.Buffer()).Command(cmd);
+            RedisReply reply = context.Execute();
+            if (!reply) {
+                context.SetContextDisable();
+                continue;
+            }
+            if (reply->type != REDIS_REPLY_ARRAY) {
+                LOG_ERROR("%s: CLUSTER SLOTS failed on %s:%d", __FUNCTION__,
+                    node->Param().host.c_str(), node->Param().port);
+                continue;
+            }
+            context.Release();
+            if (LoadSlots(reply, node->Param().host))
+                return 0;
+        }
+        return -1;
+    }
+
+    template <typename T, typename Cmd, typename... Args>
+    tl::expected<T, int> ExcuteCommand(const Cmd& cmd, const Args&... args) {
+        [[maybe_unused]] std::string_view command = detail::CommandName(cmd);
+        int slot = CommandSlot(cmd, args...);
+        if (slot == kCrossSlot) {
+            LOG_ERROR("cmd[%.*s] keys hash to different slots", static_cast<int>(command.size()), command.data());
+            return tl::unexpected{ REDIS_REPLY_ERROR };
+        }
+
+        fmt::memory_buffer buffer;
+        detail::RespWriter(buffer).Command(cmd, args...);
+        RedisReply reply = Execute(slot, std::string_view(buffer.data(), buffer.size()));
+        if (!reply) {
+            LOG_ERROR("cmd[%.*s] reply is null", static_cast<int>(command.size()), command.data());
+            return tl::unexpected{ -1 };
+        }
+
+        auto _ = GetFromReply<T>(reply);
+        if (!_ && _.error() == REDIS_REPLY_ERROR) {
+            LOG_ERROR("%s: command[%.*s]", __FUNCTION__, static_cast<int>(command.size()), command.data());
+        }
+        return _;
+    }
+
+    // keys are grouped by slot, each node gets its own thread when they span several nodes
+    template <typename... Args>
+    tl::expected<int, int> DEL(const Args&... keys) {
+        static_assert(sizeof...(keys) > 0, "DEL needs at least one key");
+        std::vector<std::string> names;
+        char buf[32];
+        (names.emplace_back(detail::ArgBytes(keys, buf)), ...);
+        return SplitBySlot("DEL", names);
+    }
+
+    template <typename R>
+    tl::expected<int, int> DEL(const R& keys, std::enable_if_t<detail::is_arg_range_v<R>, int> = 0) {
+        std::vector<std::string> names;
+        names.reserve(keys.size());
+        char buf[32];
+        for (auto& key : keys)
+            names.emplace_back(detail::ArgBytes(key, buf));
+        return SplitBySlot("DEL", names);
+    }
+
+protected:
+    static constexpr int kAnySlot = -1;
+    static constexpr int kCrossSlot = -2;
+    static constexpr int kMaxRedirects = 5;
+
+    template <typename Cmd, typename... Args>
+    int CommandSlot(const Cmd& cmd, const Args&... args) {
+        uint32_t flags = detail::CommandFlags(cmd);
+        if constexpr (sizeof...(args) == 0) {
+            return kAnySlot;
+        }
+        else {
+            if (flags & detail::kCmdNoKey)
+                return kAnySlot;
+            if (flags & detail::kCmdStreamKey) {
+                auto key = detail::StreamKey(args...);
+                return key ? detail::HashSlot(*key) : kAnySlot;
+            }
+            if (!(flags & (detail::kCmdMultiKey | detail::kCmdScript)))
+                return FirstArgSlot(args...);
+            int slot = kAnySlot;
+            auto merge = [&slot](int s) {
+                if (slot == kAnySlot)
+                    slot = s;
+                else if (slot != s)
+                    slot = kCrossSlot;
+            };
+            if (flags & detail::kCmdScript)
+                ScriptKeySlots(merge, args...);
+            else
+                (MergeSlots(args, merge), ...);
+            return slot;
+        }
+    }
+
+    template <typename First, typename... Rest>
+    static int FirstArgSlot(const First& first, const Rest&...) {
+        if constexpr (detail::is_container<First>::value && !std::is_convertible_v<const First&, std::string_view>)
+            return first.empty() ? kAnySlot : detail::ArgSlot(*std::begin(first));
+        else
+            return detail::ArgSlot(first);
+    }
+
+    // script, numkeys, keys, args
+    template <typename F, typename... Args>
+    static void ScriptKeySlots(F& merge, const Args&... args) {
+        if constexpr (sizeof...(args) >= 3)
+            MergeSlots(std::get<2>(std::forward_as_tuple(args...)), merge);
+    }
+
+    template <typename T, typename F>
+    static void MergeSlots(const T& arg, F& merge) {
+        if constexpr (detail::is_container<T>::value && !std::is_convertible_v<const T&, std::string_view>) {
+            for (auto& key : arg)
+                merge(detail::ArgSlot(key));
+        }
+        else {
+            merge(detail::ArgSlot(arg));
+        }
+    }
+
+    /*
+    Send an encoded command to the owner of slot and follow redirects. MOVED means
+    the slot has a new owner for good, ASK only for this one command, which then
+    has to be preceded by ASKING on the same connection. A followed MOVED reloads
+    the whole slot map once the reply is in, the other slots of a failed over node
+    moved too; the threads that got a MOVED meanwhile share that one reload.
+    */
+    RedisReply Execute(int slot, std::string_view command) {
+        RedisReply reply = Redirect(slot, command);
+        if (refresh_pending_)
+            RefreshSlots();
+        return reply;
+    }
+
+    RedisReply Redirect(int slot, std::string_view command) {
+        static constexpr std::string_view kAsking = "*1\r\n$6\r\nASKING\r\n";
+        RedisPool* node = NodeForSlot(slot);
+        bool asking = false;
+        bool reconnected = false;
+        for (int redirects = 0; redirects <= kMaxRedirects; redirects++) {
+            if (!node) {
+                RefreshSlots();
+                if (!(node = NodeForSlot(slot)))
+                    break;
+            }
+            auto context = node->Get();
+            if (!context)
+                return nullptr;
+
+            RedisReply reply = nullptr;
+            bool sent = (!asking || context.Send(kAsking.data(), kAsking.size()))
+                && context.Send(command.data(), command.size());
+            if (sent && asking && !(reply = context.Receive()))
+                sent = false;
+            if (sent)
+                reply = context.Receive();
+            if (!reply) {
+                // the node may be gone after a failover, look up the new owner once
+                context.SetContextDisable();
+                if (reconnected)
+                    return nullptr;
+                reconnected = true;
+                node = nullptr;
+                continue;
+            }
+            context.Release();
+            asking = false;
+            if (reply->type != REDIS_REPLY_ERROR)
+                return reply;
+
+            std::string_view error(reply->str, reply->len);
+            bool moved = error.substr(0, 6) == "MOVED ";
+            if (moved || error.substr(0, 4) == "ASK ") {
+                // MOVED 3999 127.0.0.1:6381
+                std::string_view rest = error.substr(moved ? 6 : 4);
+                size_t space = rest.find(' ');
+                size_t colon = rest.rfind(':');
+                if (space == std::string_view::npos || colon == std::string_view::npos || colon < space)
+                    return reply;
+                int target = std::atoi(std::string(rest.substr(0, space)).c_str());
+                std::string host(rest.substr(space + 1, colon - space - 1));
+                int port = std::atoi(std::string(rest.substr(colon + 1)).c_str());
+                if (!(node = Node(host, port)))
+                    return reply;
+                if (moved) {
+                    SetSlot(target, node);
+                    refresh_pending_ = true;
+                }
+                asking = !moved;
+                continue;
+            }
+            if (error.substr(0, 8) == "TRYAGAIN") {
+                // keys of a multi key command are being migrated
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            return reply;
+        }
+        return nullptr;
+    }
+
+    tl::expected<int, int> SplitBySlot(std::string_view command, const std::vector<std::string>& keys) {
+        std::map<int, std::vector<std::string_view>> by_slot;
+        for (auto& key : keys)
+            by_slot[detail::HashSlot(key)].push_back(key);
+
+        std::map<RedisPool*, std::vector<int>> by_node;
+        for (auto& [slot, _] : by_slot)
+            by_node[NodeForSlot(slot)].push_back(slot);
+
+        // by_slot is only read from here on, the node threads must not use operator[]
+        auto run = [&](const std::vector<int>& slots) -> tl::expected<int, int> {
+            int total = 0;
+            fmt::memory_buffer buffer;
+            for (int slot : slots) {
+                buffer.clear();
+                detail::RespWriter(buffer).Command(command, by_slot.at(slot));
+                RedisReply reply = Execute(slot, std::string_view(buffer.data(), buffer.size()));
+                if (!reply)
+                    return tl::unexpected{ -1 };
+                auto count = GetFromReply<int>(reply);
+                if (!count)
+                    return count;
+                total += *count;
+            }
+            return total;
+        };
+        if (by_node.size() == 1)
+            return run(by_node.begin()->second);
+
+        std::vector<std::future<tl::expected<int, int>>> parts;
+        for (auto& [_, slots] : by_node)
+            parts.push_back(std::async(std::launch::async, run, std::cref(slots)));
+        tl::expected<int, int> total = 0;
+        for (auto& part : parts) {
+            auto count = part.get();
+            if (!count)
+                total = count;
+            else if (total)
+                *total += *count;
+        }
+        return total;
+    }
+
+    bool LoadSlots(const redisReply* reply, const std::string& asked_host) {
+        // 1) 1) start 2) end 3) 1) host 2) port 3) id ... the first node is the primary
+        std::vector<std::pair<std::pair<int, int>, RedisPool*>> ranges;
+        for (size_t i = 0; i < reply->elements; i++) {
+            const redisReply* range = reply->element[i];
+            if (range->type != REDIS_REPLY_ARRAY || range->elements < 3)
+                continue;
+            const redisReply* primary = range->element[2];
+            if (primary->type != REDIS_REPLY_ARRAY || primary->elements < 2)
+                continue;
+            const redisReply* ip = primary->element[0];
+            std::string host = ip->type == REDIS_REPLY_STRING ? std::string(ip->str, ip->len) : std::string();
+            // an empty host or "?" means the node we asked
+            if (host.empty() || host == "?")
+                host = asked_host;
+            RedisPool* node = Node(host, static_cast<int>(primary->element[1]->integer));
+            if (!node)
+                return false;
+            ranges.push_back({ { static_cast<int>(range->element[0]->integer), static_cast<int>(range->element[1]->integer) }, node });
+        }
+        if (ranges.empty())
+            return false;
+
+        std::unique_lock<std::shared_mutex> lock(slots_mutex_);
+        for (auto& [range, node] : ranges) {
+            for (int slot = std::max(range.first, 0); slot <= range.second && slot < static_cast<int>(detail::kClusterSlots); slot++)
+                slots_[slot] = node;
+        }
+        return true;
+    }
+
+    RedisPool* NodeForSlot(int slot) {
+        if (slot < 0) {
+            auto nodes = Nodes();
+            return nodes.empty() ? nullptr : nodes.front();
+        }
+        std::shared_lock<std::shared_mutex> lock(slots_mutex_);
+        return slots_[slot];
+    }
+
+    void SetSlot(int slot, RedisPool* node) {
+        if (slot < 0 || slot >= static_cast<int>(detail::kClusterSlots))
+            return;
+        std::unique_lock<std::shared_mutex> lock(slots_mutex_);
+        slots_[slot] = node;
+    }
+
+    // pools are only added, a slot can keep pointing to a node until the next refresh.
+    // the pool connects outside nodes_mutex_, a node that failed is not tried again for a second
+    RedisPool* Node(const std::string& host, int port) {
+        std::string name = fmt::format("{}:{}", host, port);
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(nodes_mutex_);
+            auto it = nodes_.find(name);
+            if (it != nodes_.end())
+                return it->second.get();
+            auto failed = failed_.find(name);
+            if (failed != failed_.end() && failed->second > now)
+                return nullptr;
+        }
+
+        RedisInitParam param = param_;
+        param.host = host;
+        param.port = port;
+        auto pool = std::make_unique<RedisPool>();
+        bool connected = pool->Initialize(param) == 0;
+
+        std::lock_guard<std::mutex> lock(nodes_mutex_);
+        if (!connected) {
+            failed_[name] = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            return nullptr;
+        }
+        failed_.erase(name);
+        // another thread may have connected the same node meanwhile, its pool wins
+        return nodes_.emplace(name, std::move(pool)).first->second.get();
+    }
+
+    std::vector<RedisPool*> Nodes() {
+        std::vector<RedisPool*> nodes;
+        std::lock_guard<std::mutex> lock(nodes_mutex_);
+        for (auto& [_, pool] : nodes_)
+            nodes.push_back(pool.get());
+        return nodes;
+    }
+
+protected:
+    RedisInitParam param_;
+    std::vector<RedisPool*> slots_;
+    std::shared_mutex slots_mutex_;
+    std::map<std::string, std::unique_ptr<RedisPool>> nodes_;
+    std::map<std::string, std::chrono::steady_clock::time_point> failed_; // retry after, see Node
+    std::mutex nodes_mutex_;
+    std::mutex refresh_mutex_;
+    std::atomic<bool> refresh_pending_{ false };
+};
+
+} // namespace rdsfmt
+
+#endif // !__REDISFMT_CLUSTER_H__
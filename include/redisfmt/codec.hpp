@@ -0,0 +1,476 @@
+#ifndef __REDISFMT_CODEC_H__
+#define __REDISFMT_CODEC_H__
+
+#include <limits>
+
+#include "redisfmt/redisfmt.hpp"
+
+namespace rdsfmt {
+
+/*
+Codecs for Encode and REDIS_CODEC. A value written by a codec starts with a
+header byte that no UTF-8 text starts with, so one key space can hold codec
+values next to plain text ones and a codec can tell them apart:
+
+0xFE    BinaryCodec, the binary encoding follows
+0xFF    Compressed, the varint size of the original bytes and an LZ4 block follow
+0xFD    Compressed left it as is, the original bytes follow
+
+The first byte of anything else is data, BinaryCodec reads it as text then.
+*/
+namespace codec {
+constexpr uint8_t kStored = 0xFD;
+constexpr uint8_t kBinary = 0xFE;
+constexpr uint8_t kCompressed = 0xFF;
+
+// no value of redis is larger, a bigger size in a header is garbage
+constexpr size_t kMaxValueSize = 512 * 1024 * 1024;
+}
+
+namespace detail {
+
+inline void PutVarint(fmt::memory_buffer& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline bool GetVarint(std::string_view& data, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && !data.empty(); shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(data.front());
+        data.remove_prefix(1);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/*
+LZ4 block format, greedy matching on a hash of the next 4 bytes. It gives up
+ratio for speed like LZ4 itself, JSON and other repetitive text still shrinks
+several times. The blocks can be read by any LZ4 block decoder.
+*/
+class Lz4Block {
+public:
+    // appends the block of data to out
+    static void Compress(std::string_view data, fmt::memory_buffer& out) {
+        const uint8_t* src = reinterpret_cast<const uint8_t*>(data.data());
+        size_t size = data.size();
+        uint32_t table[kTableSize] = {};
+        size_t anchor = 0;
+        size_t pos = 0;
+        size_t misses = 0;
+        // the last match starts 12 bytes and ends 5 bytes before the end, see the LZ4 block format
+        size_t match_limit = size > kMinTail ? size - kMinTail : 0;
+        while (pos < match_limit) {
+            uint32_t sequence = Read32(src + pos);
+            uint32_t& slot = table[Hash(sequence)];
+            size_t ref = slot;
+            slot = static_cast<uint32_t>(pos + 1);
+            if (ref == 0 || pos + 1 - ref > kMaxOffset || Read32(src + ref - 1) != sequence) {
+                // incompressible input is skipped faster the longer it goes on
+                pos += 1 + (misses++ >> 6);
+                continue;
+            }
+            ref--;
+            misses = 0;
+            size_t length = kMinMatch;
+            while (pos + length < size - kLastLiterals && src[ref + length] == src[pos + length])
+                length++;
+            Sequence(out, src + anchor, pos - anchor, pos - ref, length);
+            pos += length;
+            anchor = pos;
+        }
+        Sequence(out, src + anchor, size - anchor, 0, 0);
+    }
+
+    // decodes block into exactly size bytes, false when it is damaged
+    static bool Decompress(std::string_view block, size_t size, std::string& out) {
+        // a byte of a block expands to 255 bytes at most
+        if (size / 255 > block.size())
+            return false;
+        const uint8_t* in = reinterpret_cast<const uint8_t*>(block.data());
+        const uint8_t* end = in + block.size();
+        out.resize(size);
+        char* dst = out.data();
+        size_t pos = 0;
+        auto length = [&](size_t value) {
+            if (value != 15)
+                return value;
+            uint8_t byte = 255;
+            while (byte == 255 && in < end) {
+                byte = *in++;
+                value += byte;
+            }
+            return byte == 255 ? SIZE_MAX : value;
+        };
+        while (in < end) {
+            uint8_t token = *in++;
+            size_t literals = length(token >> 4);
+            if (literals > static_cast<size_t>(end - in) || literals > size - pos)
+                return false;
+            memcpy(dst + pos, in, literals);
+            in += literals;
+            pos += literals;
+            if (in == end)
+                break;
+            if (end - in < 2)
+                return false;
+            size_t offset = in[0] | (static_cast<size_t>(in[1]) << 8);
+            in += 2;
+            size_t match = length(token & 15);
+            if (match == SIZE_MAX || offset == 0 || offset > pos || match + kMinMatch > size - pos)
+                return false;
+            match += kMinMatch;
+            // the source may overlap what is written, a run of one byte has offset 1
+            for (size_t i = 0; i < match; i++, pos++)
+                dst[pos] = dst[pos - offset];
+        }
+        return pos == size;
+    }
+
+private:
+    static constexpr size_t kTableBits = 12;
+    static constexpr size_t kTableSize = size_t(1) << kTableBits;
+    static constexpr size_t kMinMatch = 4;
+    static constexpr size_t kLastLiterals = 5;
+    static constexpr size_t kMinTail = 12;
+    static constexpr size_t kMaxOffset = 65535;
+
+    static uint32_t Read32(const uint8_t* p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static size_t Hash(uint32_t sequence) {
+        return (sequence * 2654435761U) >> (32 - kTableBits);
+    }
+
+    static void Length(fmt::memory_buffer& out, size_t value) {
+        while (value >= 255) {
+            out.push_back(static_cast<char>(255));
+            value -= 255;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    // match 0 is the literals at the end of the block
+    static void Sequence(fmt::memory_buffer& out, const uint8_t* literals, size_t count, size_t offset, size_t match) {
+        size_t extra = match ? match - kMinMatch : 0;
+        out.push_back(static_cast<char>((std::min<size_t>(count, 15) << 4) | std::min<size_t>(extra, 15)));
+        if (count >= 15)
+            Length(out, count - 15);
+        out.append(literals, literals + count);
+        if (match == 0)
+            return;
+        out.push_back(static_cast<char>(offset & 0xFF));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (extra >= 15)
+            Length(out, extra - 15);
+    }
+};
+}
+
+/*
+Values as text, what the commands write without a codec. Strings, numbers,
+bool and enums, mostly useful inside Compressed for JSON and other text blobs.
+*/
+struct TextCodec {
+    template <typename T>
+    static void Encode(const T& value, fmt::memory_buffer& out) {
+        if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            std::string_view str(value);
+            out.append(str.data(), str.data() + str.size());
+        }
+        else if constexpr (std::is_same_v<T, bool>) {
+            out.push_back(value ? '1' : '0');
+        }
+        else if constexpr (std::is_enum_v<T>) {
+            Encode(static_cast<std::underlying_type_t<T>>(value), out);
+        }
+        else {
+            fmt::format_to(std::back_inserter(out), "{}", value);
+        }
+    }
+
+    template <typename T>
+    static bool Decode(std::string_view data, T& value) {
+        return detail::ParseValue(data, value);
+    }
+};
+
+/*
+Compact binary encoding after the 0xFE header byte:
+
+integers    LEB128 varint, signed ones zigzag encoded first, 1 byte up to 63
+floats      fixed 4 or 8 bytes, little endian
+bool        1 byte
+strings     varint length and the bytes
+optional    1 byte for has value and the value
+containers  varint count and the elements, pairs as first then second
+REDIS_STRUCT the members in declaration order, without names
+
+A struct reads the members there are and leaves the rest default, so members
+can be added at the end while old values are still around, and a value of a
+newer struct with more members can be read by an older one. A value without the
+header byte is read as text, numbers and strings written before the codec was
+introduced are still readable.
+*/
+struct BinaryCodec {
+    template <typename T>
+    static void Encode(const T& value, fmt::memory_buffer& out) {
+        out.push_back(static_cast<char>(codec::kBinary));
+        Put(value, out);
+    }
+
+    template <typename T>
+    static bool Decode(std::string_view data, T& value) {
+        if (data.empty() || static_cast<uint8_t>(data.front()) != codec::kBinary) {
+            if constexpr (is_text<T>::value)
+                return detail::ParseValue(data, value);
+            else
+                return false;
+        }
+        data.remove_prefix(1);
+        return Get(data, value);
+    }
+
+private:
+    template <typename T, typename = void>
+    struct is_text : std::bool_constant<std::is_arithmetic_v<T> || std::is_enum_v<T> || std::is_same_v<T, std::string>> {};
+
+    template <typename T>
+    struct is_text<T, std::enable_if_t<detail::is_optional<T>::value>> : is_text<typename T::value_type> {};
+
+    // the key of a map element is const
+    template <typename T, typename = void>
+    struct element { using type = std::decay_t<T>; };
+
+    template <typename T>
+    struct element<T, std::enable_if_t<detail::is_pair<T>::value>> {
+        using type = std::pair<std::decay_t<typename T::first_type>, std::decay_t<typename T::second_type>>;
+    };
+
+    template <typename T>
+    using element_t = typename element<T>::type;
+
+    template <typename T>
+    static void Put(const T& value, fmt::memory_buffer& out) {
+        if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            std::string_view str(value);
+            detail::PutVarint(out, str.size());
+            out.append(str.data(), str.data() + str.size());
+        }
+        else if constexpr (std::is_same_v<T, bool>) {
+            out.push_back(value ? 1 : 0);
+        }
+        else if constexpr (std::is_enum_v<T>) {
+            Put(static_cast<std::underlying_type_t<T>>(value), out);
+        }
+        else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+            int64_t v = value;
+            detail::PutVarint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+        }
+        else if constexpr (std::is_integral_v<T>) {
+            detail::PutVarint(out, value);
+        }
+        else if constexpr (std::is_floating_point_v<T>) {
+            static_assert(sizeof(T) == 4 || sizeof(T) == 8, "only float and double");
+            using Bits = std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>;
+            Bits bits;
+            memcpy(&bits, &value, sizeof(bits));
+            for (size_t i = 0; i < sizeof(bits); i++)
+                out.push_back(static_cast<char>(bits >> (8 * i)));
+        }
+        else if constexpr (detail::is_optional<T>::value) {
+            out.push_back(value ? 1 : 0);
+            if (value)
+                Put(*value, out);
+        }
+        else if constexpr (detail::is_pair<T>::value) {
+            Put(value.first, out);
+            Put(value.second, out);
+        }
+        else if constexpr (detail::is_container<T>::value) {
+            detail::PutVarint(out, std::size(value));
+            for (auto& item : value)
+                Put(item, out);
+        }
+        else if constexpr (detail::is_redis_struct<T>::value) {
+            std::apply([&](const auto&... field) { (Put(value.*field.member, out), ...); }, detail::StructFields<T>());
+        }
+        else {
+            static_assert(detail::is_redis_struct<T>::value, "BinaryCodec can not encode this type");
+        }
+    }
+
+    template <typename T>
+    static bool Get(std::string_view& data, T& value) {
+        if constexpr (std::is_same_v<T, std::string>) {
+            uint64_t size = 0;
+            if (!detail::GetVarint(data, size) || size > data.size())
+                return false;
+            value.assign(data.data(), static_cast<size_t>(size));
+            data.remove_prefix(static_cast<size_t>(size));
+            return true;
+        }
+        else if constexpr (std::is_same_v<T, bool>) {
+            if (data.empty())
+                return false;
+            value = data.front() != 0;
+            data.remove_prefix(1);
+            return true;
+        }
+        else if constexpr (std::is_enum_v<T>) {
+            std::underlying_type_t<T> v{};
+            if (!Get(data, v))
+                return false;
+            value = static_cast<T>(v);
+            return true;
+        }
+        else if constexpr (std::is_integral_v<T>) {
+            uint64_t v = 0;
+            if (!detail::GetVarint(data, v))
+                return false;
+            if constexpr (std::is_signed_v<T>) {
+                int64_t decoded = static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+                if (decoded < std::numeric_limits<T>::min() || decoded > std::numeric_limits<T>::max())
+                    return false;
+                value = static_cast<T>(decoded);
+            }
+            else {
+                if (v > std::numeric_limits<T>::max())
+                    return false;
+                value = static_cast<T>(v);
+            }
+            return true;
+        }
+        else if constexpr (std::is_floating_point_v<T>) {
+            using Bits = std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>;
+            if (data.size() < sizeof(Bits))
+                return false;
+            Bits bits = 0;
+            for (size_t i = 0; i < sizeof(bits); i++)
+                bits |= static_cast<Bits>(static_cast<uint8_t>(data[i])) << (8 * i);
+            memcpy(&value, &bits, sizeof(bits));
+            data.remove_prefix(sizeof(bits));
+            return true;
+        }
+        else if constexpr (detail::is_optional<T>::value) {
+            bool has_value = false;
+            if (!Get(data, has_value))
+                return false;
+            if (!has_value) {
+                value.reset();
+                return true;
+            }
+            typename T::value_type v{};
+            if (!Get(data, v))
+                return false;
+            value = std::move(v);
+            return true;
+        }
+        else if constexpr (detail::is_pair<T>::value) {
+            return Get(data, value.first) && Get(data, value.second);
+        }
+        else if constexpr (detail::is_container<T>::value) {
+            uint64_t count = 0;
+            // every element takes a byte at least
+            if (!detail::GetVarint(data, count) || count > data.size())
+                return false;
+            value.clear();
+            auto inserter = std::inserter(value, value.end());
+            for (uint64_t i = 0; i < count; i++) {
+                element_t<typename T::value_type> item{};
+                if (!Get(data, item))
+                    return false;
+                *inserter++ = std::move(item);
+            }
+            return true;
+        }
+        else if constexpr (detail::is_redis_struct<T>::value) {
+            return std::apply([&](const auto&... field) {
+                return ((data.empty() || Get(data, value.*field.member)) && ...);
+            }, detail::StructFields<T>());
+        }
+        else {
+            static_assert(detail::is_redis_struct<T>::value, "BinaryCodec can not decode this type");
+            return false;
+        }
+    }
+};
+
+/*
+Inner's encoding compressed with LZ4 once it reaches Threshold bytes, and only
+kept when it saves something. Decoding takes both, and values written by Inner
+alone too, so compression can be turned on or the threshold moved while old
+values are still around:
+
+    mgr.SET("page:1", Encode<Compressed<TextCodec>>(html));
+    auto html = mgr.GET<Encoded<std::string, Compressed<TextCodec>>>("page:1");
+*/
+template <typename Inner, size_t Threshold = 1024>
+struct Compressed {
+    template <typename T>
+    static void Encode(const T& value, fmt::memory_buffer& out) {
+        fmt::memory_buffer encoded;
+        Inner::Encode(value, encoded);
+        std::string_view data(encoded.data(), encoded.size());
+        if (data.size() >= Threshold) {
+            size_t start = out.size();
+            out.push_back(static_cast<char>(codec::kCompressed));
+            detail::PutVarint(out, data.size());
+            detail::Lz4Block::Compress(data, out);
+            if (out.size() - start < data.size())
+                return;
+            out.resize(start);
+        }
+        // a header byte as the first byte would be taken for one
+        if (!data.empty() && static_cast<uint8_t>(data.front()) >= codec::kStored &&
+            static_cast<uint8_t>(data.front()) != codec::kBinary)
+            out.push_back(static_cast<char>(codec::kStored));
+        out.append(data.data(), data.data() + data.size());
+    }
+
+    template <typename T>
+    static bool Decode(std::string_view data, T& value) {
+        if (data.empty())
+            return Inner::Decode(data, value);
+        switch (static_cast<uint8_t>(data.front())) {
+        case codec::kStored:
+            return Inner::Decode(data.substr(1), value);
+        case codec::kCompressed: {
+            data.remove_prefix(1);
+            uint64_t size = 0;
+            if (!detail::GetVarint(data, size) || size > codec::kMaxValueSize)
+                return false;
+            std::string original;
+            if (!detail::Lz4Block::Decompress(data, static_cast<size_t>(size), original))
+                return false;
+            return Inner::Decode(original, value);
+        }
+        default:
+            return Inner::Decode(data, value);
+        }
+    }
+};
+
+// binary values, compressed from 1KB
+using PackedCodec = Compressed<BinaryCodec>;
+
+template <typename T>
+using Packed = Encoded<T, PackedCodec>;
+
+template <typename T>
+Encoded<const T&, PackedCodec> Pack(const T& value) {
+    return { value };
+}
+
+} // namespace rdsfmt
+
+#endif // !__REDISFMT_CODEC_H__
@@ -0,0 +1,447 @@
+#ifndef __REDISFMT_LOCK_H__
+#define __REDISFMT_LOCK_H__
+
+#include <random>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "redisfmt/redisfmt.hpp"
+
+namespace rdsfmt {
+
+namespace detail {
+
+constexpr std::string_view kLockChannelPrefix = "__redisfmt_lock__:";
+
+// -3 when taken, otherwise the PTTL of the holder so a waiter knows how long the lease can last
+inline constexpr RedisScript kLockAcquire = MakeScript(R"(
+if redis.call('SET', KEYS[1], ARGV[1], 'PX', ARGV[2], 'NX') then return -3 end
+return redis.call('PTTL', KEYS[1]))");
+
+// delete only our own lock and tell the waiters
+inline constexpr RedisScript kLockRelease = MakeScript(R"(
+if redis.call('GET', KEYS[1]) ~= ARGV[1] then return 0 end
+redis.call('DEL', KEYS[1])
+redis.call('PUBLISH', ARGV[2], KEYS[1])
+return 1)");
+
+inline constexpr RedisScript kLockRenew = MakeScript(R"(
+if redis.call('GET', KEYS[1]) ~= ARGV[1] then return 0 end
+return redis.call('PEXPIRE', KEYS[1], ARGV[2]))");
+
+// 128 random bits, a lock is only released or renewed by the holder of its token
+inline std::string LockToken() {
+    thread_local std::mt19937_64 rng(std::random_device{}() ^
+        (static_cast<uint64_t>(std::hash<std::thread::id>{}(std::this_thread::get_id())) << 1));
+    return fmt::format("{:016x}{:016x}", rng(), rng());
+}
+
+/*
+One subscriber connection per locker on the release channels of every lock,
+PSUBSCRIBE __redisfmt_lock__:*. A waiter takes the generation of its key before
+it tries the lock, and Wait() returns as soon as a release bumps it, so a release
+between the try and the wait is not missed. Until the subscription is up, and
+after it drops, Ready() is false and waiters back off instead.
+*/
+class LockListener {
+    struct Waiting {
+        uint64_t generation = 0;
+        size_t waiters = 0;
+    };
+
+public:
+    ~LockListener() { Stop(); }
+
+    void Start(const RedisInitParam& param) {
+        RedisInitParam listen = param;
+        listen.context_count = 1;
+        listen.use_reply_arena = false;
+        listen.protocol = 2;    // pub/sub messages would arrive as RESP3 pushes
+        listen.heart_invervals = 0;
+        listen.near_cache_size = 0;
+        pool_.Initialize(listen);
+        running_ = true;
+        thread_ = std::thread([this] { Run(); });
+    }
+
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_)
+                return;
+            running_ = false;
+            if (fd_ >= 0)
+                shutdown(fd_, SHUT_RDWR);
+        }
+        cv_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+        pool_.UnInit();
+    }
+
+    bool Ready() const { return ready_.load(); }
+
+    // register as a waiter of key, every Enter needs a Leave
+    uint64_t Enter(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Waiting& waiting = waiting_[key];
+        waiting.waiters++;
+        return waiting.generation;
+    }
+
+    void Leave(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = waiting_.find(key);
+        if (it != waiting_.end() && --it->second.waiters == 0)
+            waiting_.erase(it);
+    }
+
+    // false on timeout, true once key was released after generation was taken
+    bool Wait(const std::string& key, uint64_t generation, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return cv_.wait_for(lock, timeout, [&] {
+            auto it = waiting_.find(key);
+            return !running_ || !ready_ || (it != waiting_.end() && it->second.generation != generation);
+        });
+    }
+
+private:
+    void Run() {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!running_)
+                    break;
+            }
+            auto context = pool_.Get();
+            if (context && Subscribe(context)) {
+                ready_ = true;
+                Listen(context);
+            }
+            {
+                // waiters fall back to polling while there is no subscription
+                std::lock_guard<std::mutex> lock(mutex_);
+                ready_ = false;
+            }
+            cv_.notify_all();
+            if (context)
+                context.SetContextDisable();
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            fd_ = -1;
+            cv_.wait_for(lock, std::chrono::seconds(1), [this] { return !running_; });
+        }
+    }
+
+    bool Subscribe(RedisPool::AutoContext& context) {
+        std::string pattern = fmt::format("{}*", kLockChannelPrefix);
+        RedisReply reply = redisCommand(context, "PSUBSCRIBE %b", pattern.data(), pattern.size());
+        if (!reply || reply->type != REDIS_REPLY_ARRAY)
+            return false;
+
+        redisEnableKeepAlive(context);
+        struct timeval tv = { 0, 0 };
+        redisSetTimeout(context, tv);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_)
+            return false;
+        fd_ = context->fd;
+        return true;
+    }
+
+    void Listen(RedisPool::AutoContext& context) {
+        for (;;) {
+            // ["pmessage", pattern, channel, key]
+            RedisReply reply = context.Receive();
+            if (!reply)
+                return;
+            if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 4 || reply->element[3]->type != REDIS_REPLY_STRING)
+                continue;
+            std::string key(reply->element[3]->str, reply->element[3]->len);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = waiting_.find(key);
+                if (it == waiting_.end())
+                    continue;
+                it->second.generation++;
+            }
+            cv_.notify_all();
+        }
+    }
+
+    RedisPool pool_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool running_ = false;
+    int fd_ = -1;
+    std::atomic<bool> ready_{ false };
+    std::unordered_map<std::string, Waiting> waiting_;
+};
+
+struct LockState {
+    std::string key;
+    std::string token;
+    int px = 0;
+    bool renew = false;
+    std::atomic<bool> held{ true };
+    std::chrono::steady_clock::time_point renew_at{};   // next lease extension, under the mutex of the locker
+};
+}
+
+class RedisLocker;
+
+namespace detail {
+// shared by a locker and its locks, the locker is cleared under the unique lock when it goes away
+struct LockerLink {
+    std::shared_mutex mutex;
+    RedisLocker* locker = nullptr;
+};
+}
+
+/*
+A held lock. Unlock(), or the destructor, releases it only if it still holds
+the token, so a lock that expired and was taken by another client is left
+alone. Held() turns false when the watchdog finds the lease lost. A lock that
+outlives its RedisLocker is not released, Unlock() returns 0 and the lease expires.
+*/
+class RedisLock {
+public:
+    RedisLock() = default;
+    RedisLock(RedisLock&& other) noexcept
+        : link_(std::move(other.link_)), state_(std::move(other.state_)) {}
+    RedisLock& operator=(RedisLock&& other) noexcept {
+        if (this != &other) {
+            Unlock();
+            link_ = std::move(other.link_);
+            state_ = std::move(other.state_);
+        }
+        return *this;
+    }
+    RedisLock(const RedisLock&) = delete;
+    RedisLock& operator=(const RedisLock&) = delete;
+    ~RedisLock() { Unlock(); }
+
+    explicit operator bool() const { return Held(); }
+    bool Held() const { return state_ && state_->held.load(); }
+    std::string_view Token() const { return state_ ? std::string_view(state_->token) : std::string_view(); }
+
+    // 1 released, 0 not held anymore, -1 on error
+    inline int Unlock();
+
+private:
+    friend class RedisLocker;
+    RedisLock(std::shared_ptr<detail::LockerLink> link, std::shared_ptr<detail::LockState> state)
+        : link_(std::move(link)), state_(std::move(state)) {}
+
+    std::shared_ptr<detail::LockerLink> link_;
+    std::shared_ptr<detail::LockState> state_;
+};
+
+/*
+Locks with an owner token on top of a RedisMgr.
+
+    RedisLocker locker(mgr);
+    if (auto lock = locker.Lock("job:42", std::chrono::seconds(5))) {
+        ...
+    }   // released here, waiters of job:42 are woken by the release message
+
+Lock() blocks until the lock is free, woken by the release message of the
+holder instead of polling, or by the end of the holder's lease when it went away
+without releasing. Without the subscription it polls with jittered exponential
+backoff. Leases of locks taken with renew are extended by a watchdog thread
+every third of px while they are held.
+*/
+class RedisLocker {
+public:
+    explicit RedisLocker(RedisMgr& mgr) : mgr_(mgr), link_(std::make_shared<detail::LockerLink>()) {
+        link_->locker = this;
+        mgr_.RegisterScript(detail::kLockAcquire);
+        mgr_.RegisterScript(detail::kLockRelease);
+        mgr_.RegisterScript(detail::kLockRenew);
+        listener_.Start(mgr_.Param());
+        watchdog_ = std::thread([this] { Watchdog(); });
+    }
+    RedisLocker(const RedisLocker&) = delete;
+    RedisLocker& operator=(const RedisLocker&) = delete;
+
+    // locks still alive are not released, they expire
+    ~RedisLocker() {
+        {
+            // waits for the Unlock() calls already running
+            std::unique_lock<std::shared_mutex> lock(link_->mutex);
+            link_->locker = nullptr;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = false;
+        }
+        cv_.notify_all();
+        if (watchdog_.joinable())
+            watchdog_.join();
+        listener_.Stop();
+    }
+
+    // one attempt, the returned lock is empty when someone else holds it
+    RedisLock TryLock(std::string_view key, int px = 30000, bool renew = true) {
+        auto state = NewState(key, px, renew);
+        return Acquire(state) == kAcquired ? Hold(std::move(state)) : RedisLock();
+    }
+
+    RedisLock Lock(std::string_view key, std::chrono::milliseconds timeout, int px = 30000, bool renew = true) {
+        auto state = NewState(key, px, renew);
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        std::chrono::milliseconds backoff(2);
+        thread_local std::mt19937 rng(std::random_device{}());
+
+        for (;;) {
+            uint64_t generation = listener_.Enter(state->key);
+            int64_t pttl = Acquire(state);
+            if (pttl == kAcquired) {
+                listener_.Leave(state->key);
+                return Hold(std::move(state));
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (pttl == kError || now >= deadline) {
+                listener_.Leave(state->key);
+                return RedisLock();
+            }
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + std::chrono::milliseconds(1);
+            if (pttl != kNoLease && listener_.Ready()) {
+                // the release message wakes us, or the lease of a crashed holder runs out
+                auto lease = pttl >= 0 ? std::chrono::milliseconds(pttl + 1) : std::chrono::milliseconds(0);
+                listener_.Wait(state->key, generation, std::min(left, lease));
+            }
+            else {
+                auto cap = pttl >= 0 ? std::chrono::milliseconds(pttl + 1) : std::chrono::milliseconds(100);
+                std::uniform_int_distribution<int64_t> jitter(backoff.count() / 2, backoff.count());
+                auto sleep = std::min({ std::chrono::milliseconds(jitter(rng)), left, cap });
+                listener_.Leave(state->key);
+                std::this_thread::sleep_for(sleep);
+                backoff = std::min(backoff * 2, std::chrono::milliseconds(100));
+                continue;
+            }
+            listener_.Leave(state->key);
+        }
+    }
+
+private:
+    friend class RedisLock;
+
+    static constexpr int64_t kAcquired = -3;
+    static constexpr int64_t kNoLease = -1;     // held without an expiry, by a plain SET
+    static constexpr int64_t kError = -100;
+
+    std::shared_ptr<detail::LockState> NewState(std::string_view key, int px, bool renew) {
+        auto state = std::make_shared<detail::LockState>();
+        state->key = std::string(key);
+        state->token = detail::LockToken();
+        state->px = std::max(px, 1);
+        state->renew = renew;
+        return state;
+    }
+
+    int64_t Acquire(const std::shared_ptr<detail::LockState>& state) {
+        auto _ = mgr_.Eval<int64_t>(detail::kLockAcquire, { state->key }, state->token, state->px);
+        if (!_) {
+            LOG_ERROR("%s: lock %s failed, error[%d]", __FUNCTION__, state->key.c_str(), _.error());
+            return kError;
+        }
+        return *_;
+    }
+
+    RedisLock Hold(std::shared_ptr<detail::LockState> state) {
+        if (state->renew) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            state->renew_at = std::chrono::steady_clock::now() + RenewInterval(*state);
+            held_.push_back(state);
+            rearm_ = true;
+        }
+        cv_.notify_all();
+        return RedisLock(link_, std::move(state));
+    }
+
+    static std::chrono::milliseconds RenewInterval(const detail::LockState& state) {
+        return std::chrono::milliseconds(std::max(state.px / 3, 1));
+    }
+
+    int Release(detail::LockState& state) {
+        bool held = state.held.exchange(false);
+        if (state.renew) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            held_.erase(std::remove_if(held_.begin(), held_.end(),
+                [&](const std::shared_ptr<detail::LockState>& s) { return s.get() == &state; }), held_.end());
+        }
+        if (!held)
+            return 0;
+        std::string channel = fmt::format("{}{}", detail::kLockChannelPrefix, state.key);
+        auto _ = mgr_.Eval<int>(detail::kLockRelease, { state.key }, state.token, channel);
+        if (!_) {
+            LOG_ERROR("%s: unlock %s failed, error[%d]", __FUNCTION__, state.key.c_str(), _.error());
+            return -1;
+        }
+        return *_;
+    }
+
+    // every lock has its own deadline, a new lock can only make the wait shorter
+    void Watchdog() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (running_) {
+            auto now = std::chrono::steady_clock::now();
+            auto next = now + std::chrono::seconds(1);
+            std::vector<std::shared_ptr<detail::LockState>> due;
+            for (auto& state : held_) {
+                if (state->renew_at <= now) {
+                    due.push_back(state);
+                    state->renew_at = now + RenewInterval(*state);
+                }
+                next = std::min(next, state->renew_at);
+            }
+            if (due.empty()) {
+                cv_.wait_until(lock, next, [this] { return !running_ || rearm_; });
+                rearm_ = false;
+                continue;
+            }
+
+            lock.unlock();
+            for (auto& state : due) {
+                auto _ = mgr_.Eval<int>(detail::kLockRenew, { state->key }, state->token, state->px);
+                // a network error may be over before the lease is, only a missing token means lost
+                if (_ && *_ == 0 && state->held.exchange(false)) {
+                    LOG_WARN("%s: lease of lock %s lost", __FUNCTION__, state->key.c_str());
+                }
+            }
+            lock.lock();
+            held_.erase(std::remove_if(held_.begin(), held_.end(),
+                [](const std::shared_ptr<detail::LockState>& s) { return !s->held.load(); }), held_.end());
+        }
+    }
+
+    RedisMgr& mgr_;
+    std::shared_ptr<detail::LockerLink> link_;
+    detail::LockListener listener_;
+    std::thread watchdog_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool running_ = true;
+    bool rearm_ = false;
+    std::vector<std::shared_ptr<detail::LockState>> held_;
+};
+
+inline int RedisLock::Unlock() {
+    if (!link_ || !state_)
+        return 0;
+    int ret = 0;
+    {
+        std::shared_lock<std::shared_mutex> lock(link_->mutex);
+        if (link_->locker)
+            ret = link_->locker->Release(*state_);
+    }
+    link_.reset();
+    state_.reset();
+    return ret;
+}
+
+} // namespace rdsfmt
+
+#endif // !__REDISFMT_LOCK_H__
@@ -6,6 +6,26 @@
 #include <vector>
 #include <chrono>
 #include <array>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <tuple>
+#include <string>
+#include <charconv>
+#include <cstring>
+#include <new>
+#include <any>
+#include <list>
+#include <unordered_map>
+#include <future>
+#include <deque>
+
+#include <sys/socket.h>
 
 #include "hiredis.h"
 
@@ -22,6 +42,12 @@ namespace rdsfmt {
 
 constexpr std::string_view kRedisNilStr{ "(nil)" };
 
+// how RedisMgr picks the replica of a read only command
+enum class ReadPolicy {
+    Latency,            // lowest moving average latency, weighted by the requests it has in flight
+    LeastOutstanding,   // fewest requests in flight
+};
+
 struct RedisInitParam {
     std::string host;
     int port = 0;
@@ -29,18 +55,34 @@ struct RedisInitParam {
     int context_count = 0;
     int db_index = 0;
     bool use_ssl = false;
-    int connect_timeout = 0;
-    int heart_invervals = 0;
+    int connect_timeout = 0;    // milliseconds, 0 means blocking connect
+    int heart_invervals = 0;    // seconds, idle connections are PINGed on checkout
+    int checkout_timeout = 100; // milliseconds to wait when every context is busy
+    bool use_reply_arena = false; // read replies into a per connection arena, see detail::ReplyArena
+    int slow_log_threshold = 100; // milliseconds, slower commands go to LOG_WARN or the slow command hook, 0 disables
+    bool enable_metrics = false;  // per command latency histograms, see RedisMgr::Metrics
+    int protocol = 2;           // 3 sends HELLO 3 on connect, replies then come as RESP3 maps, sets, doubles...
+    size_t near_cache_size = 0; // keys kept by the client side cache of RedisMgr, 0 disables it, needs redis 6
+    int coalesce_window = 0;    // microseconds concurrent commands of RedisMgr wait to share one write, 0 disables it
+    size_t coalesce_batch = 64; // commands sent together at most when coalescing
+    std::vector<std::string> replicas;  // "host:port" of replicas that serve the read only commands of RedisMgr
+    ReadPolicy read_policy = ReadPolicy::Latency;
+    size_t chunk_size = 1000;   // elements per command when a container given to MGET, MSET, SADD... is split, 0 never splits
 };
 
 class RedisReply {
 public:
     RedisReply(void* reply)
         : reply_(static_cast<redisReply*>(reply), freeReplyObject) {}
+    // a reply whose memory is owned by someone else, see detail::ReplyArena
+    explicit RedisReply(std::shared_ptr<redisReply> reply) : reply_(std::move(reply)) {}
     RedisReply(const RedisReply& other) : reply_(other.reply_) {}
-    std::shared_ptr<redisReply> operator->() { return reply_; }
-    operator bool() { return reply_ != nullptr; }
-    operator redisReply* () { return reply_.get(); }
+    RedisReply(RedisReply&& other) = default;
+    RedisReply& operator=(const RedisReply& other) = default;
+    RedisReply& operator=(RedisReply&& other) = default;
+    redisReply* operator->() const { return reply_.get(); }
+    operator bool() const { return reply_ != nullptr; }
+    operator redisReply* () const { return reply_.get(); }
 
 private:
     std::shared_ptr<redisReply> reply_;
@@ -59,6 +101,150 @@ struct is_pair : std::false_type {};
 
 template<typename T>
 struct is_pair<T, std::void_t<typename T::first_type, typename T::second_type>> : std::true_type {};
+
+// a container argument that expands to one bulk string per element, strings are not
+template <typename T>
+constexpr bool is_arg_range_v = is_container<std::decay_t<T>>::value &&
+    !std::is_convertible_v<const std::decay_t<T>&, std::string_view>;
+
+// a struct described by REDIS_STRUCT, its fields are a tuple of StructField
+template <typename C, typename M>
+struct StructField {
+    std::string_view name;
+    M C::* member;
+};
+
+template <typename C, typename M>
+constexpr StructField<C, M> MakeStructField(std::string_view name, M C::* member) {
+    return { name, member };
+}
+
+template <typename T, typename = void>
+struct is_redis_struct : std::false_type {};
+
+template <typename T>
+struct is_redis_struct<T, std::void_t<decltype(RedisStructFields(static_cast<const T*>(nullptr)))>> : std::true_type {};
+
+template <typename T>
+constexpr auto StructFields() {
+    return RedisStructFields(static_cast<const T*>(nullptr));
+}
+
+template <typename T>
+struct is_optional : std::false_type {};
+
+template <typename T>
+struct is_optional<std::optional<T>> : std::true_type {};
+}
+
+#define REDISFMT_EXPAND(x) x
+#define REDISFMT_FE_1(m, t, x) m(t, x)
+#define REDISFMT_FE_2(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_1(m, t, __VA_ARGS__))
+#define REDISFMT_FE_3(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_2(m, t, __VA_ARGS__))
+#define REDISFMT_FE_4(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_3(m, t, __VA_ARGS__))
+#define REDISFMT_FE_5(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_4(m, t, __VA_ARGS__))
+#define REDISFMT_FE_6(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_5(m, t, __VA_ARGS__))
+#define REDISFMT_FE_7(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_6(m, t, __VA_ARGS__))
+#define REDISFMT_FE_8(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_7(m, t, __VA_ARGS__))
+#define REDISFMT_FE_9(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_8(m, t, __VA_ARGS__))
+#define REDISFMT_FE_10(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_9(m, t, __VA_ARGS__))
+#define REDISFMT_FE_11(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_10(m, t, __VA_ARGS__))
+#define REDISFMT_FE_12(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_11(m, t, __VA_ARGS__))
+#define REDISFMT_FE_13(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_12(m, t, __VA_ARGS__))
+#define REDISFMT_FE_14(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_13(m, t, __VA_ARGS__))
+#define REDISFMT_FE_15(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_14(m, t, __VA_ARGS__))
+#define REDISFMT_FE_16(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_15(m, t, __VA_ARGS__))
+#define REDISFMT_FE_17(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_16(m, t, __VA_ARGS__))
+#define REDISFMT_FE_18(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_17(m, t, __VA_ARGS__))
+#define REDISFMT_FE_19(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_18(m, t, __VA_ARGS__))
+#define REDISFMT_FE_20(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_19(m, t, __VA_ARGS__))
+#define REDISFMT_FE_21(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_20(m, t, __VA_ARGS__))
+#define REDISFMT_FE_22(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_21(m, t, __VA_ARGS__))
+#define REDISFMT_FE_23(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_22(m, t, __VA_ARGS__))
+#define REDISFMT_FE_24(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_23(m, t, __VA_ARGS__))
+#define REDISFMT_FE_25(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_24(m, t, __VA_ARGS__))
+#define REDISFMT_FE_26(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_25(m, t, __VA_ARGS__))
+#define REDISFMT_FE_27(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_26(m, t, __VA_ARGS__))
+#define REDISFMT_FE_28(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_27(m, t, __VA_ARGS__))
+#define REDISFMT_FE_29(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_28(m, t, __VA_ARGS__))
+#define REDISFMT_FE_30(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_29(m, t, __VA_ARGS__))
+#define REDISFMT_FE_31(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_30(m, t, __VA_ARGS__))
+#define REDISFMT_FE_32(m, t, x, ...) m(t, x), REDISFMT_EXPAND(REDISFMT_FE_31(m, t, __VA_ARGS__))
+#define REDISFMT_FE_PICK(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, NAME, ...) NAME
+#define REDISFMT_FOR_EACH(m, t, ...) \
+    REDISFMT_EXPAND(REDISFMT_FE_PICK(__VA_ARGS__, REDISFMT_FE_32, REDISFMT_FE_31, REDISFMT_FE_30, REDISFMT_FE_29, REDISFMT_FE_28, REDISFMT_FE_27, REDISFMT_FE_26, REDISFMT_FE_25, REDISFMT_FE_24, REDISFMT_FE_23, REDISFMT_FE_22, REDISFMT_FE_21, REDISFMT_FE_20, REDISFMT_FE_19, REDISFMT_FE_18, REDISFMT_FE_17, REDISFMT_FE_16, REDISFMT_FE_15, REDISFMT_FE_14, REDISFMT_FE_13, REDISFMT_FE_12, REDISFMT_FE_11, REDISFMT_FE_10, REDISFMT_FE_9, REDISFMT_FE_8, REDISFMT_FE_7, REDISFMT_FE_6, REDISFMT_FE_5, REDISFMT_FE_4, REDISFMT_FE_3, REDISFMT_FE_2, REDISFMT_FE_1)(m, t, __VA_ARGS__))
+#define REDISFMT_STRUCT_FIELD(type, field) ::rdsfmt::detail::MakeStructField(#field, &type::field)
+
+/*
+Describe the fields of a struct at compile time, in the namespace of the struct:
+
+struct Profile { std::string name; int64_t score = 0; int level = 0; };
+REDIS_STRUCT(Profile, name, score, level)
+
+Then HGETALL<Profile>(key) decodes a hash straight into the members and
+HSET(key, profile) writes them as field value pairs. Members can be strings,
+numbers, bool, enums or std::optional of those, at most 32 of them.
+*/
+#define REDIS_STRUCT(type, ...) \
+inline constexpr auto RedisStructFields(const type*) { \
+    return std::make_tuple(REDISFMT_FOR_EACH(REDISFMT_STRUCT_FIELD, type, __VA_ARGS__)); \
+}
+
+/*
+A value sent and read as one bulk string in the format of a codec, see
+redisfmt/codec.hpp for the codecs. A codec is a type with
+
+    template <typename T> static void Encode(const T& value, fmt::memory_buffer& out);
+    template <typename T> static bool Decode(std::string_view data, T& value);
+
+Per call, the argument is wrapped with Encode and the result type names the codec:
+
+    mgr.SET("user:1", Encode<PackedCodec>(profile));
+    auto profile = mgr.GET<Encoded<Profile, PackedCodec>>("user:1");
+*/
+template <typename T, typename Codec>
+struct Encoded {
+    T value;
+};
+
+template <typename Codec, typename T>
+Encoded<const T&, Codec> Encode(const T& value) {
+    return { value };
+}
+
+/*
+Per type, in the namespace of the type, every SET, HSET or ZADD argument of
+that type is encoded and every reply decoded into it is decoded with codec:
+
+REDIS_CODEC(Profile, PackedCodec)
+
+A REDIS_STRUCT with a codec is a single value, HSET(key, profile) is no longer
+one field per member then.
+*/
+#define REDIS_CODEC(type, codec) \
+inline constexpr codec* RedisValueCodec(const type*) { return nullptr; }
+
+namespace detail {
+template <typename T>
+struct is_encoded : std::false_type {};
+
+template <typename T, typename Codec>
+struct is_encoded<Encoded<T, Codec>> : std::true_type {};
+
+template <typename T>
+struct codec_of;
+
+template <typename T, typename Codec>
+struct codec_of<Encoded<T, Codec>> { using type = Codec; };
+
+template <typename T, typename = void>
+struct has_value_codec : std::false_type {};
+
+template <typename T>
+struct has_value_codec<T, std::void_t<decltype(RedisValueCodec(static_cast<const T*>(nullptr)))>> : std::true_type {};
+
+template <typename T>
+using value_codec_t = std::remove_pointer_t<decltype(RedisValueCodec(static_cast<const T*>(nullptr)))>;
 }
 
 namespace RedisOp {
@@ -76,6 +262,8 @@ namespace RedisOp {
 
 template<const char* op, typename T>
 struct RedisOptions {
+    // an option without value is left out of the command
+    RedisOptions() = default;
     RedisOptions(T v) : value(std::forward<T>(v)) {}
 
     constexpr static std::string_view option{ op };
@@ -111,6 +299,495 @@ using KEEPTTL = RedisOptions<OptionStrKEEPTTL, void>;
 constexpr char OptionStrGET[] = "GET";
 using GET = RedisOptions<OptionStrGET, void>;
 
+constexpr char OptionStrMATCH[] = "MATCH";
+using MATCH = RedisOptions<OptionStrMATCH, std::string_view>;
+
+constexpr char OptionStrCOUNT[] = "COUNT";
+using COUNT = RedisOptions<OptionStrCOUNT, int64_t>;
+
+constexpr char OptionStrTYPE[] = "TYPE";
+using TYPE = RedisOptions<OptionStrTYPE, std::string_view>;
+
+constexpr char OptionStrBLOCK[] = "BLOCK";
+using BLOCK = RedisOptions<OptionStrBLOCK, int64_t>;
+
+// stream trimming of XADD and XTRIM, "~" lets redis trim whole nodes only, which is much cheaper
+template<const char* op, typename T>
+struct StreamTrim {
+    StreamTrim(T v, bool approximate = true) : threshold(std::move(v)), approximate(approximate) {}
+
+    constexpr static std::string_view option{ op };
+    T threshold;
+    bool approximate;
+};
+
+constexpr char OptionStrMAXLEN[] = "MAXLEN";
+using MAXLEN = StreamTrim<OptionStrMAXLEN, int64_t>;
+
+constexpr char OptionStrMINID[] = "MINID";
+using MINID = StreamTrim<OptionStrMINID, std::string_view>;
+
+}
+
+namespace detail {
+// number of bulk strings an argument expands to, 0 when only known at runtime
+template <typename T, typename = void>
+struct arg_count : std::integral_constant<size_t, 1> {};
+
+template <typename T>
+struct arg_count<T, std::enable_if_t<is_container<T>::value && !std::is_convertible_v<const T&, std::string_view>>>
+    : std::integral_constant<size_t, 0> {};
+
+template <typename K, typename V>
+struct arg_count<std::pair<K, V>>
+    : std::integral_constant<size_t, (arg_count<std::decay_t<K>>::value && arg_count<std::decay_t<V>>::value)
+        ? arg_count<std::decay_t<K>>::value + arg_count<std::decay_t<V>>::value : 0> {};
+
+// an option with a value may be left out, see RedisOptions
+template <const char* op, typename T>
+struct arg_count<RedisOp::RedisOptions<op, T>> : std::integral_constant<size_t, 0> {};
+
+template <const char* op>
+struct arg_count<RedisOp::RedisOptions<op, void>> : std::integral_constant<size_t, 1> {};
+
+template <const char* op, typename T>
+struct arg_count<RedisOp::StreamTrim<op, T>> : std::integral_constant<size_t, 3> {};
+
+// a field value pair per member, an empty std::optional member is left out
+template <typename T>
+constexpr size_t StructArgCount() {
+    return std::apply([](auto... field) {
+        return (is_optional<std::decay_t<decltype(std::declval<T&>().*field.member)>>::value || ...)
+            ? size_t(0) : 2 * sizeof...(field);
+    }, StructFields<T>());
+}
+
+template <typename T>
+struct arg_count<T, std::enable_if_t<is_redis_struct<T>::value && !has_value_codec<T>::value>>
+    : std::integral_constant<size_t, StructArgCount<T>()> {};
+
+template <typename... Args>
+constexpr bool kStaticArgCount = ((arg_count<std::decay_t<Args>>::value != 0) && ...);
+
+template <typename... Args>
+constexpr size_t kArgCount = (arg_count<std::decay_t<Args>>::value + ... + 0);
+
+template <typename T>
+size_t FieldArgCount(const T& value) {
+    if constexpr (is_optional<T>::value)
+        return value ? 2 : 0;
+    else
+        return 2;
+}
+
+template <typename T>
+size_t CountArg(const T& arg) {
+    if constexpr (arg_count<T>::value != 0) {
+        return arg_count<T>::value;
+    }
+    else if constexpr (is_pair<T>::value) {
+        return CountArg(arg.first) + CountArg(arg.second);
+    }
+    else if constexpr (is_container<T>::value) {
+        using V = std::decay_t<typename T::value_type>;
+        if constexpr (arg_count<V>::value != 0) {
+            return arg.size() * arg_count<V>::value;
+        }
+        else {
+            size_t count = 0;
+            for (auto& item : arg)
+                count += CountArg(item);
+            return count;
+        }
+    }
+    else if constexpr (is_redis_struct<T>::value) {
+        return std::apply([&](const auto&... field) {
+            return (FieldArgCount(arg.*field.member) + ...);
+        }, StructFields<T>());
+    }
+    else {
+        return arg.value ? 2 : 0;
+    }
+}
+
+constexpr void AppendNumber(char* out, size_t& pos, size_t value) {
+    char digits[20] = {};
+    size_t n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n)
+        out[pos++] = digits[--n];
+}
+
+// RespCommand::flags, how the arguments map to keys. By default the first argument is the key
+constexpr uint32_t kCmdNoKey = 1;       // no key at all, AUTH, SELECT
+constexpr uint32_t kCmdMultiKey = 2;    // every argument is a key, DEL
+constexpr uint32_t kCmdCacheable = 4;   // read only, the reply may be kept by the near cache
+constexpr uint32_t kCmdScript = 8;      // EVAL, EVALSHA: script, numkeys, then a container of keys
+constexpr uint32_t kCmdReadOnly = 16;   // never writes, RedisMgr may send it to a replica
+constexpr uint32_t kCmdBlocking = 32;   // may wait on the server, XREADGROUP BLOCK, never coalesced
+constexpr uint32_t kCmdStreamKey = 64;  // the key is the argument before the last, XREADGROUP ... STREAMS key id
+constexpr uint32_t kCmdKeyValue = 128;  // key value pairs, or a container of them, MSET
+
+/*
+RESP encoding of a command name. When the argument types have a fixed arity the
+"*argc" array header is part of it too, then the whole prefix is a constant
+built at compile time, see MakeRespCommand.
+*/
+template <size_t N>
+struct RespCommand {
+    char data[N] = {};
+    size_t size = 0;
+    size_t prefix = 0;  // bytes of the "*argc\r\n" header, 0 when the arity is only known at runtime
+    size_t words = 0;
+    const char* name = nullptr;
+    size_t name_size = 0;
+    uint32_t flags = 0;
+
+    constexpr std::string_view Name() const { return { name, name_size }; }
+};
+
+/*
+static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(field)>("HGET");
+A name of several words, "SCRIPT LOAD", is split into several bulk strings.
+*/
+template <typename... Args, size_t L>
+constexpr auto MakeRespCommand(const char (&name)[L], uint32_t flags = 0) {
+    RespCommand<L * 8 + 32> cmd{};
+    cmd.name = name;
+    cmd.name_size = L - 1;
+    cmd.flags = flags;
+
+    for (size_t i = 0; i + 1 < L; i++) {
+        if (name[i] != ' ' && (i == 0 || name[i - 1] == ' '))
+            cmd.words++;
+    }
+
+    size_t pos = 0;
+    if constexpr (kStaticArgCount<Args...>) {
+        cmd.data[pos++] = '*';
+        AppendNumber(cmd.data, pos, cmd.words + kArgCount<Args...>);
+        cmd.data[pos++] = '\r';
+        cmd.data[pos++] = '\n';
+        cmd.prefix = pos;
+    }
+    for (size_t i = 0; i + 1 < L;) {
+        if (name[i] == ' ') {
+            i++;
+            continue;
+        }
+        size_t end = i;
+        while (end + 1 < L && name[end] != ' ')
+            end++;
+        cmd.data[pos++] = '$';
+        AppendNumber(cmd.data, pos, end - i);
+        cmd.data[pos++] = '\r';
+        cmd.data[pos++] = '\n';
+        while (i < end)
+            cmd.data[pos++] = name[i++];
+        cmd.data[pos++] = '\r';
+        cmd.data[pos++] = '\n';
+    }
+    cmd.size = pos;
+    return cmd;
+}
+
+template <typename T>
+struct is_resp_command : std::false_type {};
+
+template <size_t N>
+struct is_resp_command<RespCommand<N>> : std::true_type {};
+
+template <typename Cmd>
+std::string_view CommandName(const Cmd& command) {
+    if constexpr (is_resp_command<Cmd>::value)
+        return command.Name();
+    else
+        return std::string_view(command);
+}
+
+// name the metrics of a command are kept under, only the first word of a runtime command line
+template <typename Cmd>
+std::string_view MetricName(const Cmd& command) {
+    if constexpr (is_resp_command<Cmd>::value) {
+        return command.Name();
+    }
+    else {
+        std::string_view name(command);
+        return name.substr(0, name.find(' '));
+    }
+}
+
+// a runtime command name is assumed to take its key first
+template <typename Cmd>
+uint32_t CommandFlags(const Cmd& command) {
+    if constexpr (is_resp_command<Cmd>::value)
+        return command.flags;
+    else
+        return 0;
+}
+
+/*
+Appends commands in RESP to a buffer that is handed to hiredis as is with
+redisAppendFormattedCommand. String like arguments are copied with their
+length, so they are binary safe, numbers are formatted on the stack, RedisOp
+options expand to option and value and containers expand in place. An
+Encoded argument, or one of a type with a REDIS_CODEC, is written by its codec.
+*/
+class RespWriter {
+public:
+    explicit RespWriter(fmt::memory_buffer& buffer) : buffer_(buffer) {}
+
+    template <size_t N, typename... Args>
+    void Command(const RespCommand<N>& command, const Args&... args) {
+        if (command.prefix == 0)
+            Header(command.words + (CountArg(args) + ... + 0));
+        Append(command.data, command.size);
+        (Add(args), ...);
+    }
+
+    // a runtime command name is split on spaces, so a whole command line can be passed too
+    template <typename... Args>
+    void Command(std::string_view command, const Args&... args) {
+        size_t words = 0;
+        ForEachWord(command, [&](std::string_view) { words++; });
+        Header(words + (CountArg(args) + ... + 0));
+        ForEachWord(command, [&](std::string_view word) { Bulk(word.data(), word.size()); });
+        (Add(args), ...);
+    }
+
+    template <typename T>
+    void Add(const T& arg) {
+        if constexpr (is_encoded<T>::value) {
+            AddEncoded<typename codec_of<T>::type>(arg.value);
+        }
+        else if constexpr (has_value_codec<T>::value) {
+            AddEncoded<value_codec_t<T>>(arg);
+        }
+        else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            std::string_view str(arg);
+            Bulk(str.data(), str.size());
+        }
+        else if constexpr (std::is_same_v<T, char>) {
+            Bulk(&arg, 1);
+        }
+        else if constexpr (std::is_same_v<T, bool>) {
+            Add(arg ? std::string_view("true") : std::string_view("false"));
+        }
+        else if constexpr (std::is_enum_v<T>) {
+            Add(static_cast<std::underlying_type_t<T>>(arg));
+        }
+        else if constexpr (std::is_integral_v<T>) {
+            char buf[24];
+            auto res = std::to_chars(buf, buf + sizeof(buf), arg);
+            Bulk(buf, res.ptr - buf);
+        }
+        else if constexpr (std::is_floating_point_v<T>) {
+            char buf[32];
+            auto res = fmt::format_to_n(buf, sizeof(buf), "{}", arg);
+            Bulk(buf, res.size);
+        }
+        else if constexpr (is_pair<T>::value) {
+            Add(arg.first);
+            Add(arg.second);
+        }
+        else if constexpr (is_container<T>::value) {
+            for (auto& item : arg)
+                Add(item);
+        }
+        else if constexpr (is_redis_struct<T>::value) {
+            std::apply([&](const auto&... field) { (AddField(field.name, arg.*field.member), ...); }, StructFields<T>());
+        }
+        else {
+            fmt::memory_buffer str;
+            fmt::format_to(std::back_inserter(str), "{}", arg);
+            Bulk(str.data(), str.size());
+        }
+    }
+
+    template <const char* op, typename T>
+    void Add(const RedisOp::RedisOptions<op, T>& option) {
+        if constexpr (std::is_void_v<T>) {
+            Add(option.option);
+        }
+        else if (option.value) {
+            Add(option.option);
+            Add(*option.value);
+        }
+    }
+
+    template <const char* op, typename T>
+    void Add(const RedisOp::StreamTrim<op, T>& trim) {
+        Add(trim.option);
+        Add(trim.approximate ? std::string_view("~") : std::string_view("="));
+        Add(trim.threshold);
+    }
+
+    template <typename T>
+    void AddField(std::string_view name, const T& value) {
+        if constexpr (is_optional<T>::value) {
+            if (value)
+                AddField(name, *value);
+        }
+        else {
+            Add(name);
+            Add(value);
+        }
+    }
+
+    // the codec writes into a scratch buffer first, the bulk header needs the length
+    template <typename Codec, typename T>
+    void AddEncoded(const T& value) {
+        fmt::memory_buffer encoded;
+        Codec::Encode(value, encoded);
+        Bulk(encoded.data(), encoded.size());
+    }
+
+    void Header(size_t argc) {
+        char buf[24];
+        buf[0] = '*';
+        auto res = std::to_chars(buf + 1, buf + sizeof(buf) - 2, argc);
+        *res.ptr++ = '\r';
+        *res.ptr++ = '\n';
+        Append(buf, res.ptr - buf);
+    }
+
+    void Bulk(const char* data, size_t len) {
+        char buf[24];
+        buf[0] = '$';
+        auto res = std::to_chars(buf + 1, buf + sizeof(buf) - 2, len);
+        *res.ptr++ = '\r';
+        *res.ptr++ = '\n';
+        Append(buf, res.ptr - buf);
+        Append(data, len);
+        Append("\r\n", 2);
+    }
+
+private:
+    void Append(const char* data, size_t len) {
+        buffer_.append(data, data + len);
+    }
+
+    template <typename F>
+    static void ForEachWord(std::string_view command, F&& f) {
+        size_t pos = 0;
+        while (pos < command.size()) {
+            size_t end = command.find(' ', pos);
+            if (end == std::string_view::npos)
+                end = command.size();
+            if (end > pos)
+                f(command.substr(pos, end - pos));
+            pos = end + 1;
+        }
+    }
+
+    fmt::memory_buffer& buffer_;
+};
+
+// bytes of an argument used as a key, numbers are formatted into buf
+template <typename T>
+std::string_view ArgBytes(const T& arg, char (&buf)[32]) {
+    if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+        return std::string_view(arg);
+    }
+    else if constexpr (std::is_integral_v<T> && !std::is_same_v<T, bool> && !std::is_same_v<T, char>) {
+        auto res = std::to_chars(buf, buf + sizeof(buf), arg);
+        return std::string_view(buf, res.ptr - buf);
+    }
+    else if constexpr (is_arg_range_v<T>) {
+        // the keys of MGET or DEL, the first one stands for them all
+        return std::begin(arg) == std::end(arg) ? std::string_view() : ArgBytes(*std::begin(arg), buf);
+    }
+    else if constexpr (is_pair<T>::value) {
+        // key value pair of MSET, the key comes first
+        return ArgBytes(arg.first, buf);
+    }
+    else if constexpr (is_redis_struct<T>::value || is_encoded<T>::value || has_value_codec<T>::value) {
+        // a value that is never a key, the fields of XADD or HSET, only reached by the key scan of kCmdMultiKey
+        return std::string_view();
+    }
+    else {
+        auto res = fmt::format_to_n(buf, sizeof(buf), "{}", arg);
+        return std::string_view(buf, std::min(res.size, sizeof(buf)));
+    }
+}
+
+// key of a kCmdStreamKey command, the argument before the last when it is string like
+template <typename... Args>
+std::optional<std::string_view> StreamKey(const Args&... args) {
+    if constexpr (sizeof...(args) >= 2) {
+        constexpr size_t index = sizeof...(args) - 2;
+        using Key = std::tuple_element_t<index, std::tuple<Args...>>;
+        if constexpr (std::is_convertible_v<const Key&, std::string_view>)
+            return std::string_view(std::get<index>(std::forward_as_tuple(args...)));
+    }
+    return std::nullopt;
+}
+
+// the part of a key that is hashed: the inside of the first non empty {...}, else the whole key
+constexpr std::string_view HashTag(std::string_view key) {
+    size_t open = key.find('{');
+    if (open != std::string_view::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != std::string_view::npos && close != open + 1)
+            return key.substr(open + 1, close - open - 1);
+    }
+    return key;
+}
+
+// parse a bulk string into a struct member, false when it is not a valid value
+template <typename T>
+bool ParseValue(std::string_view str, T& out) {
+    if constexpr (std::is_same_v<T, std::string>) {
+        out.assign(str.data(), str.size());
+        return true;
+    }
+    else if constexpr (is_optional<T>::value) {
+        typename T::value_type value{};
+        if (!ParseValue(str, value))
+            return false;
+        out = std::move(value);
+        return true;
+    }
+    else if constexpr (std::is_same_v<T, bool>) {
+        if (str == "1" || str == "true")
+            out = true;
+        else if (str == "0" || str == "false" || str.empty())
+            out = false;
+        else
+            return false;
+        return true;
+    }
+    else if constexpr (std::is_enum_v<T>) {
+        std::underlying_type_t<T> value{};
+        if (!ParseValue(str, value))
+            return false;
+        out = static_cast<T>(value);
+        return true;
+    }
+    else if constexpr (std::is_arithmetic_v<T>) {
+        auto res = std::from_chars(str.data(), str.data() + str.size(), out);
+        return res.ec == std::errc() && res.ptr == str.data() + str.size();
+    }
+    else {
+        static_assert(std::is_same_v<T, std::string>, "unsupported REDIS_STRUCT member type");
+        return false;
+    }
+}
+
+/*
+Set the member called name. The names are compared in declaration order, a
+string_view compare rejects on the length first, so a miss costs a few integer
+compares per field and no allocation.
+*/
+template <typename T>
+bool SetStructField(T& data, std::string_view name, std::string_view value, bool& parsed) {
+    return std::apply([&](const auto&... field) {
+        return ((field.name == name && (parsed = ParseValue(value, data.*field.member), true)) || ...);
+    }, StructFields<T>());
+}
 }
 
 
@@ -124,6 +801,8 @@ GetFromReply.
 template <typename T> tl::expected<T, int> GetFromReply(redisReply* reply);
 
 template <int RT, typename T, typename = void> struct RedisReplyConvert;
+
+// kept for structs registered with the runtime reflection, new code should use REDIS_STRUCT
 #define REDIS_ARRAY_CONVERT_REPLY(data_type) \
 template <> struct RedisReplyConvert<REDIS_REPLY_ARRAY, data_type> { \
 static tl::expected <data_type, int> Convert(redisReply* reply) { \
@@ -159,6 +838,37 @@ static tl::expected <data_type, int> Convert(redisReply* reply) { \
 }
 
 
+// a hash read by HGETALL into a REDIS_STRUCT, unknown fields are skipped
+template <typename T>
+struct RedisReplyConvert<REDIS_REPLY_ARRAY, T, std::enable_if_t<detail::is_redis_struct<T>::value>> {
+    static tl::expected<T, int> Convert(redisReply* reply) {
+        if (reply->elements == 0) {
+            LOG_ERROR("%s, reply->elements=0 is invalid", __FUNCTION__);
+            return tl::unexpected{ -1 };
+        }
+        else if (reply->elements % 2 != 0) {
+            LOG_ERROR("%s, reply->elements=%zu is invalid", __FUNCTION__, reply->elements);
+            return tl::unexpected{ -1 };
+        }
+        T data{};
+        for (size_t i = 0; i < reply->elements; i += 2) {
+            const redisReply* name = reply->element[i];
+            const redisReply* value = reply->element[i + 1];
+            if (name->type != REDIS_REPLY_STRING || value->type != REDIS_REPLY_STRING)
+                continue;
+            bool parsed = false;
+            std::string_view field(name->str, name->len);
+            if (!detail::SetStructField(data, field, std::string_view(value->str, value->len), parsed)) {
+                LOG_INFO("%s: skip unknown field %.*s", __FUNCTION__, static_cast<int>(field.size()), field.data());
+            }
+            else if (!parsed) {
+                LOG_WARN("%s: invalid value of field %.*s", __FUNCTION__, static_cast<int>(field.size()), field.data());
+            }
+        }
+        return data;
+    }
+};
+
 /*
 check if the type T has a convert function
 tmeplate<int RT, typename T> tl::expected<T, int> RedisReplyConvert(redisReply*);
@@ -182,15 +892,11 @@ struct is_redis_reply_convertible<
     RT, T, std::enable_if_t<has_convert_function<RT, T>::value>>
     : public std::true_type {};
 
-template <> struct RedisReplyConvert<REDIS_REPLY_INTEGER, int> {
-    static inline tl::expected<int, int> Convert(redisReply* reply) {
-        return static_cast<int>(reply->integer);
-    }
-};
-
-template <> struct RedisReplyConvert<REDIS_REPLY_INTEGER, size_t> {
-    static inline tl::expected<size_t, int> Convert(redisReply* reply) {
-        return reply->integer;
+// numbers and bool, SISMEMBER and EXISTS answer 0 or 1
+template <typename T>
+struct RedisReplyConvert<REDIS_REPLY_INTEGER, T, std::enable_if_t<std::is_arithmetic_v<T>>> {
+    static inline tl::expected<T, int> Convert(redisReply* reply) {
+        return static_cast<T>(reply->integer);
     }
 };
 
@@ -202,86 +908,161 @@ template <> struct RedisReplyConvert<REDIS_REPLY_INTEGER, std::string> {
 
 template <> struct RedisReplyConvert<REDIS_REPLY_STRING, std::string> {
     static inline tl::expected<std::string, int> Convert(redisReply* reply) {
-        return std::string(reply->str);
+        return std::string(reply->str, reply->len);
     }
 };
 
-template <> struct RedisReplyConvert<REDIS_REPLY_STRING, int> {
-    static inline tl::expected<int, int> Convert(redisReply* reply) {
-        try {
-            return std::stoi(reply->str);
-        }
-        catch (std::invalid_argument const& e) {
-            return tl::unexpected{ -1 };
-        }
-        return tl::unexpected{ -1 };
+template <> struct RedisReplyConvert<REDIS_REPLY_STRING, std::string_view> {
+    static inline tl::expected<std::string_view, int> Convert(redisReply* reply) {
+        return std::string_view(reply->str, reply->len);
     }
 };
 
-template <> struct RedisReplyConvert<REDIS_REPLY_STRING, int64_t> {
-    static inline tl::expected<int64_t, int> Convert(redisReply* reply) {
-        try {
-            return std::stol(reply->str);
-        }
-        catch (std::invalid_argument const& e) {
+/*
+Numbers sent as bulk strings, INCRBYFLOAT and the RESP2 ZSCORE for example. The
+whole string has to be a number in the range of T, anything else is an error
+without throwing.
+*/
+template <typename T>
+struct RedisReplyConvert<REDIS_REPLY_STRING, T, std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>>> {
+    static inline tl::expected<T, int> Convert(redisReply* reply) {
+        T value{};
+        if (!detail::ParseValue(std::string_view(reply->str, reply->len), value))
             return tl::unexpected{ -1 };
-        }
-        return tl::unexpected{ -1 };
+        return value;
     }
 };
 
-template <> struct RedisReplyConvert<REDIS_REPLY_STRING, unsigned long> {
-    static inline tl::expected<unsigned long, int> Convert(redisReply* reply) {
-        try {
-            return std::stol(reply->str);
-        }
-        catch (std::invalid_argument const& e) {
+// a value written with Encode<Codec>, the codec decides what it can still read
+template <typename T, typename Codec>
+struct RedisReplyConvert<REDIS_REPLY_STRING, Encoded<T, Codec>> {
+    static inline tl::expected<Encoded<T, Codec>, int> Convert(redisReply* reply) {
+        Encoded<T, Codec> result{};
+        if (!Codec::Decode(std::string_view(reply->str, reply->len), result.value)) {
+            LOG_WARN("%s: value of %zu bytes can not be decoded", __FUNCTION__, reply->len);
             return tl::unexpected{ -1 };
         }
-        return tl::unexpected{ -1 };
+        return result;
     }
 };
 
+// a type with a REDIS_CODEC
 template <typename T>
-struct RedisReplyConvert<
-    REDIS_REPLY_ARRAY, T,
-    std::enable_if_t<detail::is_container<T>::value&&
-    detail::is_pair<typename T::value_type>::value>> {
-    using K = typename T::value_type::first_type;
-    using V = typename T::value_type::second_type;
+struct RedisReplyConvert<REDIS_REPLY_STRING, T, std::enable_if_t<detail::has_value_codec<T>::value>> {
     static inline tl::expected<T, int> Convert(redisReply* reply) {
-        T result;
-
-        auto inserter = std::inserter(result, result.end());
-        for (size_t i = 0, e = reply->elements; i < e; i += 2) {
-            auto k = GetFromReply<std::decay_t<K>>(reply->element[i]);
-            auto v = GetFromReply<std::decay_t<V>>(reply->element[i + 1]);
-            if (k && v) {
-                *inserter++ =
-                    std::make_pair<K, V>(std::move(k.value()), std::move(v.value()));
-            }
+        T value{};
+        if (!detail::value_codec_t<T>::Decode(std::string_view(reply->str, reply->len), value)) {
+            LOG_WARN("%s: value of %zu bytes can not be decoded", __FUNCTION__, reply->len);
+            return tl::unexpected{ -1 };
         }
-        return std::move(result);
+        return value;
     }
 };
 
+// RESP3 double, hiredis keeps the text next to the parsed value. An integer T
+// reads the text, so a fraction is an error like with the RESP2 bulk string
 template <typename T>
-struct RedisReplyConvert<
-    REDIS_REPLY_ARRAY, T,
-    std::enable_if_t<detail::is_container<T>::value &&
-    !detail::is_pair<typename T::value_type>::value>> {
-    using V = typename T::value_type;
+struct RedisReplyConvert<REDIS_REPLY_DOUBLE, T, std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>>> {
     static inline tl::expected<T, int> Convert(redisReply* reply) {
-        T result;
-        auto inserter = std::inserter(result, result.end());
-        for (size_t i = 0, e = reply->elements; i < e; i++) {
-            auto v = GetFromReply<std::decay_t<V>>(reply->element[i]);
-            if (v)
-                *inserter++ = v.value();
-            else if constexpr (std::is_same_v<V, std::string>)
-                *inserter++ = std::string(kRedisNilStr);
+        if constexpr (std::is_integral_v<T>) {
+            T value{};
+            if (!detail::ParseValue(std::string_view(reply->str, reply->len), value))
+                return tl::unexpected{ -1 };
+            return value;
         }
-        return std::move(result);
+        else {
+            return static_cast<T>(reply->dval);
+        }
+    }
+};
+
+template <> struct RedisReplyConvert<REDIS_REPLY_DOUBLE, std::string> {
+    static inline tl::expected<std::string, int> Convert(redisReply* reply) {
+        return std::string(reply->str, reply->len);
+    }
+};
+
+template <typename T>
+struct RedisReplyConvert<REDIS_REPLY_BOOL, T, std::enable_if_t<std::is_arithmetic_v<T>>> {
+    static inline tl::expected<T, int> Convert(redisReply* reply) {
+        return static_cast<T>(reply->integer != 0);
+    }
+};
+
+// RESP3 big number, only as text or when it fits into T
+template <> struct RedisReplyConvert<REDIS_REPLY_BIGNUM, std::string> {
+    static inline tl::expected<std::string, int> Convert(redisReply* reply) {
+        return std::string(reply->str, reply->len);
+    }
+};
+
+template <typename T>
+struct RedisReplyConvert<REDIS_REPLY_BIGNUM, T, std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>>>
+    : RedisReplyConvert<REDIS_REPLY_STRING, T> {};
+
+template <> struct RedisReplyConvert<REDIS_REPLY_VERB, std::string> {
+    static inline tl::expected<std::string, int> Convert(redisReply* reply) {
+        return std::string(reply->str, reply->len);
+    }
+};
+
+template <typename T>
+struct RedisReplyConvert<
+    REDIS_REPLY_ARRAY, T,
+    std::enable_if_t<detail::is_container<T>::value&&
+    detail::is_pair<typename T::value_type>::value>> {
+    using K = typename T::value_type::first_type;
+    using V = typename T::value_type::second_type;
+    static inline tl::expected<T, int> Convert(redisReply* reply) {
+        T result;
+
+        auto inserter = std::inserter(result, result.end());
+        // RESP3 sends WITHSCORES and the like as an array of [member, score] arrays
+        if (reply->elements > 0 && reply->element[0]->type == REDIS_REPLY_ARRAY) {
+            for (size_t i = 0, e = reply->elements; i < e; i++) {
+                auto pair = GetFromReply<std::pair<std::decay_t<K>, std::decay_t<V>>>(reply->element[i]);
+                if (pair)
+                    *inserter++ = std::move(pair.value());
+            }
+            return result;
+        }
+        for (size_t i = 0, e = reply->elements; i < e; i += 2) {
+            auto k = GetFromReply<std::decay_t<K>>(reply->element[i]);
+            auto v = GetFromReply<std::decay_t<V>>(reply->element[i + 1]);
+            if (k && v) {
+                *inserter++ =
+                    std::make_pair<K, V>(std::move(k.value()), std::move(v.value()));
+            }
+        }
+        return result;
+    }
+};
+
+template <typename T>
+struct RedisReplyConvert<
+    REDIS_REPLY_ARRAY, T,
+    std::enable_if_t<detail::is_container<T>::value &&
+    !detail::is_pair<typename T::value_type>::value &&
+    !std::is_convertible_v<const T&, std::string_view>>> {
+    using V = typename T::value_type;
+    static inline tl::expected<T, int> Convert(redisReply* reply) {
+        T result;
+        auto inserter = std::inserter(result, result.end());
+        for (size_t i = 0, e = reply->elements; i < e; i++) {
+            // std::optional elements keep their place, nil or not convertible is std::nullopt, see MGET
+            if constexpr (detail::is_optional<V>::value) {
+                auto v = GetFromReply<typename V::value_type>(reply->element[i]);
+                *inserter++ = v ? V(std::move(v.value())) : V();
+            }
+            else {
+                auto v = GetFromReply<std::decay_t<V>>(reply->element[i]);
+                if (v)
+                    *inserter++ = v.value();
+                else if constexpr (std::is_same_v<V, std::string> || std::is_same_v<V, std::string_view>)
+                    *inserter++ = V(kRedisNilStr);
+            }
+        }
+        return result;
     }
 };
 
@@ -296,15 +1077,99 @@ struct RedisReplyConvert<
         auto v = GetFromReply<std::decay_t<V>>(reply->element[1]);
         if (k && v)
             return std::make_pair<K, V>(std::move(k.value()), std::move(v.value()));
-        else
-			LOG_INFO("k or v is invalid");
+        LOG_INFO("k or v is invalid");
         return tl::unexpected{ -1 };
     }
 };
 
+/*
+An entry of a stream, [id, [field, value, ...]]. fields is decoded like the
+reply of HGETALL, into a REDIS_STRUCT or a map. error is 0, the code of the
+failed conversion, or REDIS_REPLY_NIL for an entry deleted while it was
+pending. Such an entry is kept with default fields, so its id can still be
+acknowledged.
+*/
+template <typename T>
+struct StreamEntry {
+    std::string id;
+    T fields{};
+    int error = 0;
+};
+
+// reply of XREADGROUP and XREAD, the entries of every stream read
+template <typename T>
+using StreamRead = std::vector<std::pair<std::string, std::vector<StreamEntry<T>>>>;
+
+// reply of XAUTOCLAIM, next is the cursor of the following call, "0-0" once the whole list was scanned
+template <typename T>
+struct StreamClaim {
+    std::string next;
+    std::vector<StreamEntry<T>> entries;
+    std::vector<std::string> deleted;   // ids that were pending but no longer exist, redis 7
+};
+
+template <typename T>
+struct RedisReplyConvert<REDIS_REPLY_ARRAY, StreamEntry<T>> {
+    static inline tl::expected<StreamEntry<T>, int> Convert(redisReply* reply) {
+        if (reply->elements != 2 || reply->element[0]->type != REDIS_REPLY_STRING)
+            return tl::unexpected{ -1 };
+        StreamEntry<T> entry;
+        entry.id.assign(reply->element[0]->str, reply->element[0]->len);
+        auto fields = GetFromReply<T>(reply->element[1]);
+        if (fields)
+            entry.fields = std::move(*fields);
+        else
+            entry.error = fields.error();
+        return entry;
+    }
+};
+
+template <typename T>
+struct RedisReplyConvert<REDIS_REPLY_ARRAY, StreamClaim<T>> {
+    static inline tl::expected<StreamClaim<T>, int> Convert(redisReply* reply) {
+        if (reply->elements < 2 || reply->element[0]->type != REDIS_REPLY_STRING)
+            return tl::unexpected{ -1 };
+        StreamClaim<T> claim;
+        claim.next.assign(reply->element[0]->str, reply->element[0]->len);
+        auto entries = GetFromReply<std::vector<StreamEntry<T>>>(reply->element[1]);
+        if (!entries)
+            return tl::unexpected{ entries.error() };
+        claim.entries = std::move(*entries);
+        if (reply->elements > 2) {
+            auto deleted = GetFromReply<std::vector<std::string>>(reply->element[2]);
+            if (deleted)
+                claim.deleted = std::move(*deleted);
+        }
+        return claim;
+    }
+};
+
+// RESP3 map and set, hiredis lays them out like the RESP2 arrays, a map as key value key value...
+template <typename T>
+struct RedisReplyConvert<REDIS_REPLY_MAP, T, std::enable_if_t<detail::is_redis_struct<T>::value>>
+    : RedisReplyConvert<REDIS_REPLY_ARRAY, T> {};
+
+// kept apart from the struct one, naming T::value_type in one condition ruled out both for a struct
+template <typename T>
+struct RedisReplyConvert<REDIS_REPLY_MAP, T,
+    std::enable_if_t<detail::is_container<T>::value && detail::is_pair<typename T::value_type>::value>>
+    : RedisReplyConvert<REDIS_REPLY_ARRAY, T> {};
+
+template <typename T>
+struct RedisReplyConvert<REDIS_REPLY_SET, T,
+    std::enable_if_t<detail::is_container<T>::value && !detail::is_pair<typename T::value_type>::value &&
+        !std::is_convertible_v<const T&, std::string_view>>>
+    : RedisReplyConvert<REDIS_REPLY_ARRAY, T> {};
+
 template <> struct RedisReplyConvert<REDIS_REPLY_STATUS, std::string> {
     static inline tl::expected<std::string, int> Convert(redisReply* reply) {
-        return std::string(reply->str);
+        return std::string(reply->str, reply->len);
+    }
+};
+
+template <> struct RedisReplyConvert<REDIS_REPLY_STATUS, std::string_view> {
+    static inline tl::expected<std::string_view, int> Convert(redisReply* reply) {
+        return std::string_view(reply->str, reply->len);
     }
 };
 
@@ -391,294 +1256,2935 @@ template <typename T> tl::expected<T, int> GetFromReply(redisReply* reply) {
     return tl::unexpected{ -1 };
 }
 
-class RedisMgr {
-public:
-    RedisMgr() {}
-    virtual ~RedisMgr() { 
-        UnInit();
-    }
+/*
+A decoded reply that still points into the hiredis reply it came from. The
+reply is kept alive by the view, so string_view results stay valid as long as
+the view does and reading a large value costs no copy:
 
-    template<typename ...Args>
-    int Initialize(Args&&... args) {
-        (redis_cxt_pool_.push_back(args), ...);
-        return 0;
-    }
-    void UnInit() {
-        for (auto& context : redis_cxt_pool_)
-            redisFree(context);
-    }
+    auto blob = mgr.GET<ReplyView<std::string_view>>("cache:blob");
+    auto hash = mgr.HGETALL<ReplyView<std::map<std::string_view, std::string_view>>>("user:1");
+*/
+template <typename T>
+class ReplyView {
+public:
+    using value_type = T;
 
-    tl::expected<std::string, int> AUTH(std::string_view password) {
-        static std::string cmd = GetCmd("AUTH", 1);
-        return ExcuteCommand<std::string>(cmd, std::string(password));
-    }
+    ReplyView(RedisReply reply, T value) : reply_(std::move(reply)), value_(std::move(value)) {}
 
-    tl::expected<std::string, int> SELECT(int index) {
-        static std::string cmd = GetCmd("SELECT", 1);
-        return ExcuteCommand<std::string>(cmd, fmt::format("{}", index));
-    }
+    const T& Value() const { return value_; }
+    const T& operator*() const { return value_; }
+    const T* operator->() const { return &value_; }
 
-    template <typename T, typename F>
-    tl::expected<T, int> HGET(std::string_view key, const F& field) {
-        static_assert(is_redis_reply_convertible<REDIS_REPLY_STRING, T>::value,
-            "no function RedisReplyConvert<REDIS_REPLY_STRING, T>::Convert can be called.");
-        static std::string cmd = GetCmd("HGET", 2);
-        return ExcuteCommand<T>(cmd, std::string(key), fmt::format("{}", field));
-    }
+private:
+    RedisReply reply_;
+    T value_;
+};
 
-    /*
-    a list of values associated with the given fields, in the same order as they are requested.
-    if any of requested is not exists, then the associated value is '(nil)'
-    */
-    template <typename ...Field>
-    tl::expected<std::vector<std::string>, int> HMGET(std::string_view key, Field... field) {
-        constexpr size_t arg_count = sizeof...(field);
-        static_assert(arg_count > 0, "invalid number of arguement");
-        static std::string cmd = GetCmd("HMGET", arg_count + 1);
-        return ExcuteCommand<std::vector<std::string>>(cmd, std::string(key), fmt::format("{}", field)...);
-    }
+namespace detail {
+template <typename T>
+struct is_reply_view : std::false_type {};
 
+template <typename T>
+struct is_reply_view<ReplyView<T>> : std::true_type {};
 
-    template <typename T>
-    tl::expected<T, int> HGETALL(std::string_view key) {
-        static_assert(is_redis_reply_convertible<REDIS_REPLY_ARRAY, T>::value,
-            "no function RedisReplyConvert<REDIS_REPLY_ARRAY, T>::Convert can be called.");
-        static std::string cmd = GetCmd("HGETALL", 1);
-        return ExcuteCommand<T>(cmd, std::string(key));
-    }
+template <typename T>
+struct view_value { using type = T; };
 
-    // Integer reply: the value of the field after the increment operation.
-    template <typename T>
-    tl::expected<int, int> HINCRBY(std::string_view key, const T& field, int inc) {
-        static std::string cmd = GetCmd("HINCRBY", 3);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", field), fmt::format("{}", inc));
-    }
+template <typename T>
+struct view_value<ReplyView<T>> { using type = T; };
 
-    template <typename... Args>
-    tl::expected<int, int> HSET(std::string_view key, Args &&...args) {
-        constexpr size_t arg_count = sizeof...(args);
-        static_assert(arg_count % 2 == 0 && arg_count > 0, "invalid number of arguement");
-        static std::string cmd = GetCmd("HSET", arg_count + 1);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", args)...);
-    }
+template <typename T>
+using view_value_t = typename view_value<T>::type;
 
-    template <typename T>
-    tl::expected<int, int> HSET(std::string_view key, T&& arg, 
-        std::enable_if_t<detail::is_container<std::decay_t<T>>::value && detail::is_pair<typename std::decay_t<T>::value_type>::value, int> = 0) {
-        std::string cmd = fmt::format("HSET {}", key);
-        for (auto& iter : arg)
-            cmd += fmt::format(" {} {}", iter.first, iter.second);
-        return ExcuteCommand<int>(cmd);
-    }
+// reply of EVALSHA, noscript when the server does not know the script and it has to be sent again
+template <typename T>
+struct ScriptReply {
+    bool noscript = false;
+    tl::expected<T, int> value = tl::unexpected{ -1 };
+};
 
-    tl::expected<int, int> EXPIRE(std::string_view key, int seconds) {
-        static std::string cmd = GetCmd("EXPIRE", 2);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", seconds));
-    }
+template <typename T>
+struct is_script_reply : std::false_type {};
 
-    template <typename... Args>
-    tl::expected<int, int> HDEL(std::string_view key, Args &&...args) {
-        static_assert(sizeof...(Args) > 0, "invalid number of arguement");
+template <typename T>
+struct is_script_reply<ScriptReply<T>> : std::true_type {};
 
-        static std::string cmd = GetCmd("HDEL", sizeof...(args) + 1);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", args)...);
-    }
+// T points into the reply buffer and can't outlive it without a ReplyView
+template <typename T, typename = void>
+struct is_borrowed : std::false_type {};
 
-    template <typename... Args>
-    tl::expected<int, int> SADD(std::string_view key, Args &&...args) {
-        static_assert(sizeof...(Args) > 0, "invalid number of arguement");
+template <>
+struct is_borrowed<std::string_view> : std::true_type {};
 
-        static std::string cmd = GetCmd("SADD", sizeof...(args) + 1);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", args)...);
-    }
+template <typename T>
+struct is_borrowed<T, std::enable_if_t<is_pair<T>::value>>
+    : std::bool_constant<is_borrowed<std::decay_t<typename T::first_type>>::value ||
+        is_borrowed<std::decay_t<typename T::second_type>>::value> {};
 
-    template <typename... Args>
-    tl::expected<int, int> SREM(std::string_view key, Args &&...args) {
-        static_assert(sizeof...(Args) > 0, "invalid number of arguement");
+template <typename T>
+struct is_borrowed<T, std::enable_if_t<is_container<T>::value && !is_pair<T>::value &&
+    !std::is_same_v<T, std::string>>>
+    : is_borrowed<std::decay_t<typename T::value_type>> {};
+}
 
-        static std::string cmd = GetCmd("SREM", sizeof...(args) + 1);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", args)...);
+// decode an owned reply, a ReplyView<T> shares the ownership of the reply
+template <typename T> tl::expected<T, int> GetFromReply(const RedisReply& reply) {
+    if constexpr (detail::is_reply_view<T>::value) {
+        auto value = GetFromReply<typename T::value_type>(static_cast<redisReply*>(reply));
+        if (!value)
+            return tl::unexpected{ value.error() };
+        return T(reply, std::move(value.value()));
     }
-
-    template <typename T>
-    tl::expected<int, int> SISMEMBER(std::string_view key, T&& member) {
-        static std::string cmd = GetCmd("SISMEMBER", 2);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", member));
+    else if constexpr (detail::is_script_reply<T>::value) {
+        T result;
+        const redisReply* r = reply;
+        result.noscript = r && r->type == REDIS_REPLY_ERROR && std::string_view(r->str, r->len).substr(0, 8) == "NOSCRIPT";
+        if (!result.noscript)
+            result.value = GetFromReply<typename decltype(result.value)::value_type>(reply);
+        return result;
+    }
+    else {
+        static_assert(!detail::is_borrowed<T>::value,
+            "the result points into the reply, use ReplyView<T> to keep the reply alive.");
+        return GetFromReply<T>(static_cast<redisReply*>(reply));
     }
+}
 
-    // template <typename T>
-    // ?? SMEMBERS(std::string_view key) {
-    //     static_assert(is_redis_reply_convertible<REDIS_REPLY_ARRAY, T>::value,
-    //         "no function RedisReplyConvert<REDIS_REPLY_ARRAY, T>::Convert can be called.");
-    //     static std::string cmd = GetCmd("SMEMBERS", 1);
-    //     return ExcuteCommand<int>(cmd, fmt::format(value), std::string_view(key));
-    // }
+namespace detail {
+/*
+Bump allocator for the reply trees read on one connection. With the
+redisReplyObjectFunctions installed by Install() hiredis takes every reply node
+and string from the arena instead of malloc, and a whole tree is dropped at once
+by Rewind() before the next command is sent. Replies still referenced, by a
+ReplyView for instance, keep their pages alive and the arena moves on to fresh
+ones.
+*/
+class ReplyArena {
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size = 0;
+    };
+    struct Pages {
+        std::vector<Block> blocks;
+        size_t current = 0;
+        size_t offset = 0;
+    };
 
+public:
+    static constexpr size_t kBlockSize = 16 * 1024;
+    static constexpr size_t kKeepBlocks = 4;
 
-    tl::expected<std::pair<int, std::vector<std::string>>, int> SSCAN(const std::string_view& key, size_t cursor, const std::string_view& match="",size_t count = 0) {
-        std::string cmd = fmt::format("SSCAN {} {}", key, cursor);
-        if(!match.empty()) cmd.append(fmt::format(" MATCH {}",match));
-        if(count > 0) cmd.append(fmt::format(" COUNT {}",count));
-        return ExcuteCommand<std::pair<int,std::vector<std::string>>>(cmd);
+    void* Allocate(size_t size) {
+        constexpr size_t align = alignof(std::max_align_t);
+        size = (size + align - 1) & ~(align - 1);
+        Pages& pages = *pages_;
+        while (pages.current < pages.blocks.size()) {
+            Block& block = pages.blocks[pages.current];
+            if (pages.offset + size <= block.size) {
+                void* ptr = block.data.get() + pages.offset;
+                pages.offset += size;
+                return ptr;
+            }
+            pages.current++;
+            pages.offset = 0;
+        }
+        size_t block_size = std::max(size, kBlockSize);
+        char* data = new (std::nothrow) char[block_size];
+        if (!data)
+            return nullptr;
+        pages.blocks.push_back({ std::unique_ptr<char[]>(data), block_size });
+        pages.current = pages.blocks.size() - 1;
+        pages.offset = size;
+        return data;
     }
 
-    /*
-    Integer reply: 0 if the hash does not contain the field, or the key does not exist.
-    Integer reply: 1 if the hash contains the field.
-    */
-    tl::expected<int, int> HEXISTS(std::string_view key, std::string_view field) {
-        static std::string cmd = GetCmd("HEXISTS", 2);
-        return ExcuteCommand<int>(cmd, std::string(key), std::string(field));
+    // drop every reply read so far, call it before sending the next command
+    void Rewind() {
+        if (pages_.use_count() > 1) {
+            pages_ = std::make_shared<Pages>();
+            return;
+        }
+        auto& blocks = pages_->blocks;
+        blocks.erase(std::remove_if(blocks.begin(), blocks.end(),
+            [](const Block& block) { return block.size != kBlockSize; }), blocks.end());
+        if (blocks.size() > kKeepBlocks)
+            blocks.resize(kKeepBlocks);
+        pages_->current = 0;
+        pages_->offset = 0;
     }
 
-    tl::expected<int, int> EXISTS(std::string_view key) {
-        static std::string cmd = GetCmd("EXISTS", 1);
-        return ExcuteCommand<int>(cmd, std::string(key));
+    // the returned reply shares the ownership of the pages it lives in
+    RedisReply Adopt(void* reply) {
+        if (!reply)
+            return nullptr;
+        return RedisReply(std::shared_ptr<redisReply>(pages_, static_cast<redisReply*>(reply)));
     }
 
-    template<typename T, typename... Args>
-    tl::expected<std::string, int> SET(std::string_view key, T&& value, Args&&... args) {
-        static std::string cmd = GetCmd("SET", 2 + sizeof...(args));
-        return ExcuteCommand<std::string>(cmd, std::string(key), fmt::format("{}", value), fmt::format("{}", args)...);
+    // the reader is recreated on reconnect, install again after that
+    static void Install(redisContext* context, ReplyArena* arena) {
+        static redisReplyObjectFunctions functions = {
+            CreateString, CreateArray, CreateInteger, CreateDouble, CreateNil, CreateBool, FreeObject
+        };
+        context->reader->fn = &functions;
+        context->reader->privdata = arena;
+        // the default push handler frees the reply with freeReplyObject
+        redisSetPushCallback(context, [](void*, void*) {});
     }
 
-    template<typename VT>
-    tl::expected<int,int> SETNX(const std::string_view& key,VT&& value){
-        static std::string cmd = GetCmd("SETNX", 2);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", value));
+private:
+    static redisReply* CreateReply(const redisReadTask* task) {
+        auto arena = static_cast<ReplyArena*>(task->privdata);
+        auto reply = static_cast<redisReply*>(arena->Allocate(sizeof(redisReply)));
+        if (!reply)
+            return nullptr;
+        std::memset(reply, 0, sizeof(redisReply));
+        reply->type = task->type;
+        if (task->parent) {
+            auto parent = static_cast<redisReply*>(task->parent->obj);
+            parent->element[task->idx] = reply;
+        }
+        return reply;
     }
 
-    template<typename T>
-    tl::expected<T, int> GET(std::string_view key) {
-        static std::string cmd = GetCmd("GET", 1);
-        return ExcuteCommand<T>(cmd, std::string(key));
+    static char* CopyString(const redisReadTask* task, const char* str, size_t len) {
+        auto buf = static_cast<char*>(static_cast<ReplyArena*>(task->privdata)->Allocate(len + 1));
+        if (buf) {
+            std::memcpy(buf, str, len);
+            buf[len] = '\0';
+        }
+        return buf;
     }
 
-
-    // Integer reply: the value of the field after the increment operation.
-    tl::expected<int64_t, int> INCRBY(const std::string_view key, int64_t inc) {
-        static std::string cmd = GetCmd("INCRBY", 2);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", inc));
+    static void* CreateString(const redisReadTask* task, char* str, size_t len) {
+        redisReply* reply = CreateReply(task);
+        if (!reply)
+            return nullptr;
+        if (task->type == REDIS_REPLY_VERB) {
+            // "txt:" prefix of verbatim strings
+            std::memcpy(reply->vtype, str, 3);
+            reply->vtype[3] = '\0';
+            str += 4;
+            len -= 4;
+        }
+        reply->str = CopyString(task, str, len);
+        reply->len = len;
+        return reply->str ? reply : nullptr;
     }
 
-    template<typename ...Args>
-    tl::expected<int, int> DEL(Args&& ...keys) {
-        static_assert(sizeof...(Args) > 0, "invalid number of arguement");
-        static std::string cmd = GetCmd("DEL", sizeof...(keys));
-        return ExcuteCommand<int>(cmd, fmt::format("{}", keys)...);
+    static void* CreateArray(const redisReadTask* task, size_t elements) {
+        redisReply* reply = CreateReply(task);
+        if (!reply)
+            return nullptr;
+        if (elements > 0) {
+            reply->element = static_cast<redisReply**>(
+                static_cast<ReplyArena*>(task->privdata)->Allocate(elements * sizeof(redisReply*)));
+            if (!reply->element)
+                return nullptr;
+            std::memset(reply->element, 0, elements * sizeof(redisReply*));
+        }
+        reply->elements = elements;
+        return reply;
     }
 
-    /*
-    Integer reply: TTL in seconds.
-    Integer reply: -1 if the key exists but has no associated expiration.
-    Integer reply: -2 if the key does not exist.
-    */
-    tl::expected<int, int> TTL(std::string_view key) {
-        static std::string cmd = GetCmd("TTL", 1);
-        return ExcuteCommand<int>(cmd, std::string(key));
+    static void* CreateInteger(const redisReadTask* task, long long value) {
+        redisReply* reply = CreateReply(task);
+        if (reply)
+            reply->integer = value;
+        return reply;
     }
 
-    // key score1 member1 score2 member2 ...
-    template<typename ...Args>
-    tl::expected<int, int> ZADD(std::string_view key, Args&& ...keys) {
-        static_assert((sizeof...(Args) % 2) == 0 && (sizeof...(Args) > 0),
-            "invalid number of arguement");
-        static std::string cmd = GetCmd("ZADD", sizeof...(keys) + 1);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", keys)...);
+    static void* CreateDouble(const redisReadTask* task, double value, char* str, size_t len) {
+        redisReply* reply = CreateReply(task);
+        if (!reply)
+            return nullptr;
+        reply->dval = value;
+        reply->str = CopyString(task, str, len);
+        reply->len = len;
+        return reply->str ? reply : nullptr;
     }
 
-    template<typename ...Args>
-    tl::expected<int, int> ZREM(Args&& ...keys) {
-        static_assert((sizeof...(Args) > 0), "invalid number of arguement");
-        static std::string cmd = GetCmd("ZREM", sizeof...(keys));
-        return ExcuteCommand<int>(cmd, fmt::format("{}", keys)...);
+    static void* CreateNil(const redisReadTask* task) {
+        return CreateReply(task);
     }
 
-    tl::expected<int, int> ZCARD(std::string_view key) {
-        static std::string cmd = GetCmd("ZCARD {}", 1);
-        return ExcuteCommand<int>(cmd, std::string(key));
+    static void* CreateBool(const redisReadTask* task, int value) {
+        redisReply* reply = CreateReply(task);
+        if (reply)
+            reply->integer = value != 0;
+        return reply;
     }
 
-    template<typename T>
-    tl::expected<int, int> ZSCORE(std::string_view key, T member) {
-        static std::string cmd = GetCmd("ZSCORE", 2);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", member));
-    }
+    // memory goes back with Rewind()
+    static void FreeObject(void*) {}
 
-    template<typename T>
-    tl::expected<int, int> ZINCRBY(std::string_view key, int increment, T&& member) {
-        static std::string cmd = GetCmd("ZINCRBY", 3);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", increment), fmt::format("{}", member));
-    }
+    std::shared_ptr<Pages> pages_ = std::make_shared<Pages>();
+};
+}
 
-    // query WITHSCORES
-    tl::expected<std::vector<std::pair<std::string, int>>, int> ZREVRANGE(std::string_view key, int start, int stop) {
-        static std::string cmd = GetCmd("ZREVRANGE", 4);
-        return ExcuteCommand<std::vector<std::pair<std::string, int>>>(
-            cmd, std::string(key), fmt::format("{}", start), fmt::format("{}", stop), std::string("WITHSCORES"));
-    }
+/*
+A fixed size pool of blocking redisContext built from RedisInitParam.
+A context is checked out through AutoContext and goes back to the pool when the
+AutoContext is destroyed. Each thread remembers the slot it used last and tries
+it first, so it usually gets the same warm connection back. When every context
+is busy the caller waits up to checkout_timeout milliseconds.
+*/
+class RedisPool {
+    struct Connection {
+        redisContext* context = nullptr;
+        std::atomic<bool> busy{ false };
+        bool broken = false;
+        uint64_t epoch = 0;
+        std::chrono::steady_clock::time_point last_used;
+        fmt::memory_buffer obuf;
+        std::unique_ptr<detail::ReplyArena> arena;
 
-    /*
-    // query WITHSCORES, pair<rank, socre>
-    template<typename T>
-    tl::expected<std::pair<int, int>, int> ZREVRANK(std::string_view key, T member) {
-        std::string cmd = fmt::format("ZREVRANK {} {} WITHSCORE", key, member);
-        return ExcuteCommand<std::pair<int, int>>(cmd);
-    }
-    */
+        bool Send(const char* data, size_t len) {
+            // a reply the reader has half built lives in the arena too, it is kept until it is complete
+            if (arena && context->reader->ridx < 0)
+                arena->Rewind();
+            return redisAppendFormattedCommand(context, data, len) == REDIS_OK;
+        }
 
-    template<typename T>
-    tl::expected<int, int> ZREVRANK(std::string_view key, T member) {
-        static std::string cmd = GetCmd("ZREVRANK", 2);
-        return ExcuteCommand<int>(cmd, std::string(key), fmt::format("{}", member));
-    }
+        RedisReply Receive() {
+            void* reply = nullptr;
+            if (redisGetReply(context, &reply) != REDIS_OK)
+                return nullptr;
+            return arena ? arena->Adopt(reply) : RedisReply(reply);
+        }
+    };
 
-	tl::expected<std::string, int> TryLock(std::string_view lock_key, int px = 3000) {
-		return SET(lock_key, 1, RedisOp::PX{ px }, RedisOp::NX{});
-    }
+public:
+    class AutoContext {
+    public:
+        AutoContext() = default;
+        AutoContext(RedisPool* pool, Connection* conn) : pool_(pool), conn_(conn) {}
+        AutoContext(AutoContext&& other) noexcept
+            : pool_(std::exchange(other.pool_, nullptr)), conn_(std::exchange(other.conn_, nullptr)) {}
+        AutoContext& operator=(AutoContext&& other) noexcept {
+            if (this != &other) {
+                Release();
+                pool_ = std::exchange(other.pool_, nullptr);
+                conn_ = std::exchange(other.conn_, nullptr);
+            }
+            return *this;
+        }
+        AutoContext(const AutoContext&) = delete;
+        AutoContext& operator=(const AutoContext&) = delete;
+        ~AutoContext() { Release(); }
 
-	tl::expected<int, int> UnLock(std::string_view lock_key) {
-		return DEL(lock_key);
-	}
+        operator bool() const { return conn_ != nullptr; }
+        operator redisContext* () const { return conn_->context; }
+        redisContext* operator->() const { return conn_->context; }
 
-    template <typename T, typename... Args, std::enable_if_t<(std::is_same_v<Args, std::string> && ...), int> = 0>
-    tl::expected<T, int> ExcuteCommand(std::string_view command, Args&&... args) {
-        redisContext* context = redis_cxt_pool_[0];
+        // the context is reconnected the next time it is checked out
+        void SetContextDisable() { conn_->broken = true; }
 
-        time_t start = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-        RedisReply reply = redisCommand(context, command.data(), (args.c_str())...);
-        time_t end = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-        if (end - start > 100) {
-            LOG_WARN("slow redis: time[%d] command[%s]", end - start, command.data());
+        // reusable output buffer of the connection, cleared on checkout
+        fmt::memory_buffer& Buffer() { return conn_->obuf; }
+
+        // send the RESP encoded in Buffer() and wait for the reply, null on a context error
+        RedisReply Execute() {
+            return Send(conn_->obuf.data(), conn_->obuf.size()) ? Receive() : RedisReply(nullptr);
         }
-        if (!reply) {
-            LOG_ERROR("cmd[%s] reply is null, context error[%d:%s]", command.data(),
-                context->err, context->errstr);
-            //auto_ctx.SetContextDisable();
-            return tl::unexpected{ -1 };
+
+        // queue RESP encoded commands, the first Receive() writes them out
+        bool Send(const char* data, size_t len) { return conn_->Send(data, len); }
+
+        // read the next reply, null on a context error
+        RedisReply Receive() { return conn_->Receive(); }
+
+        // write out what Send queued without waiting for the replies, false on a context error
+        bool Flush() {
+            int done = 0;
+            while (!done) {
+                if (redisBufferWrite(conn_->context, &done) != REDIS_OK)
+                    return false;
+            }
+            return true;
         }
 
-        auto _ = GetFromReply<T>(reply);
-        if (!_ && _.error() == REDIS_REPLY_ERROR) {
-            LOG_ERROR("%s: command[%s]", __FUNCTION__, command.data());
+        // hand the context back to the pool before the handle goes out of scope
+        void Release() {
+            if (pool_ && conn_)
+                pool_->Put(conn_);
+            pool_ = nullptr;
+            conn_ = nullptr;
         }
-        return _;
+
+    private:
+        RedisPool* pool_ = nullptr;
+        Connection* conn_ = nullptr;
+    };
+
+    RedisPool() {}
+    ~RedisPool() { UnInit(); }
+    RedisPool(const RedisPool&) = delete;
+    RedisPool& operator=(const RedisPool&) = delete;
+
+    int Initialize(const RedisInitParam& param) {
+        if (param.use_ssl) {
+            LOG_ERROR("%s: ssl is not supported", __FUNCTION__);
+            return -1;
+        }
+        param_ = param;
+        int count = std::max(param.context_count, 1);
+        int connected = 0;
+        for (int i = 0; i < count; i++) {
+            auto& conn = conns_.emplace_back(std::make_unique<Connection>());
+            if (Connect(*conn))
+                connected++;
+        }
+        if (connected == 0) {
+            LOG_ERROR("%s: can not connect to %s:%d", __FUNCTION__, param.host.c_str(), param.port);
+            return -1;
+        }
+        return 0;
     }
 
+    // adopt contexts that are already connected, the pool frees them on UnInit
+    int Initialize(std::vector<redisContext*> contexts) {
+        for (auto context : contexts) {
+            auto& conn = conns_.emplace_back(std::make_unique<Connection>());
+            conn->context = context;
+            conn->broken = context == nullptr || context->err != 0;
+            conn->last_used = std::chrono::steady_clock::now();
+        }
+        return conns_.empty() ? -1 : 0;
+    }
 
-protected:
-    std::string GetCmd(std::string_view cmd, size_t argc) {
-        std::string ret { cmd };
-        for (int i = 0; i < argc; i++)
-            ret += " %s";
+    void UnInit() {
+        for (auto& conn : conns_) {
+            if (conn->context)
+                redisFree(conn->context);
+        }
+        conns_.clear();
+    }
 
-        return std::move(ret);
+    size_t Size() const { return conns_.size(); }
+    const RedisInitParam& Param() const { return param_; }
+
+    // run on every (re)connect after AUTH and SELECT, a false return fails the connect
+    void AddConnectHook(std::function<bool(redisContext*)> hook) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        hooks_.push_back(std::move(hook));
     }
+
+    // every context is reconnected on its next checkout, so the connect hooks run again
+    void ReconnectAll() {
+        epoch_++;
+    }
+
+    AutoContext Get() {
+        return Get(std::chrono::milliseconds(param_.checkout_timeout));
+    }
+
+    AutoContext Get(std::chrono::milliseconds timeout) {
+        if (conns_.empty())
+            return {};
+
+        thread_local struct { const RedisPool* pool; size_t slot; } affinity{ nullptr, 0 };
+        size_t hint = affinity.pool == this
+            ? affinity.slot
+            : std::hash<std::thread::id>{}(std::this_thread::get_id()) % conns_.size();
+
+        size_t slot = 0;
+        if (!TryAcquire(hint, slot)) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            waiters_++;
+            bool ok = cv_.wait_for(lock, timeout, [&] { return TryAcquire(hint, slot); });
+            waiters_--;
+            if (!ok) {
+                LOG_ERROR("%s: no idle redis context in %lld ms", __FUNCTION__,
+                    static_cast<long long>(timeout.count()));
+                return {};
+            }
+        }
+        affinity = { this, slot };
+
+        Connection* conn = conns_[slot].get();
+        if (conn->obuf.capacity() > kMaxIdleBuffer)
+            conn->obuf = fmt::memory_buffer();
+        conn->obuf.clear();
+        if (!Prepare(*conn)) {
+            Put(conn);
+            return {};
+        }
+        return AutoContext(this, conn);
+    }
+
+private:
+    bool TryAcquire(size_t hint, size_t& slot) {
+        for (size_t i = 0, n = conns_.size(); i < n; i++) {
+            size_t idx = (hint + i) % n;
+            bool expected = false;
+            if (!conns_[idx]->busy.load(std::memory_order_relaxed) &&
+                conns_[idx]->busy.compare_exchange_strong(expected, true)) {
+                slot = idx;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Put(Connection* conn) {
+        conn->last_used = std::chrono::steady_clock::now();
+        conn->busy.store(false);
+        if (waiters_.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            cv_.notify_one();
+        }
+    }
+
+    // reconnect broken contexts and check idle ones before handing them out
+    bool Prepare(Connection& conn) {
+        if (!conn.broken && param_.heart_invervals > 0 &&
+            std::chrono::steady_clock::now() - conn.last_used > std::chrono::seconds(param_.heart_invervals)) {
+            constexpr std::string_view ping = "*1\r\n$4\r\nPING\r\n";
+            conn.broken = !conn.Send(ping.data(), ping.size()) || !conn.Receive();
+        }
+        if (conn.epoch != epoch_.load())
+            conn.broken = true;
+        return !conn.broken || Connect(conn);
+    }
+
+    bool Connect(Connection& conn) {
+        conn.broken = true;
+        conn.epoch = epoch_.load();
+        if (conn.context) {
+            if (redisReconnect(conn.context) != REDIS_OK) {
+                LOG_ERROR("%s: reconnect failed, %s", __FUNCTION__, conn.context->errstr);
+                return false;
+            }
+        }
+        else {
+            if (param_.host.empty())
+                return false;
+            if (param_.connect_timeout > 0) {
+                struct timeval tv;
+                tv.tv_sec = param_.connect_timeout / 1000;
+                tv.tv_usec = (param_.connect_timeout % 1000) * 1000;
+                conn.context = redisConnectWithTimeout(param_.host.c_str(), param_.port, tv);
+            }
+            else {
+                conn.context = redisConnect(param_.host.c_str(), param_.port);
+            }
+            if (!conn.context || conn.context->err) {
+                LOG_ERROR("%s: connect %s:%d failed, %s", __FUNCTION__, param_.host.c_str(), param_.port,
+                    conn.context ? conn.context->errstr : "can't allocate redis context");
+                if (conn.context)
+                    redisFree(conn.context);
+                conn.context = nullptr;
+                return false;
+            }
+        }
+
+        if (!param_.auth.empty()) {
+            RedisReply reply = redisCommand(conn.context, "AUTH %b", param_.auth.data(), param_.auth.size());
+            if (!reply || reply->type == REDIS_REPLY_ERROR) {
+                LOG_ERROR("%s: AUTH failed", __FUNCTION__);
+                return false;
+            }
+        }
+        if (param_.db_index != 0) {
+            RedisReply reply = redisCommand(conn.context, "SELECT %d", param_.db_index);
+            if (!reply || reply->type == REDIS_REPLY_ERROR) {
+                LOG_ERROR("%s: SELECT %d failed", __FUNCTION__, param_.db_index);
+                return false;
+            }
+        }
+        if (param_.protocol == 3) {
+            RedisReply reply = redisCommand(conn.context, "HELLO 3");
+            if (!reply || reply->type == REDIS_REPLY_ERROR) {
+                LOG_ERROR("%s: HELLO 3 failed", __FUNCTION__);
+                return false;
+            }
+        }
+        std::vector<std::function<bool(redisContext*)>> hooks;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            hooks = hooks_;
+        }
+        for (auto& hook : hooks) {
+            if (!hook(conn.context))
+                return false;
+        }
+        if (param_.use_reply_arena) {
+            if (!conn.arena)
+                conn.arena = std::make_unique<detail::ReplyArena>();
+            detail::ReplyArena::Install(conn.context, conn.arena.get());
+        }
+        conn.broken = false;
+        conn.last_used = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    // a buffer grown by a huge command is not kept around
+    static constexpr size_t kMaxIdleBuffer = 64 * 1024;
+
+    RedisInitParam param_;
+    std::vector<std::unique_ptr<Connection>> conns_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic<int> waiters_{ 0 };
+    std::atomic<uint64_t> epoch_{ 0 };
+    std::vector<std::function<bool(redisContext*)>> hooks_;
+};
+
+namespace detail {
+// SHA1 written for constant evaluation, scripts are hashed at compile time
+class Sha1 {
+public:
+    static constexpr std::array<char, 40> Hex(std::string_view data) {
+        uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+        uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+        size_t total = (data.size() + 8) / 64 * 64 + 64;
+        for (size_t block = 0; block < total; block += 64) {
+            uint32_t w[80] = {};
+            for (size_t i = 0; i < 16; i++) {
+                for (size_t j = 0; j < 4; j++)
+                    w[i] = (w[i] << 8) | Byte(data, bits, total, block + i * 4 + j);
+            }
+            for (size_t i = 16; i < 80; i++)
+                w[i] = Rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+            for (size_t i = 0; i < 80; i++) {
+                uint32_t f = 0, k = 0;
+                if (i < 20) {
+                    f = (b & c) | (~b & d);
+                    k = 0x5A827999;
+                }
+                else if (i < 40) {
+                    f = b ^ c ^ d;
+                    k = 0x6ED9EBA1;
+                }
+                else if (i < 60) {
+                    f = (b & c) | (b & d) | (c & d);
+                    k = 0x8F1BBCDC;
+                }
+                else {
+                    f = b ^ c ^ d;
+                    k = 0xCA62C1D6;
+                }
+                uint32_t temp = Rotl(a, 5) + f + e + k + w[i];
+                e = d;
+                d = c;
+                c = Rotl(b, 30);
+                b = a;
+                a = temp;
+            }
+            h[0] += a;
+            h[1] += b;
+            h[2] += c;
+            h[3] += d;
+            h[4] += e;
+        }
+        std::array<char, 40> hex{};
+        constexpr const char* digits = "0123456789abcdef";
+        for (size_t i = 0; i < 40; i++)
+            hex[i] = digits[(h[i / 8] >> (28 - (i % 8) * 4)) & 0xF];
+        return hex;
+    }
+
+private:
+    static constexpr uint32_t Rotl(uint32_t value, int n) {
+        return (value << n) | (value >> (32 - n));
+    }
+
+    // byte i of the padded message: data, 0x80, zeros, then the length in bits
+    static constexpr uint32_t Byte(std::string_view data, uint64_t bits, size_t total, size_t i) {
+        if (i < data.size())
+            return static_cast<unsigned char>(data[i]);
+        if (i == data.size())
+            return 0x80;
+        if (i >= total - 8)
+            return static_cast<uint32_t>((bits >> ((total - 1 - i) * 8)) & 0xFF);
+        return 0;
+    }
+};
+}
+
+/*
+A Lua script and its SHA1, worked out at compile time for a literal:
+
+    static constexpr RedisScript kIncrCapped = MakeScript(R"(
+        local v = redis.call('INCR', KEYS[1])
+        if v > tonumber(ARGV[1]) then redis.call('SET', KEYS[1], ARGV[1]) end
+        return v)");
+    mgr.RegisterScript(kIncrCapped);
+    auto v = mgr.Eval<int64_t>(kIncrCapped, { "counter" }, 100);
+
+The script only points to its body, a body built at runtime has to outlive it.
+*/
+struct RedisScript {
+    std::string_view body;
+    std::array<char, 40> sha{};
+
+    constexpr std::string_view Sha() const { return { sha.data(), sha.size() }; }
+};
+
+constexpr RedisScript MakeScript(std::string_view body) {
+    return RedisScript{ body, detail::Sha1::Hex(body) };
+}
+
+namespace detail {
+// elements [first, last) of a container argument, written like the container itself
+template <typename It>
+struct ArgChunk {
+    using value_type = typename std::iterator_traits<It>::value_type;
+    using iterator = It;
+
+    It first;
+    It last;
+    size_t count = 0;
+
+    It begin() const { return first; }
+    It end() const { return last; }
+    size_t size() const { return count; }
+};
+
+// f(ArgChunk) for every chunk_size elements of range, a single chunk when chunk_size is 0
+template <typename R, typename F>
+void ForEachChunk(const R& range, size_t chunk_size, F&& f) {
+    size_t left = range.size();
+    if (chunk_size == 0)
+        chunk_size = std::max<size_t>(left, 1);
+    auto it = std::begin(range);
+    while (left > 0) {
+        size_t count = std::min(left, chunk_size);
+        auto first = it;
+        std::advance(it, count);
+        f(ArgChunk<decltype(it)>{ first, it, count });
+        left -= count;
+    }
+}
+
+// the reply of a chunk folded into those before it, counts are added up and arrays appended, the first error stays
+template <typename T>
+void MergeChunk(tl::expected<T, int>& total, tl::expected<T, int>&& part) {
+    if (!total)
+        return;
+    if (!part) {
+        total = std::move(part);
+    }
+    else if constexpr (std::is_arithmetic_v<T> && !std::is_same_v<T, bool>) {
+        *total += *part;
+    }
+    else if constexpr (is_arg_range_v<T>) {
+        total->insert(total->end(), std::make_move_iterator(part->begin()), std::make_move_iterator(part->end()));
+    }
+    else {
+        total = std::move(part);
+    }
+}
+
+// the reply to a container command when the container is empty, nothing is sent then: OK for MSET, nothing for the others
+template <typename T>
+T EmptyChunk() {
+    if constexpr (std::is_same_v<T, std::string>)
+        return "OK";
+    else
+        return T{};
+}
+}
+
+/*
+The typed command surface shared by RedisMgr and RedisPipeline. Every command
+ends up in Impl::ExcuteCommand<T>(command, args...), whose return type decides
+what the typed methods return: tl::expected<T, int> for RedisMgr, a
+PipelineResult<T> handle for RedisPipeline.
+
+The overloads taking a container (MGET, MSET, HMGET, HSET, SADD, SREM, ZADD,
+DEL) go through Impl::ExcuteChunked<T>(command, range, args...) instead, which
+may split the container into commands of RedisInitParam::chunk_size elements
+and fold their replies into one. RedisMgr and RedisPipeline do, in pipelined
+writes, the others send the whole container in one command. An empty container
+sends nothing, its reply is detail::EmptyChunk<T>().
+*/
+template <typename Impl>
+class RedisCommands {
+public:
+    auto AUTH(std::string_view password) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(password)>("AUTH", detail::kCmdNoKey);
+        return Self().template ExcuteCommand<std::string>(cmd, password);
+    }
+
+    auto SELECT(int index) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(index)>("SELECT", detail::kCmdNoKey);
+        return Self().template ExcuteCommand<std::string>(cmd, index);
+    }
+
+    template <typename T, typename F>
+    auto HGET(std::string_view key, const F& field) {
+        static_assert(is_redis_reply_convertible<REDIS_REPLY_STRING, detail::view_value_t<T>>::value,
+            "no function RedisReplyConvert<REDIS_REPLY_STRING, T>::Convert can be called.");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(field)>("HGET", detail::kCmdCacheable | detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<T>(cmd, key, field);
+    }
+
+    /*
+    a list of values associated with the given fields, in the same order as they are requested.
+    if any of requested is not exists, then the associated value is '(nil)'
+    */
+    template <typename ...Field>
+    auto HMGET(std::string_view key, Field... field) {
+        constexpr size_t arg_count = sizeof...(field);
+        static_assert(arg_count > 0, "invalid number of arguement");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(field)...>("HMGET", detail::kCmdCacheable | detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<std::vector<std::string>>(cmd, key, field...);
+    }
+
+    template <typename R>
+    auto HMGET(std::string_view key, R&& fields, std::enable_if_t<detail::is_arg_range_v<R>, int> = 0) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(fields)>("HMGET", detail::kCmdCacheable | detail::kCmdReadOnly);
+        return Self().template ExcuteChunked<std::vector<std::string>>(cmd, fields, key);
+    }
+
+
+    template <typename T>
+    auto HGETALL(std::string_view key) {
+        static_assert(is_redis_reply_convertible<REDIS_REPLY_ARRAY, detail::view_value_t<T>>::value,
+            "no function RedisReplyConvert<REDIS_REPLY_ARRAY, T>::Convert can be called.");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key)>("HGETALL", detail::kCmdCacheable | detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<T>(cmd, key);
+    }
+
+    // Integer reply: the value of the field after the increment operation.
+    template <typename T>
+    auto HINCRBY(std::string_view key, const T& field, int inc) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(field), decltype(inc)>("HINCRBY");
+        return Self().template ExcuteCommand<int>(cmd, key, field, inc);
+    }
+
+    template <typename... Args>
+    auto HSET(std::string_view key, Args &&...args) {
+        constexpr size_t arg_count = sizeof...(args);
+        static_assert(arg_count % 2 == 0 && arg_count > 0, "invalid number of arguement");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(args)...>("HSET");
+        return Self().template ExcuteCommand<int>(cmd, key, args...);
+    }
+
+    template <typename T>
+    auto HSET(std::string_view key, T&& arg, 
+        std::enable_if_t<detail::is_container<std::decay_t<T>>::value && detail::is_pair<typename std::decay_t<T>::value_type>::value, int> = 0) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(arg)>("HSET");
+        return Self().template ExcuteChunked<int>(cmd, arg, key);
+    }
+
+    // every member of a REDIS_STRUCT as a field value pair
+    template <typename T>
+    auto HSET(std::string_view key, T&& data,
+        std::enable_if_t<detail::is_redis_struct<std::decay_t<T>>::value && !detail::has_value_codec<std::decay_t<T>>::value, int> = 0) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(data)>("HSET");
+        return Self().template ExcuteCommand<int>(cmd, key, data);
+    }
+
+    auto EXPIRE(std::string_view key, int seconds) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(seconds)>("EXPIRE");
+        return Self().template ExcuteCommand<int>(cmd, key, seconds);
+    }
+
+    template <typename... Args>
+    auto HDEL(std::string_view key, Args &&...args) {
+        static_assert(sizeof...(Args) > 0, "invalid number of arguement");
+
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(args)...>("HDEL");
+
+        return Self().template ExcuteCommand<int>(cmd, key, args...);
+    }
+
+    template <typename... Args>
+    auto SADD(std::string_view key, Args &&...args) {
+        static_assert(sizeof...(Args) > 0, "invalid number of arguement");
+
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(args)...>("SADD");
+
+        return Self().template ExcuteCommand<int>(cmd, key, args...);
+    }
+
+    template <typename R>
+    auto SADD(std::string_view key, R&& members, std::enable_if_t<detail::is_arg_range_v<R>, int> = 0) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(members)>("SADD");
+        return Self().template ExcuteChunked<int>(cmd, members, key);
+    }
+
+    template <typename... Args>
+    auto SREM(std::string_view key, Args &&...args) {
+        static_assert(sizeof...(Args) > 0, "invalid number of arguement");
+
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(args)...>("SREM");
+
+        return Self().template ExcuteCommand<int>(cmd, key, args...);
+    }
+
+    template <typename R>
+    auto SREM(std::string_view key, R&& members, std::enable_if_t<detail::is_arg_range_v<R>, int> = 0) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(members)>("SREM");
+        return Self().template ExcuteChunked<int>(cmd, members, key);
+    }
+
+    template <typename T>
+    auto SISMEMBER(std::string_view key, T&& member) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(member)>("SISMEMBER", detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<int>(cmd, key, member);
+    }
+
+    // template <typename T>
+    // ?? SMEMBERS(std::string_view key) {
+    //     static_assert(is_redis_reply_convertible<REDIS_REPLY_ARRAY, T>::value,
+    //         "no function RedisReplyConvert<REDIS_REPLY_ARRAY, T>::Convert can be called.");
+    //     static std::string cmd = GetCmd("SMEMBERS", 1);
+    //     return Self().template ExcuteCommand<int>(cmd, fmt::format(value), std::string_view(key));
+    // }
+
+
+    /*
+    One page of the SCAN family, pair<next cursor, elements>, the cursor is 0 after
+    the last page. RedisMgr::ScanAll and friends walk every page. A cursor is only
+    good on the node that made it, so these go to the primary, not to a replica,
+    only ScanAll sends a whole scan to one replica. In a cluster SCAN only covers
+    the node it is sent to, with RedisShardMgr only the first shard.
+    */
+    template <typename T = std::string>
+    auto SCAN(uint64_t cursor, std::string_view match = "", size_t count = 0, std::string_view type = "") {
+        RedisOp::MATCH match_op;
+        RedisOp::COUNT count_op;
+        RedisOp::TYPE type_op;
+        if (!match.empty()) match_op = match;
+        if (count > 0) count_op = count;
+        if (!type.empty()) type_op = type;
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(cursor), decltype(match_op), decltype(count_op), decltype(type_op)>(
+            "SCAN", detail::kCmdNoKey);
+        return Self().template ExcuteCommand<std::pair<uint64_t, std::vector<T>>>(cmd, cursor, match_op, count_op, type_op);
+    }
+
+    template <typename T = std::string>
+    auto SSCAN(std::string_view key, uint64_t cursor, std::string_view match = "", size_t count = 0) {
+        RedisOp::MATCH match_op;
+        RedisOp::COUNT count_op;
+        if (!match.empty()) match_op = match;
+        if (count > 0) count_op = count;
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(cursor), decltype(match_op), decltype(count_op)>("SSCAN");
+        return Self().template ExcuteCommand<std::pair<uint64_t, std::vector<T>>>(cmd, key, cursor, match_op, count_op);
+    }
+
+    template <typename K = std::string, typename V = std::string>
+    auto HSCAN(std::string_view key, uint64_t cursor, std::string_view match = "", size_t count = 0) {
+        RedisOp::MATCH match_op;
+        RedisOp::COUNT count_op;
+        if (!match.empty()) match_op = match;
+        if (count > 0) count_op = count;
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(cursor), decltype(match_op), decltype(count_op)>("HSCAN");
+        return Self().template ExcuteCommand<std::pair<uint64_t, std::vector<std::pair<K, V>>>>(cmd, key, cursor, match_op, count_op);
+    }
+
+    // pair<member, score>
+    template <typename T = std::string, typename S = double>
+    auto ZSCAN(std::string_view key, uint64_t cursor, std::string_view match = "", size_t count = 0) {
+        RedisOp::MATCH match_op;
+        RedisOp::COUNT count_op;
+        if (!match.empty()) match_op = match;
+        if (count > 0) count_op = count;
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(cursor), decltype(match_op), decltype(count_op)>("ZSCAN");
+        return Self().template ExcuteCommand<std::pair<uint64_t, std::vector<std::pair<T, S>>>>(cmd, key, cursor, match_op, count_op);
+    }
+
+    /*
+    Integer reply: 0 if the hash does not contain the field, or the key does not exist.
+    Integer reply: 1 if the hash contains the field.
+    */
+    auto HEXISTS(std::string_view key, std::string_view field) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(field)>("HEXISTS", detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<int>(cmd, key, field);
+    }
+
+    auto EXISTS(std::string_view key) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key)>("EXISTS", detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<int>(cmd, key);
+    }
+
+    template<typename T, typename... Args>
+    auto SET(std::string_view key, T&& value, Args&&... args) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(value), decltype(args)...>("SET");
+        return Self().template ExcuteCommand<std::string>(cmd, key, value, args...);
+    }
+
+    template<typename VT>
+    auto SETNX(const std::string_view& key,VT&& value){
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(value)>("SETNX");
+        return Self().template ExcuteCommand<int>(cmd, key, value);
+    }
+
+    template<typename T>
+    auto GET(std::string_view key) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key)>("GET", detail::kCmdCacheable | detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<T>(cmd, key);
+    }
+
+    // a value per key in the order of the keys, std::nullopt for a missing key
+    template <typename T = std::string, typename... Keys>
+    auto MGET(Keys&&... keys) {
+        static_assert(sizeof...(Keys) > 0, "invalid number of arguement");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(keys)...>("MGET", detail::kCmdMultiKey | detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<std::vector<std::optional<T>>>(cmd, keys...);
+    }
+
+    template <typename T = std::string, typename R>
+    auto MGET(R&& keys, std::enable_if_t<detail::is_arg_range_v<R>, int> = 0) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(keys)>("MGET", detail::kCmdMultiKey | detail::kCmdReadOnly);
+        return Self().template ExcuteChunked<std::vector<std::optional<T>>>(cmd, keys);
+    }
+
+    // key1 value1 key2 value2 ..., in a cluster the keys have to share a slot
+    template <typename... Args>
+    auto MSET(Args&&... args) {
+        static_assert(sizeof...(Args) % 2 == 0 && sizeof...(Args) > 0, "invalid number of arguement");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(args)...>("MSET", detail::kCmdKeyValue);
+        return Self().template ExcuteCommand<std::string>(cmd, args...);
+    }
+
+    // key value pairs, a map or a vector of pairs. A split MSET is atomic per chunk only
+    template <typename R>
+    auto MSET(R&& pairs, std::enable_if_t<detail::is_arg_range_v<R> && detail::is_pair<typename std::decay_t<R>::value_type>::value, int> = 0) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(pairs)>("MSET", detail::kCmdKeyValue);
+        return Self().template ExcuteChunked<std::string>(cmd, pairs);
+    }
+
+
+    // Integer reply: the value of the field after the increment operation.
+    auto INCRBY(const std::string_view key, int64_t inc) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(inc)>("INCRBY");
+        return Self().template ExcuteCommand<int64_t>(cmd, key, inc);
+    }
+
+    template<typename ...Args>
+    auto DEL(Args&& ...keys) {
+        static_assert(sizeof...(Args) > 0, "invalid number of arguement");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(keys)...>("DEL", detail::kCmdMultiKey);
+        return Self().template ExcuteCommand<int>(cmd, keys...);
+    }
+
+    template <typename R>
+    auto DEL(R&& keys, std::enable_if_t<detail::is_arg_range_v<R>, int> = 0) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(keys)>("DEL", detail::kCmdMultiKey);
+        return Self().template ExcuteChunked<int>(cmd, keys);
+    }
+
+    /*
+    Integer reply: TTL in seconds.
+    Integer reply: -1 if the key exists but has no associated expiration.
+    Integer reply: -2 if the key does not exist.
+    */
+    auto TTL(std::string_view key) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key)>("TTL", detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<int>(cmd, key);
+    }
+
+    // key score1 member1 score2 member2 ...
+    template<typename ...Args>
+    auto ZADD(std::string_view key, Args&& ...keys) {
+        static_assert((sizeof...(Args) % 2) == 0 && (sizeof...(Args) > 0),
+            "invalid number of arguement");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(keys)...>("ZADD");
+        return Self().template ExcuteCommand<int>(cmd, key, keys...);
+    }
+
+    // pairs of score, member, in the order ZADD takes them
+    template <typename R>
+    auto ZADD(std::string_view key, R&& members,
+        std::enable_if_t<detail::is_arg_range_v<R> && detail::is_pair<typename std::decay_t<R>::value_type>::value, int> = 0) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(members)>("ZADD");
+        return Self().template ExcuteChunked<int>(cmd, members, key);
+    }
+
+    template<typename ...Args>
+    auto ZREM(Args&& ...keys) {
+        static_assert((sizeof...(Args) > 0), "invalid number of arguement");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(keys)...>("ZREM");
+        return Self().template ExcuteCommand<int>(cmd, keys...);
+    }
+
+    auto ZCARD(std::string_view key) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key)>("ZCARD", detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<int>(cmd, key);
+    }
+
+    // scores are doubles, an integral R fails on a score with a fraction under RESP2 and RESP3 alike
+    template<typename R = double, typename T>
+    auto ZSCORE(std::string_view key, T member) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(member)>("ZSCORE", detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<R>(cmd, key, member);
+    }
+
+    // the new score, see ZSCORE
+    template<typename R = double, typename T>
+    auto ZINCRBY(std::string_view key, int increment, T&& member) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(increment), decltype(member)>("ZINCRBY");
+        return Self().template ExcuteCommand<R>(cmd, key, increment, member);
+    }
+
+    // query WITHSCORES
+    template <typename R = int>
+    auto ZREVRANGE(std::string_view key, int start, int stop) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(start), decltype(stop), const char*>("ZREVRANGE", detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<std::vector<std::pair<std::string, R>>>(
+            cmd, key, start, stop, "WITHSCORES");
+    }
+
+    /*
+    // query WITHSCORES, pair<rank, socre>
+    template<typename T>
+    tl::expected<std::pair<int, int>, int> ZREVRANK(std::string_view key, T member) {
+        std::string cmd = fmt::format("ZREVRANK {} {} WITHSCORE", key, member);
+        return ExcuteCommand<std::pair<int, int>>(cmd);
+    }
+    */
+
+    // runs the script sent along, the server keeps it by its SHA1 afterwards
+    template <typename T, typename... Args>
+    auto EVAL(std::string_view script, std::initializer_list<std::string_view> keys, const Args&... args) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(script), size_t, decltype(keys), Args...>(
+            "EVAL", detail::kCmdScript);
+        return Self().template ExcuteCommand<T>(cmd, script, keys.size(), keys, args...);
+    }
+
+    // a script the server already knows, see RedisMgr::Eval for the NOSCRIPT fallback
+    template <typename T, typename... Args>
+    auto EVALSHA(std::string_view sha, std::initializer_list<std::string_view> keys, const Args&... args) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(sha), size_t, decltype(keys), Args...>(
+            "EVALSHA", detail::kCmdScript);
+        return Self().template ExcuteCommand<T>(cmd, sha, keys.size(), keys, args...);
+    }
+
+    // returns the SHA1 of the script
+    auto SCRIPT_LOAD(std::string_view script) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(script)>("SCRIPT LOAD", detail::kCmdNoKey);
+        return Self().template ExcuteCommand<std::string>(cmd, script);
+    }
+
+    template<typename T>
+    auto ZREVRANK(std::string_view key, T member) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(member)>("ZREVRANK", detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<int>(cmd, key, member);
+    }
+
+    /*
+    Appends an entry and returns its id. The fields are field value arguments,
+    a map or a REDIS_STRUCT, id is usually "*":
+
+        mgr.XADD("jobs", "*", job);
+        mgr.XADD("jobs", RedisOp::MAXLEN{ 100000 }, "*", "type", "mail", "to", to);
+    */
+    template <typename... Args>
+    auto XADD(std::string_view key, std::string_view id, Args&&... fields) {
+        static_assert(sizeof...(Args) > 0, "an entry needs fields");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(id), decltype(fields)...>("XADD");
+        return Self().template ExcuteCommand<std::string>(cmd, key, id, fields...);
+    }
+
+    template <const char* op, typename V, typename... Args>
+    auto XADD(std::string_view key, const RedisOp::StreamTrim<op, V>& trim, std::string_view id, Args&&... fields) {
+        static_assert(sizeof...(Args) > 0, "an entry needs fields");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(trim), decltype(id), decltype(fields)...>("XADD");
+        return Self().template ExcuteCommand<std::string>(cmd, key, trim, id, fields...);
+    }
+
+    // returns the number of entries removed
+    template <const char* op, typename V>
+    auto XTRIM(std::string_view key, const RedisOp::StreamTrim<op, V>& trim) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(trim)>("XTRIM");
+        return Self().template ExcuteCommand<int64_t>(cmd, key, trim);
+    }
+
+    auto XLEN(std::string_view key) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key)>("XLEN", detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<int64_t>(cmd, key);
+    }
+
+    // ids are strings or containers of them
+    template <typename... Args>
+    auto XDEL(std::string_view key, Args&&... ids) {
+        static_assert(sizeof...(Args) > 0, "XDEL needs an id");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(ids)...>("XDEL");
+        return Self().template ExcuteCommand<int64_t>(cmd, key, ids...);
+    }
+
+    // XRANGE<Job>("jobs", "-", "+", RedisOp::COUNT{ 100 })
+    template <typename T, typename... Args>
+    auto XRANGE(std::string_view key, std::string_view start, std::string_view end, Args&&... options) {
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(start), decltype(end), decltype(options)...>(
+            "XRANGE", detail::kCmdReadOnly);
+        return Self().template ExcuteCommand<std::vector<StreamEntry<T>>>(cmd, key, start, end, options...);
+    }
+
+    // "$" delivers only entries added from now on, "0" the whole stream. An existing group is a BUSYGROUP error
+    auto XGROUP_CREATE(std::string_view key, std::string_view group, std::string_view id = "$", bool mkstream = true) {
+        if (mkstream) {
+            static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(group), decltype(id), std::string_view>(
+                "XGROUP CREATE");
+            return Self().template ExcuteCommand<std::string>(cmd, key, group, id, std::string_view("MKSTREAM"));
+        }
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(group), decltype(id)>("XGROUP CREATE");
+        return Self().template ExcuteCommand<std::string>(cmd, key, group, id);
+    }
+
+    /*
+    Up to count entries of one stream for consumer, ">" reads new entries and
+    "0" the ones already delivered to it and not acknowledged. With block the
+    call waits that many milliseconds for entries, the context is held meanwhile.
+    A timeout is the REDIS_REPLY_NIL error.
+    */
+    template <typename T>
+    auto XREADGROUP(std::string_view group, std::string_view consumer, int64_t count, std::optional<int64_t> block,
+        std::string_view key, std::string_view id = ">") {
+        RedisOp::COUNT count_option{ count };
+        RedisOp::BLOCK block_option = block ? RedisOp::BLOCK{ *block } : RedisOp::BLOCK{};
+        std::string_view streams = "STREAMS";
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(group), decltype(consumer), decltype(count_option),
+            decltype(block_option), decltype(streams), decltype(key), decltype(id)>(
+            "XREADGROUP GROUP", detail::kCmdStreamKey | detail::kCmdBlocking);
+        return Self().template ExcuteCommand<StreamRead<T>>(cmd, group, consumer, count_option, block_option, streams, key, id);
+    }
+
+    // ids are strings or containers of them, returns the number acknowledged
+    template <typename... Args>
+    auto XACK(std::string_view key, std::string_view group, Args&&... ids) {
+        static_assert(sizeof...(Args) > 0, "XACK needs an id");
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(group), decltype(ids)...>("XACK");
+        return Self().template ExcuteCommand<int64_t>(cmd, key, group, ids...);
+    }
+
+    // takes over entries pending for min_idle milliseconds or longer, start is "0-0" or the cursor of the previous call
+    template <typename T>
+    auto XAUTOCLAIM(std::string_view key, std::string_view group, std::string_view consumer, int64_t min_idle,
+        std::string_view start, int64_t count = 100) {
+        RedisOp::COUNT count_option{ count };
+        static constexpr auto cmd = detail::MakeRespCommand<decltype(key), decltype(group), decltype(consumer),
+            decltype(min_idle), decltype(start), decltype(count_option)>("XAUTOCLAIM");
+        return Self().template ExcuteCommand<StreamClaim<T>>(cmd, key, group, consumer, min_idle, start, count_option);
+    }
+
+    // no owner token, any client can release it, see RedisLocker in lock.hpp
+	auto TryLock(std::string_view lock_key, int px = 3000) {
+		return SET(lock_key, 1, RedisOp::PX{ px }, RedisOp::NX{});
+    }
+
+	auto UnLock(std::string_view lock_key) {
+		return DEL(lock_key);
+	}
+
+protected:
+    Impl& Self() { return static_cast<Impl&>(*this); }
+
+    // the whole range in one command, for the clients that do not split
+    template <typename T, typename Cmd, typename R, typename... Args>
+    auto ExcuteChunked(const Cmd& cmd, const R& range, const Args&... args) {
+        return Self().template ExcuteCommand<T>(cmd, args..., range);
+    }
+};
+
+// handle of a command queued in a RedisPipeline, decoded with RedisPipeline::Get
+template <typename T>
+struct PipelineResult {
+    size_t index = 0;
+    size_t count = 1;   // commands of a split container argument, their replies are merged by Get
+};
+
+/*
+The typed methods of a pipeline queue their command instead of sending it.
+Exec() checks out one context, sends every queued command in a single write and
+reads all the replies back. A pipeline can be reused after Exec(), handles of
+the previous batch are invalid then.
+
+    auto pipe = mgr.Pipeline();
+    auto [name, visits] = pipe.Exec(pipe.HGET<std::string>("user:1", "name"),
+        pipe.HINCRBY("user:1", "visits", 1));
+*/
+class RedisPipeline : public RedisCommands<RedisPipeline> {
+public:
+    explicit RedisPipeline(RedisPool& pool) : pool_(pool) {}
+
+    template <typename T, typename Cmd, typename... Args>
+    PipelineResult<T> ExcuteCommand(const Cmd& command, const Args&... args) {
+        detail::RespWriter(buffer_).Command(command, args...);
+        return PipelineResult<T>{ count_++ };
+    }
+
+    // a command per RedisInitParam::chunk_size elements of range, one handle for all of them.
+    // an empty range queues nothing, Get returns detail::EmptyChunk<T>() for it
+    template <typename T, typename Cmd, typename R, typename... Args>
+    PipelineResult<T> ExcuteChunked(const Cmd& command, const R& range, const Args&... args) {
+        PipelineResult<T> result{ count_, 0 };
+        detail::ForEachChunk(range, pool_.Param().chunk_size, [&](const auto& chunk) {
+            ExcuteCommand<T>(command, args..., chunk);
+            result.count++;
+        });
+        return result;
+    }
+
+    size_t Size() const { return count_; }
+
+    // bytes of the queued commands
+    size_t Bytes() const { return buffer_.size(); }
+
+    // send the queued commands, return -1 if the replies could not all be read
+    int Exec() {
+        int ret = Send();
+        buffer_.clear();
+        return ret;
+    }
+
+    // Exec() that leaves the commands it sent in sent, for a slow command log
+    int Exec(fmt::memory_buffer& sent) {
+        int ret = Send();
+        std::swap(buffer_, sent);
+        buffer_.clear();
+        return ret;
+    }
+
+    // RESP size of the replies of the last Exec()
+    size_t ReplyBytes() const;
+
+    template <typename... T>
+    std::tuple<tl::expected<T, int>...> Exec(PipelineResult<T>... results) {
+        Exec();
+        return std::make_tuple(Get(results)...);
+    }
+
+    // send the queued commands and decode every reply as T
+    template <typename T>
+    std::vector<tl::expected<T, int>> ExecAll() {
+        Exec();
+        std::vector<tl::expected<T, int>> results;
+        results.reserve(replies_.size());
+        for (size_t i = 0; i < replies_.size(); i++)
+            results.push_back(Get(PipelineResult<T>{ i }));
+        return results;
+    }
+
+    template <typename T>
+    tl::expected<T, int> Get(PipelineResult<T> result) {
+        if (result.count == 0)
+            return detail::EmptyChunk<T>();
+        if (result.index + result.count > replies_.size())
+            return tl::unexpected{ -1 };
+        auto total = Reply<T>(result.index);
+        for (size_t i = 1; i < result.count; i++)
+            detail::MergeChunk(total, Reply<T>(result.index + i));
+        return total;
+    }
+
+    // the text of an error reply, "ERR unknown command ..." and the like, empty for any other reply
+    template <typename T>
+    std::string_view ErrorReply(PipelineResult<T> result) const {
+        for (size_t i = result.index; i < result.index + result.count && i < replies_.size(); i++) {
+            if (replies_[i] && replies_[i]->type == REDIS_REPLY_ERROR)
+                return std::string_view(replies_[i]->str, replies_[i]->len);
+        }
+        return std::string_view();
+    }
+
+private:
+    // the queued commands in one write and their replies into replies_
+    int Send() {
+        replies_.clear();
+        int ret = 0;
+        RedisPool::AutoContext context;
+        if (buffer_.size() > 0) {
+            context = pool_.Get();
+            if (!context) {
+                LOG_ERROR("%s: no redis context available", __FUNCTION__);
+                ret = -1;
+            }
+            else if (!context.Send(buffer_.data(), buffer_.size())) {
+                LOG_ERROR("%s: append failed, context error[%d:%s]", __FUNCTION__, context->err, context->errstr);
+                context.SetContextDisable();
+                ret = -1;
+            }
+        }
+
+        for (size_t i = 0; i < count_; i++) {
+            RedisReply reply = ret == 0 ? context.Receive() : RedisReply(nullptr);
+            if (ret == 0 && !reply) {
+                LOG_ERROR("%s: reply is null, context error[%d:%s]", __FUNCTION__, context->err, context->errstr);
+                // the replies left on the connection can't be matched to commands anymore
+                context.SetContextDisable();
+                ret = -1;
+            }
+            replies_.push_back(reply);
+        }
+        count_ = 0;
+        return ret;
+    }
+
+    template <typename T>
+    tl::expected<T, int> Reply(size_t index) {
+        if (!replies_[index])
+            return tl::unexpected{ -1 };
+        return GetFromReply<T>(replies_[index]);
+    }
+
+
+private:
+    RedisPool& pool_;
+    fmt::memory_buffer buffer_;
+    size_t count_ = 0;
+    std::vector<RedisReply> replies_;
+};
+
+struct BulkOptions {
+    size_t window = 10000;              // commands sent and not answered yet at most
+    size_t chunk_bytes = 64 * 1024;     // encoded commands are written in chunks of about this size
+    size_t max_errors = 1000;           // errors kept in BulkResult::errors, the rest are only counted
+};
+
+struct BulkError {
+    size_t record = 0;      // 0 based, in the order the records were added
+    std::string message;    // the error reply, or why the record was not sent
+};
+
+struct BulkResult {
+    size_t records = 0;
+    size_t ok = 0;
+    size_t failed = 0;
+    std::vector<BulkError> errors;
+    int error = 0;          // -1 when the connection was lost, the records not answered count as failed
+};
+
+/*
+Bulk ingest on one connection, in the manner of redis-cli --pipe. The typed
+methods, and Add() for whole RESP commands, encode straight into a chunk buffer.
+Full chunks are written without waiting, and replies are only read once more
+than options.window commands are outstanding. An error reply fails its own
+record and loading goes on. Finish() drains the replies.
+
+    auto loader = mgr.BulkLoad();
+    for (auto& user : users)
+        loader.HSET(user.key, user.profile);
+    BulkResult result = loader.Finish();
+*/
+class BulkLoader : public RedisCommands<BulkLoader> {
+public:
+    BulkLoader(RedisPool& pool, BulkOptions options = {})
+        : pool_(&pool), options_(options) {
+        options_.window = std::max<size_t>(options_.window, 1);
+    }
+    BulkLoader(BulkLoader&&) = default;
+    BulkLoader& operator=(BulkLoader&&) = default;
+    ~BulkLoader() { Finish(); }
+
+    // false once the connection is lost, the record is counted as failed then
+    template <typename T, typename Cmd, typename... Args>
+    bool ExcuteCommand(const Cmd& command, const Args&... args) {
+        if (!Usable())
+            return false;
+        detail::RespWriter(buffer_).Command(command, args...);
+        return Queued();
+    }
+
+    // one command already encoded in RESP, sent as is
+    bool Add(std::string_view resp) {
+        if (!Usable())
+            return false;
+        buffer_.append(resp.data(), resp.data() + resp.size());
+        return Queued();
+    }
+
+    // a record that could not be turned into a command, it takes a record number and an error
+    void Reject(std::string_view message) {
+        Fail(result_.records++, message);
+    }
+
+    // the arguments of one command, the first is the name
+    template <typename Strings>
+    bool AddArgv(const Strings& argv) {
+        if (!Usable())
+            return false;
+        detail::RespWriter writer(buffer_);
+        writer.Header(std::size(argv));
+        for (auto& arg : argv)
+            writer.Bulk(std::data(arg), std::size(arg));
+        return Queued();
+    }
+
+    // send what is buffered, wait for every reply and hand the connection back
+    BulkResult Finish() {
+        Write();
+        while (!in_flight_.empty() && ReadReply()) {
+        }
+        context_.Release();
+        return result_;
+    }
+
+    const BulkResult& Progress() const { return result_; }
+
+private:
+    bool Usable() {
+        if (result_.error == 0)
+            return true;
+        Fail(result_.records++, "connection lost");
+        return false;
+    }
+
+    bool Queued() {
+        buffered_.push_back(result_.records++);
+        if (buffer_.size() >= options_.chunk_bytes)
+            Write();
+        return result_.error == 0;
+    }
+
+    void Write() {
+        if (buffered_.empty() || result_.error != 0)
+            return;
+        if (!context_)
+            context_ = pool_->Get();
+        if (!context_) {
+            LOG_ERROR("%s: no redis context available", __FUNCTION__);
+            Lost();
+            return;
+        }
+        if (!context_.Send(buffer_.data(), buffer_.size()) || !context_.Flush()) {
+            LOG_ERROR("%s: write failed, context error[%d:%s]", __FUNCTION__, context_->err, context_->errstr);
+            Lost();
+            return;
+        }
+        buffer_.clear();
+        in_flight_.insert(in_flight_.end(), buffered_.begin(), buffered_.end());
+        buffered_.clear();
+        while (in_flight_.size() > options_.window && ReadReply()) {
+        }
+    }
+
+    bool ReadReply() {
+        RedisReply reply = context_.Receive();
+        if (!reply) {
+            LOG_ERROR("%s: reply is null, context error[%d:%s]", __FUNCTION__, context_->err, context_->errstr);
+            Lost();
+            return false;
+        }
+        size_t record = in_flight_.front();
+        in_flight_.pop_front();
+        if (reply->type == REDIS_REPLY_ERROR)
+            Fail(record, std::string_view(reply->str, reply->len));
+        else
+            result_.ok++;
+        return true;
+    }
+
+    // the replies left on the connection can't be matched to records anymore
+    void Lost() {
+        if (context_)
+            context_.SetContextDisable();
+        context_.Release();
+        result_.error = -1;
+        for (size_t record : in_flight_)
+            Fail(record, "connection lost");
+        for (size_t record : buffered_)
+            Fail(record, "connection lost");
+        in_flight_.clear();
+        buffered_.clear();
+        buffer_.clear();
+    }
+
+    void Fail(size_t record, std::string_view message) {
+        result_.failed++;
+        if (result_.errors.size() < options_.max_errors)
+            result_.errors.push_back({ record, std::string(message) });
+    }
+
+    RedisPool* pool_;
+    BulkOptions options_;
+    RedisPool::AutoContext context_;
+    fmt::memory_buffer buffer_;
+    std::vector<size_t> buffered_;
+    std::deque<size_t> in_flight_;
+    BulkResult result_;
+};
+
+/*
+Walks every page of a SCAN family command. While the caller is going through
+page N, page N+1 is already being fetched on the prefetch thread of the range,
+started with the second page and kept until the range goes away, so the round
+trips overlap with the work on the elements. A failed page ends the iteration, Error()
+tells it apart from the real end. Elements can show up more than once, as with
+SCAN itself.
+
+for (auto& key : mgr.ScanAll("user:*", 1000)) ...
+*/
+template <typename T>
+class ScanRange {
+public:
+    using Page = std::pair<uint64_t, std::vector<T>>;
+    using Fetch = std::function<tl::expected<Page, int>(uint64_t)>;
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using reference = T&;
+
+        explicit iterator(ScanRange* range) : range_(range) {}
+        T& operator*() const { return range_->page_[range_->pos_]; }
+        T* operator->() const { return &range_->page_[range_->pos_]; }
+        iterator& operator++() {
+            range_->pos_++;
+            range_->Settle();
+            return *this;
+        }
+        bool operator==(const iterator& other) const { return Done() == other.Done(); }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+
+    private:
+        bool Done() const { return !range_ || range_->done_; }
+        ScanRange* range_;
+    };
+
+    explicit ScanRange(Fetch fetch) : prefetch_(std::make_unique<Prefetch>(std::move(fetch))) {}
+    ScanRange(ScanRange&&) = default;
+    ScanRange& operator=(ScanRange&&) = default;
+
+    // single pass, begin() fetches the first page
+    iterator begin() {
+        if (!started_) {
+            started_ = true;
+            Load(prefetch_->fetch(0));
+            Settle();
+        }
+        return iterator(this);
+    }
+    iterator end() { return iterator(nullptr); }
+
+    // 0, or the error of the page that stopped the iteration
+    int Error() const { return error_; }
+
+private:
+    // one thread fetches the pages one ahead, it lives on the heap so the range can move
+    struct Prefetch {
+        explicit Prefetch(Fetch f) : fetch(std::move(f)) {}
+        ~Prefetch() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            cv.notify_all();
+            if (thread.joinable())
+                thread.join();
+        }
+
+        void Request(uint64_t next) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                cursor = next;
+            }
+            if (!thread.joinable())
+                thread = std::thread([this] { Run(); });
+            cv.notify_all();
+        }
+
+        tl::expected<Page, int> Take() {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return page.has_value(); });
+            auto taken = std::move(*page);
+            page.reset();
+            return taken;
+        }
+
+        void Run() {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                cv.wait(lock, [this] { return stop || cursor.has_value(); });
+                if (stop)
+                    return;
+                uint64_t next = *cursor;
+                cursor.reset();
+                lock.unlock();
+                auto fetched = fetch(next);
+                lock.lock();
+                page = std::move(fetched);
+                cv.notify_all();
+            }
+        }
+
+        Fetch fetch;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::optional<uint64_t> cursor;
+        std::optional<tl::expected<Page, int>> page;
+        bool stop = false;
+    };
+
+    void Load(tl::expected<Page, int> page) {
+        page_.clear();
+        pos_ = 0;
+        if (!page) {
+            error_ = page.error();
+            last_ = true;
+            return;
+        }
+        page_ = std::move(page->second);
+        last_ = page->first == 0;
+        if (!last_)
+            prefetch_->Request(page->first);
+    }
+
+    // skip to the next element, over empty pages too
+    void Settle() {
+        while (pos_ >= page_.size()) {
+            if (last_) {
+                done_ = true;
+                return;
+            }
+            Load(prefetch_->Take());
+        }
+    }
+
+    std::unique_ptr<Prefetch> prefetch_;
+    std::vector<T> page_;
+    size_t pos_ = 0;
+    bool started_ = false;
+    bool last_ = false;
+    bool done_ = false;
+    int error_ = 0;
+};
+
+struct NearCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t invalidations = 0;
+    size_t keys = 0;
+};
+
+namespace detail {
+
+template <typename T>
+struct is_cacheable_result
+    : std::bool_constant<!is_reply_view<T>::value && std::is_copy_constructible_v<T>> {};
+
+/*
+Decoded replies of cacheable reads, grouped by redis key so that an invalidation of
+the key drops every command that read it. Keys are spread over a few LRU shards,
+each behind its own mutex. The reply is stored as std::any, a lookup with another
+result type is a miss.
+
+A reply read before an invalidation could be inserted after it and stay stale, so
+Insert takes the Version() seen before the command was sent and gives up when any
+invalidation happened since.
+*/
+class NearCache {
+    struct Entry {
+        std::string key;
+        std::vector<std::pair<std::string, std::any>> commands;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru;
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+    };
+    static constexpr size_t kShards = 16;
+
+public:
+    explicit NearCache(size_t capacity) : capacity_(std::max<size_t>(capacity / kShards, 1)) {}
+
+    uint64_t Version() const { return version_.load(); }
+
+    template <typename T>
+    std::optional<T> Find(std::string_view key, std::string_view command) {
+        Shard& shard = ShardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            for (auto& [cmd, value] : it->second->commands) {
+                if (cmd != command)
+                    continue;
+                if (const T* hit = std::any_cast<T>(&value)) {
+                    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                    hits_.fetch_add(1, std::memory_order_relaxed);
+                    return *hit;
+                }
+                break;
+            }
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return std::nullopt;
+    }
+
+    template <typename T>
+    void Insert(std::string_view key, std::string_view command, const T& value, uint64_t version) {
+        Shard& shard = ShardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (version_.load() != version)
+            return;
+
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            if (shard.lru.size() >= capacity_) {
+                shard.index.erase(shard.lru.back().key);
+                shard.lru.pop_back();
+                evictions_.fetch_add(1, std::memory_order_relaxed);
+            }
+            shard.lru.push_front(Entry{ std::string(key), {} });
+            it = shard.index.emplace(shard.lru.front().key, shard.lru.begin()).first;
+        }
+        else {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        }
+        auto& commands = it->second->commands;
+        auto cmd = std::find_if(commands.begin(), commands.end(), [&](auto& c) { return c.first == command; });
+        if (cmd != commands.end())
+            cmd->second = value;
+        else
+            commands.emplace_back(std::string(command), value);
+    }
+
+    void Invalidate(std::string_view key) {
+        version_++;
+        invalidations_.fetch_add(1, std::memory_order_relaxed);
+        Shard& shard = ShardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end())
+            return;
+        auto entry = it->second;
+        shard.index.erase(it);
+        shard.lru.erase(entry);
+    }
+
+    void Clear() {
+        version_++;
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.index.clear();
+            shard.lru.clear();
+        }
+    }
+
+    NearCacheStats Stats() {
+        NearCacheStats stats;
+        stats.hits = hits_.load(std::memory_order_relaxed);
+        stats.misses = misses_.load(std::memory_order_relaxed);
+        stats.evictions = evictions_.load(std::memory_order_relaxed);
+        stats.invalidations = invalidations_.load(std::memory_order_relaxed);
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            stats.keys += shard.lru.size();
+        }
+        return stats;
+    }
+
+private:
+    Shard& ShardOf(std::string_view key) {
+        return shards_[std::hash<std::string_view>{}(key) % kShards];
+    }
+
+    size_t capacity_;
+    std::array<Shard, kShards> shards_;
+    std::atomic<uint64_t> version_{ 0 };
+    std::atomic<uint64_t> hits_{ 0 };
+    std::atomic<uint64_t> misses_{ 0 };
+    std::atomic<uint64_t> evictions_{ 0 };
+    std::atomic<uint64_t> invalidations_{ 0 };
+};
+
+/*
+Keeps a NearCache correct with server assisted invalidation. A dedicated connection
+subscribes to __redis__:invalidate and every context of the pool turns on
+CLIENT TRACKING REDIRECT <listener id> OPTIN, so only reads sent after
+CLIENT CACHING yes are tracked. The RESP2 redirect is used instead of RESP3 push
+replies so the pool contexts keep their protocol.
+
+While the listener is down nothing may be cached: the cache is cleared, Ready()
+is false, and once it is back the pool reconnects to point tracking at the new
+client id.
+*/
+class TrackingListener {
+public:
+    ~TrackingListener() { Stop(); }
+
+    void Start(const RedisInitParam& param, RedisPool& pool, NearCache& cache) {
+        RedisInitParam listen = param;
+        listen.context_count = 1;
+        listen.use_reply_arena = false;
+        listen.protocol = 2;    // pub/sub messages would arrive as RESP3 pushes
+        listen.heart_invervals = 0;
+        pool_.Initialize(listen);
+        running_ = true;
+        thread_ = std::thread([this, &pool, &cache] { Run(pool, cache); });
+    }
+
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_)
+                return;
+            running_ = false;
+            if (fd_ >= 0)
+                shutdown(fd_, SHUT_RDWR);
+        }
+        cv_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+        pool_.UnInit();
+    }
+
+    bool Ready() const { return ready_.load(); }
+
+    // connect hook of the pool contexts
+    bool Track(redisContext* context) {
+        long long id = client_id_.load();
+        if (id == 0)
+            return true;
+        RedisReply reply = redisCommand(context, "CLIENT TRACKING on REDIRECT %lld OPTIN", id);
+        if (!reply || reply->type == REDIS_REPLY_ERROR) {
+            LOG_ERROR("%s: CLIENT TRACKING failed, %s", __FUNCTION__, reply ? reply->str : context->errstr);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    void Run(RedisPool& pool, NearCache& cache) {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!running_)
+                    break;
+            }
+            auto context = pool_.Get();
+            if (context && Subscribe(context, pool)) {
+                ready_ = true;
+                Listen(context, cache);
+            }
+            ready_ = false;
+            client_id_ = 0;
+            cache.Clear();
+            if (context)
+                context.SetContextDisable();
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            fd_ = -1;
+            cv_.wait_for(lock, std::chrono::seconds(1), [this] { return !running_; });
+        }
+    }
+
+    bool Subscribe(RedisPool::AutoContext& context, RedisPool& pool) {
+        RedisReply id = redisCommand(context, "CLIENT ID");
+        if (!id || id->type != REDIS_REPLY_INTEGER) {
+            LOG_ERROR("%s: CLIENT ID failed, client side caching needs redis 6", __FUNCTION__);
+            return false;
+        }
+        RedisReply reply = redisCommand(context, "SUBSCRIBE __redis__:invalidate");
+        if (!reply || reply->type != REDIS_REPLY_ARRAY)
+            return false;
+
+        redisEnableKeepAlive(context);
+        struct timeval tv = { 0, 0 };
+        redisSetTimeout(context, tv);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_)
+                return false;
+            fd_ = context->fd;
+        }
+        client_id_ = id->integer;
+        pool.ReconnectAll();
+        return true;
+    }
+
+    void Listen(RedisPool::AutoContext& context, NearCache& cache) {
+        for (;;) {
+            // ["message", "__redis__:invalidate", [key...]], a nil key list means flush everything
+            RedisReply reply = context.Receive();
+            if (!reply)
+                return;
+            if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 3)
+                continue;
+            const redisReply* keys = reply->element[2];
+            if (keys->type == REDIS_REPLY_ARRAY) {
+                for (size_t i = 0; i < keys->elements; i++)
+                    cache.Invalidate(std::string_view(keys->element[i]->str, keys->element[i]->len));
+            }
+            else {
+                cache.Clear();
+            }
+        }
+    }
+
+    RedisPool pool_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool running_ = false;
+    int fd_ = -1;
+    std::atomic<bool> ready_{ false };
+    std::atomic<long long> client_id_{ 0 };
+};
+}
+
+// latency distribution of one command, merged over every thread
+struct CommandMetrics {
+    uint64_t count = 0;
+    uint64_t request_bytes = 0;
+    uint64_t reply_bytes = 0;       // RESP size of the replies
+    uint64_t max_ns = 0;
+    uint64_t total_ns = 0;
+    // errors by the code GetFromReply returns, [0] is -1 (no context, broken connection
+    // or a reply that did not convert), the others are REDIS_REPLY_ERROR, REDIS_REPLY_NIL...
+    std::array<uint64_t, 16> errors{};
+    std::vector<uint64_t> buckets;  // see detail::LatencyHistogram
+
+    // upper bound of the bucket holding the q quantile, q in [0, 1]
+    uint64_t PercentileNs(double q) const;
+    uint64_t MeanNs() const { return count ? total_ns / count : 0; }
+};
+
+struct MetricsSnapshot {
+    std::map<std::string, CommandMetrics> commands;
+
+    // one line per command, for a log or a debug endpoint
+    std::string Format() const {
+        fmt::memory_buffer out;
+        for (auto& [name, m] : commands) {
+            uint64_t errors = 0;
+            for (auto e : m.errors)
+                errors += e;
+            fmt::format_to(std::back_inserter(out),
+                "{} count={} errors={} mean={}us p50={}us p99={}us p999={}us max={}us out={}B in={}B\n",
+                name, m.count, errors, m.MeanNs() / 1000, m.PercentileNs(0.5) / 1000, m.PercentileNs(0.99) / 1000,
+                m.PercentileNs(0.999) / 1000, m.max_ns / 1000, m.request_bytes, m.reply_bytes);
+        }
+        return fmt::to_string(out);
+    }
+};
+
+// what the slow command hook gets, request is the RESP sent and only valid during the call
+struct SlowCommand {
+    std::string_view command;
+    std::string_view request;
+    std::chrono::nanoseconds latency;
+    int error = 0;  // 0 or the code of the failed result
+};
+
+namespace detail {
+
+/*
+Log linear buckets in the manner of HdrHistogram: every power of two is split
+into 8 linear sub buckets, so a bucket is at most 12.5% wide. Values are
+nanoseconds, everything above 2^40 (about 18 minutes) lands in the last bucket.
+*/
+struct LatencyHistogram {
+    static constexpr size_t kSubBits = 3;
+    static constexpr size_t kSub = size_t(1) << kSubBits;
+    static constexpr size_t kMaxBits = 40;
+    static constexpr size_t kBuckets = (kMaxBits - kSubBits + 2) * kSub;
+
+    static size_t Index(uint64_t v) {
+        if (v < kSub)
+            return static_cast<size_t>(v);
+        size_t msb = 63;
+        while (!(v >> msb))
+            msb--;
+        size_t shift = msb - kSubBits;
+        size_t index = (shift + 1) * kSub + static_cast<size_t>((v >> shift) - kSub);
+        return std::min(index, kBuckets - 1);
+    }
+
+    static uint64_t UpperBound(size_t index) {
+        if (index < kSub)
+            return index;
+        size_t shift = index / kSub - 1;
+        uint64_t lower = static_cast<uint64_t>(kSub + index % kSub) << shift;
+        return lower + (uint64_t(1) << shift) - 1;
+    }
+};
+
+// RESP size of a reply, close enough for byte counters
+inline size_t ReplyBytes(const redisReply* reply) {
+    auto digits = [](size_t n) {
+        size_t d = 1;
+        while (n >= 10) {
+            n /= 10;
+            d++;
+        }
+        return d;
+    };
+    switch (reply->type) {
+    case REDIS_REPLY_INTEGER:
+        return 3 + digits(reply->integer < 0 ? 0 - static_cast<size_t>(reply->integer) : static_cast<size_t>(reply->integer));
+    case REDIS_REPLY_NIL:
+        return 5;
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_ERROR:
+    case REDIS_REPLY_DOUBLE:
+    case REDIS_REPLY_BIGNUM:
+        return 3 + reply->len;
+    case REDIS_REPLY_ARRAY:
+    case REDIS_REPLY_MAP:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_PUSH: {
+        size_t size = 3 + digits(reply->elements);
+        for (size_t i = 0; i < reply->elements; i++)
+            size += ReplyBytes(reply->element[i]);
+        return size;
+    }
+    default:
+        return 5 + digits(reply->len) + reply->len;
+    }
+}
+}
+
+inline size_t RedisPipeline::ReplyBytes() const {
+    size_t size = 0;
+    for (auto& reply : replies_)
+        size += reply ? detail::ReplyBytes(reply) : 0;
+    return size;
+}
+
+inline uint64_t CommandMetrics::PercentileNs(double q) const {
+    if (count == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return std::min(detail::LatencyHistogram::UpperBound(i), max_ns);
+    }
+    return max_ns;
+}
+
+/*
+Per command latency histograms, byte and error counters. Every thread records
+into its own shard: a command seen for the first time takes the shard lock once,
+after that recording is a map lookup and relaxed stores only the owning thread
+makes. Snapshot() adds the shards up.
+*/
+class RedisMetrics {
+    struct Counters {
+        std::atomic<uint64_t> count{ 0 };
+        std::atomic<uint64_t> request_bytes{ 0 };
+        std::atomic<uint64_t> reply_bytes{ 0 };
+        std::atomic<uint64_t> max_ns{ 0 };
+        std::atomic<uint64_t> total_ns{ 0 };
+        std::array<std::atomic<uint64_t>, 16> errors{};
+        std::array<std::atomic<uint64_t>, detail::LatencyHistogram::kBuckets> buckets{};
+    };
+    struct Shard {
+        std::mutex mutex;   // guards inserts into commands against Snapshot
+        std::map<std::string, std::unique_ptr<Counters>, std::less<>> commands;
+    };
+    // shared with the threads, a thread that exits folds its shard into retired
+    struct Core {
+        uint64_t id = 0;
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Shard>> shards;
+        std::map<std::string, CommandMetrics> retired;
+
+        void Retire(Shard* shard) {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = std::find_if(shards.begin(), shards.end(), [&](auto& s) { return s.get() == shard; });
+            if (it == shards.end())
+                return;
+            {
+                std::lock_guard<std::mutex> shard_lock(shard->mutex);
+                for (auto& [name, c] : shard->commands)
+                    Fold(retired[name], *c);
+            }
+            shards.erase(it);
+        }
+    };
+    // the shards of one thread, retired when it exits
+    struct LocalShards {
+        struct Entry {
+            uint64_t id;
+            std::weak_ptr<Core> core;
+            Shard* shard;
+        };
+        std::vector<Entry> entries;
+
+        ~LocalShards() {
+            for (auto& entry : entries) {
+                if (auto core = entry.core.lock())
+                    core->Retire(entry.shard);
+            }
+        }
+    };
+
+public:
+    RedisMetrics() : core_(std::make_shared<Core>()) { core_->id = NextId(); }
+    RedisMetrics(const RedisMetrics&) = delete;
+    RedisMetrics& operator=(const RedisMetrics&) = delete;
+
+    // error is 0 for a good result, else what GetFromReply returned
+    void Record(std::string_view command, std::chrono::nanoseconds latency, size_t request_bytes,
+        size_t reply_bytes, int error) {
+        Counters& c = Find(command);
+        uint64_t ns = static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0));
+        Bump(c.count, 1);
+        Bump(c.request_bytes, request_bytes);
+        Bump(c.reply_bytes, reply_bytes);
+        Bump(c.total_ns, ns);
+        Bump(c.buckets[detail::LatencyHistogram::Index(ns)], 1);
+        if (ns > c.max_ns.load(std::memory_order_relaxed))
+            c.max_ns.store(ns, std::memory_order_relaxed);
+        if (error != 0)
+            Bump(c.errors[error > 0 && error < 16 ? error : 0], 1);
+    }
+
+    // the live shards of the threads and what the exited ones left
+    MetricsSnapshot Snapshot() {
+        MetricsSnapshot snapshot;
+        std::lock_guard<std::mutex> lock(core_->mutex);
+        for (auto& [name, m] : core_->retired)
+            snapshot.commands.emplace(name, m);
+        for (auto& shard : core_->shards) {
+            std::lock_guard<std::mutex> shard_lock(shard->mutex);
+            for (auto& [name, c] : shard->commands)
+                Fold(snapshot.commands[name], *c);
+        }
+        return snapshot;
+    }
+
+private:
+    static void Fold(CommandMetrics& m, const Counters& c) {
+        m.buckets.resize(detail::LatencyHistogram::kBuckets);
+        m.count += c.count.load(std::memory_order_relaxed);
+        m.request_bytes += c.request_bytes.load(std::memory_order_relaxed);
+        m.reply_bytes += c.reply_bytes.load(std::memory_order_relaxed);
+        m.total_ns += c.total_ns.load(std::memory_order_relaxed);
+        m.max_ns = std::max(m.max_ns, c.max_ns.load(std::memory_order_relaxed));
+        for (size_t i = 0; i < m.errors.size(); i++)
+            m.errors[i] += c.errors[i].load(std::memory_order_relaxed);
+        for (size_t i = 0; i < m.buckets.size(); i++)
+            m.buckets[i] += c.buckets[i].load(std::memory_order_relaxed);
+    }
+
+    // only the owning thread writes, so a load and a store do without a locked add
+    static void Bump(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static uint64_t NextId() {
+        static std::atomic<uint64_t> id{ 0 };
+        return ++id;
+    }
+
+    Counters& Find(std::string_view command) {
+        Shard& shard = LocalShard();
+        auto it = shard.commands.find(command);
+        if (it != shard.commands.end())
+            return *it->second;
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return *shard.commands.emplace(std::string(command), std::make_unique<Counters>()).first->second;
+    }
+
+    // keyed by id rather than address, a new RedisMetrics may reuse the memory of a dead one
+    Shard& LocalShard() {
+        thread_local LocalShards local;
+        for (auto& entry : local.entries) {
+            if (entry.id == core_->id)
+                return *entry.shard;
+        }
+        // the entries of metrics that are gone are dropped on the way
+        local.entries.erase(std::remove_if(local.entries.begin(), local.entries.end(),
+            [](auto& entry) { return entry.core.expired(); }), local.entries.end());
+        std::lock_guard<std::mutex> lock(core_->mutex);
+        Shard* shard = core_->shards.emplace_back(std::make_unique<Shard>()).get();
+        local.entries.push_back({ core_->id, core_, shard });
+        return *shard;
+    }
+
+    std::shared_ptr<Core> core_;
+};
+
+namespace detail {
+struct Replica {
+    std::string name;
+    RedisPool pool;
+    std::atomic<int64_t> ewma_ns{ 0 };      // 0 until the first reply
+    std::atomic<int> outstanding{ 0 };
+    std::atomic<int64_t> down_until{ 0 };   // steady_clock nanoseconds, skipped before that
+
+    static int64_t Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool Down() const { return down_until.load(std::memory_order_relaxed) > Now(); }
+
+    // moving average over about the last 8 replies, racing updates just lose a sample
+    void Observe(std::chrono::nanoseconds latency) {
+        int64_t old = ewma_ns.load(std::memory_order_relaxed);
+        int64_t sample = latency.count();
+        ewma_ns.store(old == 0 ? sample : old + (sample - old) / 8, std::memory_order_relaxed);
+    }
+
+    // no reads for a second, then it starts over without history
+    void Fail() {
+        down_until.store(Now() + std::chrono::nanoseconds(std::chrono::seconds(1)).count(), std::memory_order_relaxed);
+        ewma_ns.store(0, std::memory_order_relaxed);
+    }
+};
+
+/*
+The replicas of a RedisMgr, one pool each, built from the primary RedisInitParam
+with host and port replaced. Pick() scans them all, a handful at most, from a
+rotating start so ties are spread.
+*/
+class ReplicaSet {
+public:
+    explicit ReplicaSet(const RedisInitParam& param) : policy_(param.read_policy) {
+        for (auto& address : param.replicas) {
+            size_t colon = address.rfind(':');
+            if (colon == std::string::npos) {
+                LOG_ERROR("%s: replica %s is not host:port", __FUNCTION__, address.c_str());
+                continue;
+            }
+            RedisInitParam replica = param;
+            replica.host = address.substr(0, colon);
+            replica.port = std::atoi(address.c_str() + colon + 1);
+            replica.near_cache_size = 0;
+            replica.replicas.clear();
+            auto& r = replicas_.emplace_back(std::make_unique<Replica>());
+            r->name = address;
+            // a replica down at startup is tried again on checkout after its pause
+            if (r->pool.Initialize(replica) != 0)
+                r->Fail();
+        }
+    }
+
+    bool Empty() const { return replicas_.empty(); }
+
+    Replica* Pick() {
+        thread_local size_t rotate = 0;
+        size_t n = replicas_.size();
+        size_t start = rotate++ % std::max<size_t>(n, 1);
+        Replica* best = nullptr;
+        double best_score = 0;
+        for (size_t i = 0; i < n; i++) {
+            Replica* r = replicas_[(start + i) % n].get();
+            if (r->Down())
+                continue;
+            double outstanding = r->outstanding.load(std::memory_order_relaxed);
+            double ewma = static_cast<double>(r->ewma_ns.load(std::memory_order_relaxed));
+            double score = policy_ == ReadPolicy::LeastOutstanding ? outstanding : ewma * (outstanding + 1);
+            if (!best || score < best_score) {
+                best = r;
+                best_score = score;
+            }
+        }
+        return best;
+    }
+
+private:
+    ReadPolicy policy_;
+    std::vector<std::unique_ptr<Replica>> replicas_;
+};
+}
+
+namespace detail {
+/*
+Group commit of the commands concurrent threads send through RedisMgr. The first
+caller of an empty batch leads it: while another batch is on the wire it waits up
+to the window for other threads to join, or until the batch is full, then sends
+every command of the batch in one write on one context. A caller alone does not
+wait. The leader decodes each reply into the slot of its caller while it still
+holds the context, so replies read into a ReplyArena are valid during decoding.
+Callers that joined sleep until their slot is filled.
+*/
+class Coalescer {
+public:
+    struct Waiter {
+        virtual ~Waiter() = default;
+        // run by the leader, reply is null when the batch could not be sent or read
+        virtual void Deliver(const RedisReply& reply) = 0;
+
+        bool caching = false;   // the request starts with CLIENT CACHING yes, whose reply is dropped
+        bool done = false;
+    };
+
+    template <typename T>
+    struct Result : Waiter {
+        tl::expected<T, int> value = tl::unexpected{ -1 };
+        size_t reply_bytes = 0;
+
+        void Deliver(const RedisReply& reply) override {
+            if (!reply)
+                return;
+            reply_bytes = ReplyBytes(reply);
+            value = GetFromReply<T>(reply);
+        }
+    };
+
+    Coalescer(RedisPool& pool, std::chrono::microseconds window, size_t max_batch)
+        : pool_(pool), window_(window), max_batch_(std::max<size_t>(max_batch, 1)) {}
+
+    // returns once waiter.Deliver has run, from this or from another thread
+    void Submit(Waiter& waiter, std::string_view request) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!open_)
+            open_ = std::make_shared<Batch>();
+        std::shared_ptr<Batch> batch = open_;
+        batch->buffer.append(request.data(), request.data() + request.size());
+        batch->waiters.push_back(&waiter);
+
+        if (batch->waiters.size() > 1) {
+            if (batch->waiters.size() >= max_batch_) {
+                open_ = nullptr;
+                batch->cv.notify_all();
+            }
+            batch->cv.wait(lock, [&] { return waiter.done; });
+            return;
+        }
+
+        if (in_flight_ > 0 && max_batch_ > 1)
+            batch->cv.wait_for(lock, window_, [&] { return batch->waiters.size() >= max_batch_; });
+        if (open_ == batch)
+            open_ = nullptr;
+        in_flight_++;
+        lock.unlock();
+
+        Flush(*batch);
+
+        lock.lock();
+        in_flight_--;
+        for (Waiter* w : batch->waiters)
+            w->done = true;
+        batch->cv.notify_all();
+    }
+
+private:
+    struct Batch {
+        fmt::memory_buffer buffer;
+        std::vector<Waiter*> waiters;
+        std::condition_variable cv;
+    };
+
+    // a closed batch is only touched by its leader, no lock needed
+    void Flush(Batch& batch) {
+        auto context = pool_.Get();
+        bool ok = true;
+        if (!context) {
+            LOG_ERROR("%s: no redis context available", __FUNCTION__);
+            ok = false;
+        }
+        else if (!context.Send(batch.buffer.data(), batch.buffer.size())) {
+            LOG_ERROR("%s: append failed, context error[%d:%s]", __FUNCTION__, context->err, context->errstr);
+            context.SetContextDisable();
+            ok = false;
+        }
+        for (Waiter* waiter : batch.waiters) {
+            RedisReply reply = ok ? context.Receive() : RedisReply(nullptr);
+            if (ok && reply && waiter->caching)
+                reply = context.Receive();
+            if (ok && !reply) {
+                LOG_ERROR("%s: reply is null, context error[%d:%s]", __FUNCTION__, context->err, context->errstr);
+                // the replies left on the connection can't be matched to commands anymore
+                context.SetContextDisable();
+                ok = false;
+            }
+            waiter->Deliver(reply);
+        }
+    }
+
+    RedisPool& pool_;
+    std::chrono::microseconds window_;
+    size_t max_batch_;
+    std::mutex mutex_;
+    std::shared_ptr<Batch> open_;
+    int in_flight_ = 0;
+};
+}
+
+class RedisMgr : public RedisCommands<RedisMgr> {
+public:
+    RedisMgr() {}
+    virtual ~RedisMgr() { 
+        UnInit();
+    }
+
+    int Initialize(const RedisInitParam& param) {
+        slow_threshold_ = std::chrono::milliseconds(std::max(param.slow_log_threshold, 0));
+        if (param.enable_metrics)
+            metrics_ = std::make_unique<RedisMetrics>();
+        if (param.near_cache_size > 0) {
+            near_cache_ = std::make_unique<detail::NearCache>(param.near_cache_size);
+            tracking_ = std::make_unique<detail::TrackingListener>();
+            redis_cxt_pool_.AddConnectHook([this](redisContext* context) { return tracking_->Track(context); });
+        }
+        redis_cxt_pool_.AddConnectHook([this](redisContext* context) { return LoadScripts(context); });
+        if (!param.replicas.empty())
+            replicas_ = std::make_unique<detail::ReplicaSet>(param);
+        if (param.coalesce_window > 0) {
+            coalescer_ = std::make_unique<detail::Coalescer>(redis_cxt_pool_,
+                std::chrono::microseconds(param.coalesce_window), param.coalesce_batch);
+        }
+        int ret = redis_cxt_pool_.Initialize(param);
+        if (ret == 0 && tracking_)
+            tracking_->Start(param, redis_cxt_pool_, *near_cache_);
+        return ret;
+    }
+
+    template<typename ...Args, std::enable_if_t<(std::is_convertible_v<Args, redisContext*> && ...), int> = 0>
+    int Initialize(Args&&... args) {
+        return redis_cxt_pool_.Initialize({ args... });
+    }
+    void UnInit() {
+        if (tracking_)
+            tracking_->Stop();
+        redis_cxt_pool_.UnInit();
+    }
+
+    /*
+    every key, page by page with the next page prefetched, see ScanRange. With
+    replicas the whole scan runs on the one picked for its first page, unless this
+    thread is in a ReadYourWrites() scope, and ends with Error() -1 if that replica
+    fails, a cursor can't go on elsewhere.
+    */
+    template <typename T = std::string>
+    ScanRange<T> ScanAll(std::string_view match = "", size_t count = 0, std::string_view type = "") {
+        return ScanRange<T>([this, replica = ScanReplica(), match = std::string(match), count, type = std::string(type)](uint64_t cursor) {
+            ReplicaPin pin(this, replica);
+            return SCAN<T>(cursor, match, count, type);
+        });
+    }
+
+    template <typename T = std::string>
+    ScanRange<T> SScanAll(std::string_view key, std::string_view match = "", size_t count = 0) {
+        return ScanRange<T>([this, replica = ScanReplica(), key = std::string(key), match = std::string(match), count](uint64_t cursor) {
+            ReplicaPin pin(this, replica);
+            return SSCAN<T>(key, cursor, match, count);
+        });
+    }
+
+    template <typename K = std::string, typename V = std::string>
+    ScanRange<std::pair<K, V>> HScanAll(std::string_view key, std::string_view match = "", size_t count = 0) {
+        return ScanRange<std::pair<K, V>>([this, replica = ScanReplica(), key = std::string(key), match = std::string(match), count](uint64_t cursor) {
+            ReplicaPin pin(this, replica);
+            return HSCAN<K, V>(key, cursor, match, count);
+        });
+    }
+
+    template <typename T = std::string, typename S = double>
+    ScanRange<std::pair<T, S>> ZScanAll(std::string_view key, std::string_view match = "", size_t count = 0) {
+        return ScanRange<std::pair<T, S>>([this, replica = ScanReplica(), key = std::string(key), match = std::string(match), count](uint64_t cursor) {
+            ReplicaPin pin(this, replica);
+            return ZSCAN<T, S>(key, cursor, match, count);
+        });
+    }
+
+    // latency histograms and counters per command, empty unless RedisInitParam::enable_metrics
+    MetricsSnapshot Metrics() {
+        return metrics_ ? metrics_->Snapshot() : MetricsSnapshot{};
+    }
+
+    // called instead of LOG_WARN for commands slower than threshold, set it before the first command
+    void SetSlowCommandHook(std::chrono::microseconds threshold, std::function<void(const SlowCommand&)> hook) {
+        slow_threshold_ = threshold;
+        slow_hook_ = std::move(hook);
+    }
+
+    const RedisInitParam& Param() const { return redis_cxt_pool_.Param(); }
+
+    // counters of the near cache, all zero when RedisInitParam::near_cache_size is 0
+    NearCacheStats CacheStats() {
+        return near_cache_ ? near_cache_->Stats() : NearCacheStats{};
+    }
+
+    // queue commands and send them in one write, see RedisPipeline
+    RedisPipeline Pipeline() {
+        return RedisPipeline(redis_cxt_pool_);
+    }
+
+    /*
+    Scripts registered before Initialize are loaded with SCRIPT LOAD on every
+    connection as it connects, and again on reconnect. One registered later is
+    loaded right away on one connection, the server cache is shared by all of them.
+    */
+    int RegisterScript(const RedisScript& script) {
+        {
+            std::lock_guard<std::mutex> lock(scripts_mutex_);
+            for (auto& body : scripts_) {
+                if (body == script.body)
+                    return 0;
+            }
+            scripts_.emplace_back(script.body);
+        }
+        if (redis_cxt_pool_.Size() == 0)
+            return 0;
+        auto sha = SCRIPT_LOAD(script.body);
+        if (!sha || *sha != script.Sha()) {
+            LOG_ERROR("%s: SCRIPT LOAD of %.*s failed", __FUNCTION__, 40, script.sha.data());
+            return -1;
+        }
+        return 0;
+    }
+
+    // EVALSHA, and EVAL with the body when the server answers NOSCRIPT, after a restart or SCRIPT FLUSH
+    template <typename T, typename... Args>
+    tl::expected<T, int> Eval(const RedisScript& script, std::initializer_list<std::string_view> keys, const Args&... args) {
+        auto _ = EVALSHA<detail::ScriptReply<T>>(script.Sha(), keys, args...);
+        if (!_)
+            return tl::unexpected{ _.error() };
+        if (!_->noscript)
+            return std::move(_->value);
+        LOG_INFO("%s: NOSCRIPT for %.*s, sending the body", __FUNCTION__, 40, script.sha.data());
+        return EVAL<T>(script.body, keys, args...);
+    }
+
+    /*
+    Read only commands of this thread go to the primary while the scope lives, so
+    they see the writes made before them in spite of the replication lag.
+
+        auto pinned = mgr.ReadYourWrites();
+        mgr.HSET("user:1", "name", name);
+        auto profile = mgr.HGETALL<Profile>("user:1");
+    */
+    class PrimaryScope {
+    public:
+        explicit PrimaryScope(const RedisMgr* mgr) : mgr_(mgr) { Pins().push_back(mgr_); }
+        PrimaryScope(const PrimaryScope&) = delete;
+        PrimaryScope& operator=(const PrimaryScope&) = delete;
+        ~PrimaryScope() {
+            auto& pins = Pins();
+            pins.erase(std::find(pins.rbegin(), pins.rend(), mgr_).base() - 1);
+        }
+
+        static std::vector<const RedisMgr*>& Pins() {
+            thread_local std::vector<const RedisMgr*> pins;
+            return pins;
+        }
+
+    private:
+        const RedisMgr* mgr_;
+    };
+
+    PrimaryScope ReadYourWrites() const { return PrimaryScope(this); }
+
+    // stream many commands on one connection with a bounded window of unanswered ones, see BulkLoader
+    BulkLoader BulkLoad(BulkOptions options = {}) {
+        return BulkLoader(redis_cxt_pool_, options);
+    }
+
+    /*
+    command is a detail::MakeRespCommand constant, or a runtime name like "GET" or
+    "SCRIPT LOAD". A runtime name is split on spaces, so without args it can be a
+    whole command line. args are sent binary safe, RedisOp options and containers
+    expand to several arguments.
+    */
+    template <typename T, typename Cmd, typename... Args>
+    tl::expected<T, int> ExcuteCommand(const Cmd& cmd, const Args&... args) {
+        if constexpr (detail::is_cacheable_result<T>::value && sizeof...(args) > 0) {
+            if (near_cache_ && (detail::CommandFlags(cmd) & detail::kCmdCacheable))
+                return CachedCommand<T>(cmd, args...);
+        }
+        return RunCommand<T>(cmd, false,
+            [&](fmt::memory_buffer& out) { detail::RespWriter(out).Command(cmd, args...); });
+    }
+
+    /*
+    A container of more than RedisInitParam::chunk_size elements goes out as a
+    command per chunk, so no single command keeps the server busy for long. The
+    chunks are pipelined, about kChunkPipelineBytes per write, on the node
+    RunCommand would pick: a replica for a read only command when there are
+    some, else the primary. Each write is timed and logged like one command, and
+    the replies merged. It stops after the first write with a failed chunk, the
+    chunks before it stay applied. An empty container sends nothing.
+    */
+    template <typename T, typename Cmd, typename R, typename... Args>
+    tl::expected<T, int> ExcuteChunked(const Cmd& cmd, const R& range, const Args&... args) {
+        if (range.size() == 0)
+            return detail::EmptyChunk<T>();
+        size_t chunk_size = Param().chunk_size;
+        if (chunk_size == 0 || range.size() <= chunk_size)
+            return ExcuteCommand<T>(cmd, args..., range);
+
+        using Chunk = detail::ArgChunk<decltype(std::begin(range))>;
+        detail::Replica* replica = ChunkReplica(cmd);
+        std::optional<RedisPipeline> pipe;
+        pipe.emplace(replica ? replica->pool : redis_cxt_pool_);
+        std::vector<Chunk> batch;
+        tl::expected<T, int> total = T{};
+        auto exec = [&]() {
+            detail::Replica* sent_to = replica;
+            detail::MergeChunk(total, RunChunks<T>(*pipe, replica, cmd, batch, args...));
+            batch.clear();
+            // the replica failed, the rest goes to the primary
+            if (sent_to && !replica)
+                pipe.emplace(redis_cxt_pool_);
+        };
+        detail::ForEachChunk(range, chunk_size, [&](const Chunk& chunk) {
+            if (!total)
+                return;
+            pipe->template ExcuteCommand<T>(cmd, args..., chunk);
+            batch.push_back(chunk);
+            if (pipe->Bytes() >= kChunkPipelineBytes)
+                exec();
+        });
+        if (total && !batch.empty())
+            exec();
+        return total;
+    }
+
+
+protected:
+    static constexpr size_t kChunkPipelineBytes = 1 << 20;
+
+    // the encoded command is the cache key within the entries of its redis key
+    template <typename T, typename Cmd, typename Key, typename... Args>
+    tl::expected<T, int> CachedCommand(const Cmd& cmd, const Key& key, const Args&... args) {
+        fmt::memory_buffer encoded;
+        detail::RespWriter(encoded).Command(cmd, key, args...);
+        std::string_view request(encoded.data(), encoded.size());
+        char buf[32];
+        std::string_view name = detail::ArgBytes(key, buf);
+        if (auto hit = near_cache_->Find<T>(name, request))
+            return std::move(*hit);
+
+        uint64_t version = near_cache_->Version();
+        bool tracked = tracking_->Ready();
+        auto _ = RunCommand<T>(cmd, tracked,
+            [&](fmt::memory_buffer& out) { out.append(request.data(), request.data() + request.size()); });
+        if (_ && tracked)
+            near_cache_->Insert(name, request, *_, version);
+        return _;
+    }
+
+    /*
+    caching sends CLIENT CACHING yes in the same write, so the read is tracked.
+    Read only typed commands go to a replica when there are some, unless the read
+    is tracked or the thread is in a ReadYourWrites() scope, and come back to the
+    primary when the replica fails. Typed commands other than connection state
+    ones (AUTH, SELECT) and blocking ones go through the coalescer when it is on,
+    runtime command names may block and never do.
+    */
+    template <typename T, typename Cmd, typename Encode>
+    tl::expected<T, int> RunCommand(const Cmd& cmd, bool caching, Encode&& encode) {
+        [[maybe_unused]] std::string_view command = detail::MetricName(cmd);
+        if (detail::Replica* replica = PinnedReplica())
+            return RunOn<T>(replica->pool, command, false, encode, replica);
+        if constexpr (detail::is_resp_command<Cmd>::value) {
+            if (replicas_ && !caching && (cmd.flags & detail::kCmdReadOnly) && !PrimaryPinned()) {
+                if (detail::Replica* replica = replicas_->Pick()) {
+                    auto _ = RunOn<T>(replica->pool, command, false, encode, replica);
+                    if (_ || _.error() != -1 || !replica->Down())
+                        return _;
+                }
+            }
+            if (coalescer_ && !(cmd.flags & (detail::kCmdNoKey | detail::kCmdBlocking)))
+                return CoalescedCommand<T>(command, caching, encode);
+        }
+        return RunOn<T>(redis_cxt_pool_, command, caching, encode, nullptr);
+    }
+
+    template <typename T, typename Encode>
+    tl::expected<T, int> RunOn(RedisPool& pool, [[maybe_unused]] std::string_view command, bool caching, Encode& encode,
+        detail::Replica* replica) {
+        auto context = pool.Get();
+        if (!context) {
+            LOG_ERROR("cmd[%.*s] no redis context available", static_cast<int>(command.size()), command.data());
+            if (replica)
+                replica->Fail();
+            return tl::unexpected{ -1 };
+        }
+        if (caching) {
+            constexpr std::string_view yes = "*3\r\n$6\r\nCLIENT\r\n$7\r\nCACHING\r\n$3\r\nyes\r\n";
+            context.Buffer().append(yes.data(), yes.data() + yes.size());
+        }
+        encode(context.Buffer());
+
+        if (replica)
+            replica->outstanding.fetch_add(1, std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        RedisReply reply = context.Execute();
+        if (caching && reply)
+            reply = context.Receive();
+        std::chrono::nanoseconds latency = std::chrono::steady_clock::now() - start;
+        if (replica) {
+            replica->outstanding.fetch_sub(1, std::memory_order_relaxed);
+            if (reply)
+                replica->Observe(latency);
+            else
+                replica->Fail();
+        }
+        if (!reply) {
+            LOG_ERROR("cmd[%.*s] reply is null, context error[%d:%s]", static_cast<int>(command.size()), command.data(),
+                context->err, context->errstr);
+            Observe(command, context.Buffer(), latency, 0, -1);
+            context.SetContextDisable();
+            return tl::unexpected{ -1 };
+        }
+
+        auto _ = GetFromReply<T>(reply);
+        if (!_ && _.error() == REDIS_REPLY_ERROR) {
+            LOG_ERROR("%s: command[%.*s]", __FUNCTION__, static_cast<int>(command.size()), command.data());
+        }
+        Observe(command, context.Buffer(), latency, metrics_ ? detail::ReplyBytes(reply) : 0, _ ? 0 : _.error());
+        return _;
+    }
+
+    // where the chunks of ExcuteChunked go, the replica RunCommand would pick or nullptr for the primary
+    template <typename Cmd>
+    detail::Replica* ChunkReplica(const Cmd& cmd) const {
+        if (detail::Replica* replica = PinnedReplica())
+            return replica;
+        if (replicas_ && (detail::CommandFlags(cmd) & detail::kCmdReadOnly) && !PrimaryPinned())
+            return replicas_->Pick();
+        return nullptr;
+    }
+
+    /*
+    One write of ExcuteChunked: the chunks queued in pipe, observed as one command.
+    When replica fails the chunks are sent again to the primary and replica is
+    set to nullptr, so the caller moves the rest there too.
+    */
+    template <typename T, typename Cmd, typename Chunk, typename... Args>
+    tl::expected<T, int> RunChunks(RedisPipeline& pipe, detail::Replica*& replica, const Cmd& cmd,
+        const std::vector<Chunk>& chunks, const Args&... args) {
+        std::string_view command = detail::MetricName(cmd);
+        PipelineResult<T> result{ 0, chunks.size() };
+        fmt::memory_buffer request;
+        if (replica)
+            replica->outstanding.fetch_add(1, std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        int ret = pipe.Exec(request);
+        std::chrono::nanoseconds latency = std::chrono::steady_clock::now() - start;
+        if (replica) {
+            replica->outstanding.fetch_sub(1, std::memory_order_relaxed);
+            if (ret != 0) {
+                replica->Fail();
+                replica = nullptr;
+                RedisPipeline primary(redis_cxt_pool_);
+                for (auto& chunk : chunks)
+                    primary.template ExcuteCommand<T>(cmd, args..., chunk);
+                return RunChunks<T>(primary, replica, cmd, chunks, args...);
+            }
+            replica->Observe(latency);
+        }
+
+        auto _ = pipe.Get(result);
+        if (!_ && _.error() == REDIS_REPLY_ERROR) {
+            LOG_ERROR("%s: command[%.*s]", __FUNCTION__, static_cast<int>(command.size()), command.data());
+        }
+        Observe(command, request, latency, metrics_ ? pipe.ReplyBytes() : 0, _ ? 0 : _.error());
+        return _;
+    }
+
+    // every command of a batch is observed with the latency of the whole batch
+    template <typename T, typename Encode>
+    tl::expected<T, int> CoalescedCommand(std::string_view command, bool caching, Encode& encode) {
+        thread_local fmt::memory_buffer request;
+        if (request.capacity() > 64 * 1024)
+            request = fmt::memory_buffer();
+        request.clear();
+        if (caching) {
+            constexpr std::string_view yes = "*3\r\n$6\r\nCLIENT\r\n$7\r\nCACHING\r\n$3\r\nyes\r\n";
+            request.append(yes.data(), yes.data() + yes.size());
+        }
+        encode(request);
+
+        detail::Coalescer::Result<T> result;
+        result.caching = caching;
+        auto start = std::chrono::steady_clock::now();
+        coalescer_->Submit(result, std::string_view(request.data(), request.size()));
+        std::chrono::nanoseconds latency = std::chrono::steady_clock::now() - start;
+
+        if (!result.value && result.value.error() == REDIS_REPLY_ERROR) {
+            LOG_ERROR("%s: command[%.*s]", __FUNCTION__, static_cast<int>(command.size()), command.data());
+        }
+        Observe(command, request, latency, result.reply_bytes, result.value ? 0 : result.value.error());
+        return std::move(result.value);
+    }
+
+    // the replica a whole ScanAll runs on, nullptr for the primary
+    detail::Replica* ScanReplica() const {
+        return replicas_ && !PrimaryPinned() ? replicas_->Pick() : nullptr;
+    }
+
+    // the commands of this thread go to replica while a ScanAll page is fetched, on whichever thread fetches it
+    class ReplicaPin {
+    public:
+        ReplicaPin(const RedisMgr* mgr, detail::Replica* replica) : active_(replica != nullptr) {
+            if (active_)
+                Pins().emplace_back(mgr, replica);
+        }
+        ReplicaPin(const ReplicaPin&) = delete;
+        ReplicaPin& operator=(const ReplicaPin&) = delete;
+        ~ReplicaPin() {
+            if (active_)
+                Pins().pop_back();
+        }
+
+        static std::vector<std::pair<const RedisMgr*, detail::Replica*>>& Pins() {
+            thread_local std::vector<std::pair<const RedisMgr*, detail::Replica*>> pins;
+            return pins;
+        }
+
+    private:
+        bool active_;
+    };
+
+    detail::Replica* PinnedReplica() const {
+        auto& pins = ReplicaPin::Pins();
+        for (auto it = pins.rbegin(); it != pins.rend(); ++it) {
+            if (it->first == this)
+                return it->second;
+        }
+        return nullptr;
+    }
+
+    bool PrimaryPinned() const {
+        auto& pins = PrimaryScope::Pins();
+        return !pins.empty() && std::find(pins.begin(), pins.end(), this) != pins.end();
+    }
+
+    bool LoadScripts(redisContext* context) {
+        std::lock_guard<std::mutex> lock(scripts_mutex_);
+        for (auto& body : scripts_) {
+            RedisReply reply = redisCommand(context, "SCRIPT LOAD %b", body.data(), body.size());
+            if (!reply)
+                return false;
+            // a script the server rejects fails its calls, not the connection
+            if (reply->type == REDIS_REPLY_ERROR) {
+                LOG_ERROR("%s: SCRIPT LOAD failed, %s", __FUNCTION__, reply->str);
+            }
+        }
+        return true;
+    }
+
+    void Observe(std::string_view command, const fmt::memory_buffer& request, std::chrono::nanoseconds latency,
+        size_t reply_bytes, int error) {
+        if (metrics_)
+            metrics_->Record(command, latency, request.size(), reply_bytes, error);
+        if (slow_threshold_.count() == 0 || latency < slow_threshold_)
+            return;
+        if (slow_hook_) {
+            slow_hook_(SlowCommand{ command, std::string_view(request.data(), request.size()), latency, error });
+        }
+        else {
+            LOG_WARN("slow redis: time[%lld]us command[%.*s]",
+                static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count()),
+                static_cast<int>(command.size()), command.data());
+        }
+    }
+
+protected:
     int GetResultFromReply(const redisReply* reply, std::string& res);
 
 protected:
 
-    std::vector<redisContext*> redis_cxt_pool_;
+    RedisPool redis_cxt_pool_;
+    std::unique_ptr<detail::NearCache> near_cache_;
+    std::unique_ptr<detail::TrackingListener> tracking_;
+    std::unique_ptr<RedisMetrics> metrics_;
+    std::unique_ptr<detail::Coalescer> coalescer_;
+    std::unique_ptr<detail::ReplicaSet> replicas_;
+    std::mutex scripts_mutex_;
+    std::vector<std::string> scripts_;
+    std::chrono::nanoseconds slow_threshold_{ std::chrono::milliseconds(100) };
+    std::function<void(const SlowCommand&)> slow_hook_;
 };
 
 } // namespace rdsfmt
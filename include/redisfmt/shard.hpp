@@ -0,0 +1,375 @@
+#ifndef __REDISFMT_SHARD_H__
+#define __REDISFMT_SHARD_H__
+
+#include <future>
+#include <set>
+#include <shared_mutex>
+
+#include "redisfmt/redisfmt.hpp"
+
+namespace rdsfmt {
+
+namespace detail {
+
+// FNV-1a with the murmur3 finalizer, the raw FNV bits cluster too much for a ring
+constexpr uint64_t RingHash(std::string_view data) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c : data) {
+        h ^= static_cast<uint8_t>(c);
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+struct Shard {
+    std::string name;
+    int weight = 1;
+    RedisPool pool;
+};
+
+// the arguments of a multi key command that go to one shard, positions are the indexes of its keys in the command
+struct ShardPart {
+    fmt::memory_buffer args;
+    size_t argc = 0;
+    std::vector<size_t> positions;
+};
+
+/*
+Consistent hash ring. Every shard owns kVirtualNodes points per unit of weight,
+placed by the hash of "name#i", so the points of a shard don't depend on the
+other shards: adding one to N shards moves about 1/(N+1) of the keys, all of them
+to the new shard. A ring is immutable, a change builds a new one.
+*/
+class HashRing {
+public:
+    static constexpr int kVirtualNodes = 160;
+
+    explicit HashRing(std::vector<std::shared_ptr<Shard>> shards) : shards_(std::move(shards)) {
+        for (size_t i = 0; i < shards_.size(); i++) {
+            int points = kVirtualNodes * std::max(shards_[i]->weight, 1);
+            for (int v = 0; v < points; v++)
+                points_.push_back({ RingHash(fmt::format("{}#{}", shards_[i]->name, v)), i });
+        }
+        std::sort(points_.begin(), points_.end());
+    }
+
+    bool Empty() const { return points_.empty(); }
+    const std::vector<std::shared_ptr<Shard>>& Shards() const { return shards_; }
+
+    // index in Shards() of the owner of key, hashtags are honoured
+    size_t Locate(std::string_view key) const {
+        uint64_t h = RingHash(HashTag(key));
+        auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(h, size_t(0)));
+        return it == points_.end() ? points_.front().second : it->second;
+    }
+
+private:
+    std::vector<std::shared_ptr<Shard>> shards_;
+    std::vector<std::pair<uint64_t, size_t>> points_;
+};
+}
+
+/*
+Client side sharding over independent redis instances, no cluster involved.
+Keys are placed by a consistent hash ring with virtual nodes and weights, and
+"{tag}" hashtags keep related keys on one shard. A single key command goes to
+the owner of its key. Multi key commands whose keys span shards are split per
+shard and run in parallel: DEL's counts are added up, MGET's values put back in
+the order of the keys, and the pairs of MSET, which is then atomic per shard
+only, go to the owners of their keys. Any other command whose keys span shards
+fails with REDIS_REPLY_ERROR. Commands without a key go to the first shard
+only, so SCAN walks the keys of that one instance and never sees those of the
+other shards.
+
+    RedisShardMgr shards;
+    shards.AddShard(param_a);
+    shards.AddShard(param_b, 2);    // twice the keys of a
+*/
+class RedisShardMgr : public RedisCommands<RedisShardMgr> {
+public:
+    RedisShardMgr() {}
+    virtual ~RedisShardMgr() {
+        UnInit();
+    }
+
+    int Initialize(const std::vector<RedisInitParam>& shards) {
+        for (auto& param : shards) {
+            if (AddShard(param) != 0)
+                return -1;
+        }
+        return shards.empty() ? -1 : 0;
+    }
+
+    void UnInit() {
+        std::unique_lock<std::shared_mutex> lock(ring_mutex_);
+        ring_.reset();
+    }
+
+    /*
+    name is what the ring hashes, host:port by default. Keep it when an instance
+    moves to another address, or its keys are placed elsewhere.
+    */
+    int AddShard(const RedisInitParam& param, int weight = 1, std::string name = "") {
+        auto shard = std::make_shared<detail::Shard>();
+        shard->name = name.empty() ? fmt::format("{}:{}", param.host, param.port) : std::move(name);
+        shard->weight = std::max(weight, 1);
+        if (shard->pool.Initialize(param) != 0) {
+            LOG_ERROR("%s: can not connect to shard %s", __FUNCTION__, shard->name.c_str());
+            return -1;
+        }
+        std::unique_lock<std::shared_mutex> lock(ring_mutex_);
+        auto shards = ring_ ? ring_->Shards() : std::vector<std::shared_ptr<detail::Shard>>{};
+        for (auto& other : shards) {
+            if (other->name == shard->name) {
+                LOG_ERROR("%s: shard %s is already there", __FUNCTION__, shard->name.c_str());
+                return -1;
+            }
+        }
+        shards.push_back(std::move(shard));
+        ring_ = std::make_shared<const detail::HashRing>(std::move(shards));
+        return 0;
+    }
+
+    // commands already running on the shard finish first, its pool goes with the last of them
+    int RemoveShard(std::string_view name) {
+        std::unique_lock<std::shared_mutex> lock(ring_mutex_);
+        if (!ring_)
+            return -1;
+        auto shards = ring_->Shards();
+        auto it = std::find_if(shards.begin(), shards.end(), [&](auto& shard) { return shard->name == name; });
+        if (it == shards.end())
+            return -1;
+        shards.erase(it);
+        ring_ = std::make_shared<const detail::HashRing>(std::move(shards));
+        return 0;
+    }
+
+    // name of the shard that owns key, empty without shards
+    std::string ShardOf(std::string_view key) {
+        auto ring = Ring();
+        if (!ring || ring->Empty())
+            return {};
+        return ring->Shards()[ring->Locate(key)]->name;
+    }
+
+    template <typename T, typename Cmd, typename... Args>
+    tl::expected<T, int> ExcuteCommand(const Cmd& cmd, const Args&... args) {
+        [[maybe_unused]] std::string_view command = detail::CommandName(cmd);
+        auto ring = Ring();
+        if (!ring || ring->Empty()) {
+            LOG_ERROR("cmd[%.*s] no shard", static_cast<int>(command.size()), command.data());
+            return tl::unexpected{ -1 };
+        }
+
+        size_t shard = 0;
+        if constexpr (sizeof...(args) > 0) {
+            uint32_t flags = detail::CommandFlags(cmd);
+            if constexpr (detail::is_resp_command<Cmd>::value) {
+                if (flags & (detail::kCmdMultiKey | detail::kCmdKeyValue)) {
+                    std::map<size_t, detail::ShardPart> parts;
+                    size_t units = 0;
+                    auto add = [&](std::string_view key, const auto&... unit) {
+                        auto& part = parts[ring->Locate(key)];
+                        detail::RespWriter writer(part.args);
+                        (writer.Add(unit), ...);
+                        part.argc += (detail::CountArg(unit) + ...);
+                        part.positions.push_back(units++);
+                    };
+                    if (flags & detail::kCmdKeyValue)
+                        KeyValuePairs(add, args...);
+                    else
+                        (ForEachKey(args, add), ...);
+                    if (!parts.empty())
+                        return SplitByShard<T>(*ring, cmd, parts, units);
+                }
+            }
+            if (flags & detail::kCmdScript) {
+                std::set<size_t> shards;
+                auto add = [&](std::string_view key, const auto&) { shards.insert(ring->Locate(key)); };
+                ScriptKeys(add, args...);
+                if (shards.size() > 1) {
+                    LOG_ERROR("cmd[%.*s] keys are on different shards", static_cast<int>(command.size()), command.data());
+                    return tl::unexpected{ REDIS_REPLY_ERROR };
+                }
+                if (!shards.empty())
+                    shard = *shards.begin();
+            }
+            else if (flags & detail::kCmdStreamKey) {
+                auto key = detail::StreamKey(args...);
+                shard = key ? ring->Locate(*key) : 0;
+            }
+            else if (!(flags & detail::kCmdNoKey)) {
+                shard = FirstKeyShard(*ring, args...);
+            }
+        }
+
+        return Run<T>(ring->Shards()[shard]->pool, command,
+            [&](fmt::memory_buffer& out) { detail::RespWriter(out).Command(cmd, args...); });
+    }
+
+protected:
+    std::shared_ptr<const detail::HashRing> Ring() {
+        std::shared_lock<std::shared_mutex> lock(ring_mutex_);
+        return ring_;
+    }
+
+    template <typename T, typename Encode>
+    tl::expected<T, int> Run(RedisPool& pool, [[maybe_unused]] std::string_view command, Encode&& encode) {
+        auto context = pool.Get();
+        if (!context) {
+            LOG_ERROR("cmd[%.*s] no redis context available", static_cast<int>(command.size()), command.data());
+            return tl::unexpected{ -1 };
+        }
+        encode(context.Buffer());
+        RedisReply reply = context.Execute();
+        if (!reply) {
+            LOG_ERROR("cmd[%.*s] reply is null, context error[%d:%s]", static_cast<int>(command.size()), command.data(),
+                context->err, context->errstr);
+            context.SetContextDisable();
+            return tl::unexpected{ -1 };
+        }
+        auto _ = GetFromReply<T>(reply);
+        if (!_ && _.error() == REDIS_REPLY_ERROR) {
+            LOG_ERROR("%s: command[%.*s]", __FUNCTION__, static_cast<int>(command.size()), command.data());
+        }
+        return _;
+    }
+
+    /*
+    The command once per shard with the keys, or pairs, that shard owns, one
+    thread per shard past the first. Counts are added up, the elements of array
+    replies go back to the places of their keys, a status reply is the first
+    error or the last status. Other replies can't be merged and fail.
+    */
+    template <typename T, typename Cmd>
+    tl::expected<T, int> SplitByShard(const detail::HashRing& ring, const Cmd& cmd,
+        const std::map<size_t, detail::ShardPart>& parts, size_t units) {
+        std::string_view command = cmd.Name();
+        auto run = [&](size_t shard, const detail::ShardPart& part) {
+            return Run<T>(ring.Shards()[shard]->pool, command, [&](fmt::memory_buffer& out) {
+                detail::RespWriter(out).Header(cmd.words + part.argc);
+                out.append(cmd.data + cmd.prefix, cmd.data + cmd.size);
+                out.append(part.args.data(), part.args.data() + part.args.size());
+            });
+        };
+        if (parts.size() == 1)
+            return run(parts.begin()->first, parts.begin()->second);
+
+        constexpr bool counts = std::is_integral_v<T> && !std::is_same_v<T, bool>;
+        constexpr bool values = [] {
+            if constexpr (detail::is_arg_range_v<T>)
+                return !detail::is_pair<typename T::value_type>::value;
+            else
+                return false;
+        }();
+        if constexpr (!counts && !values && !std::is_same_v<T, std::string>) {
+            LOG_ERROR("cmd[%.*s] keys are on different shards", static_cast<int>(command.size()), command.data());
+            return tl::unexpected{ REDIS_REPLY_ERROR };
+        }
+        else {
+            std::vector<std::future<tl::expected<T, int>>> futures;
+            for (auto it = std::next(parts.begin()); it != parts.end(); ++it)
+                futures.push_back(std::async(std::launch::async, run, it->first, std::cref(it->second)));
+            std::vector<tl::expected<T, int>> replies;
+            replies.push_back(run(parts.begin()->first, parts.begin()->second));
+            for (auto& future : futures)
+                replies.push_back(future.get());
+
+            tl::expected<T, int> total = T{};
+            if constexpr (values)
+                total->resize(units);
+            size_t i = 0;
+            for (auto& [shard, part] : parts) {
+                auto& reply = replies[i++];
+                if (!reply || !total) {
+                    if (total)
+                        total = std::move(reply);
+                    continue;
+                }
+                if constexpr (counts) {
+                    *total += *reply;
+                }
+                else if constexpr (values) {
+                    if (reply->size() != part.positions.size()) {
+                        LOG_ERROR("cmd[%.*s] %zu values for %zu keys", static_cast<int>(command.size()), command.data(),
+                            reply->size(), part.positions.size());
+                        total = tl::unexpected{ -1 };
+                        continue;
+                    }
+                    for (size_t k = 0; k < part.positions.size(); k++)
+                        (*total)[part.positions[k]] = std::move((*reply)[k]);
+                }
+                else {
+                    total = std::move(reply);
+                }
+            }
+            return total;
+        }
+    }
+
+    template <typename First, typename... Rest>
+    static size_t FirstKeyShard(const detail::HashRing& ring, const First& first, const Rest&...) {
+        char buf[32];
+        if constexpr (detail::is_container<First>::value && !std::is_convertible_v<const First&, std::string_view>)
+            return first.empty() ? 0 : ring.Locate(detail::ArgBytes(*std::begin(first), buf));
+        else
+            return ring.Locate(detail::ArgBytes(first, buf));
+    }
+
+    // f(bytes of the key, key) per key
+    template <typename T, typename F>
+    static void ForEachKey(const T& arg, F& f) {
+        char buf[32];
+        if constexpr (detail::is_arg_range_v<T>) {
+            for (auto& key : arg)
+                f(detail::ArgBytes(key, buf), key);
+        }
+        else {
+            f(detail::ArgBytes(arg, buf), arg);
+        }
+    }
+
+    // f(bytes of the key, key, value) per pair of key1 value1 key2 value2 ..., or of a container of pairs
+    template <typename F, typename First, typename... Rest>
+    static void KeyValuePairs(F& f, const First& first, const Rest&... rest) {
+        char buf[32];
+        if constexpr (sizeof...(rest) == 0) {
+            if constexpr (detail::is_arg_range_v<First>) {
+                if constexpr (detail::is_pair<typename First::value_type>::value) {
+                    for (auto& pair : first)
+                        f(detail::ArgBytes(pair.first, buf), pair.first, pair.second);
+                }
+            }
+        }
+        else {
+            auto pairs = std::forward_as_tuple(first, rest...);
+            PairsAt(f, pairs, std::make_index_sequence<(sizeof...(rest) + 1) / 2>());
+        }
+    }
+
+    template <typename F, typename Tuple, size_t... I>
+    static void PairsAt(F& f, const Tuple& pairs, std::index_sequence<I...>) {
+        char buf[32];
+        (f(detail::ArgBytes(std::get<2 * I>(pairs), buf), std::get<2 * I>(pairs), std::get<2 * I + 1>(pairs)), ...);
+    }
+
+    // script, numkeys, keys, args
+    template <typename F, typename... Args>
+    static void ScriptKeys(F& f, const Args&... args) {
+        if constexpr (sizeof...(args) >= 3)
+            ForEachKey(std::get<2>(std::forward_as_tuple(args...)), f);
+    }
+
+protected:
+    std::shared_ptr<const detail::HashRing> ring_;
+    std::shared_mutex ring_mutex_;
+};
+
+} // namespace rdsfmt
+
+#endif // !__REDISFMT_SHARD_H__
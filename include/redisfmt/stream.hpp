@@ -0,0 +1,214 @@
+#ifndef __REDISFMT_STREAM_H__
+#define __REDISFMT_STREAM_H__
+
+#include "redisfmt/redisfmt.hpp"
+
+namespace rdsfmt {
+
+struct StreamConsumerOptions {
+    int64_t count = 100;        // entries per XREADGROUP at most
+    int block = 1000;           // milliseconds XREADGROUP waits for new entries, 0 returns at once
+    size_t ack_batch = 500;     // ids per XACK command
+    int claim_idle = 60000;     // milliseconds an entry stays pending before another consumer takes it over, 0 disables
+    int claim_interval = 5000;  // milliseconds between two XAUTOCLAIM passes
+    bool create_group = true;   // XGROUP CREATE stream group $ MKSTREAM before the first read
+};
+
+/*
+A consumer of a consumer group, entries decoded into T, a REDIS_STRUCT or a map.
+Read() returns the next batch, Ack() queues the id of a finished entry, and the
+queued acks go out in the pipeline of the next Read(), in front of its
+XREADGROUP, so a read, process, ack loop costs one round trip per batch:
+
+    RedisStreamConsumer<Job> consumer(mgr, "jobs", "workers", "worker-1");
+    while (running) {
+        auto batch = consumer.Read();
+        for (auto& entry : batch.value_or(std::vector<StreamEntry<Job>>{})) {
+            Handle(entry.fields);
+            consumer.Ack(entry.id);
+        }
+    }
+    consumer.Flush();
+
+Entries left pending by a consumer that died are taken over with XAUTOCLAIM
+once they have been idle for claim_idle, and returned by Read() before new
+ones. An entry whose fields did not convert comes with its error set, ack it
+or it is claimed again and again. A blocking read holds a context of the pool
+for up to block milliseconds, give the pool one per consumer thread on top of
+what the other commands need, and a read timeout above block if there is one.
+A consumer is used by one thread.
+*/
+template <typename T>
+class RedisStreamConsumer {
+public:
+    RedisStreamConsumer(RedisMgr& mgr, std::string stream, std::string group, std::string consumer,
+        StreamConsumerOptions options = {})
+        : mgr_(mgr), stream_(std::move(stream)), group_(std::move(group)), consumer_(std::move(consumer)),
+        options_(options) {
+        options_.ack_batch = std::max<size_t>(options_.ack_batch, 1);
+    }
+
+    RedisStreamConsumer(const RedisStreamConsumer&) = delete;
+    RedisStreamConsumer& operator=(const RedisStreamConsumer&) = delete;
+
+    /*
+    The next entries, empty when none came within block milliseconds. -1 when
+    the connection failed, the acks that were not sent are kept for the next try.
+    When an XAUTOCLAIM pass is due it goes into the same pipeline, and the read
+    after it does not block, the entries taken over come first.
+    */
+    tl::expected<std::vector<StreamEntry<T>>, int> Read() {
+        if (options_.create_group && !group_ready_ && CreateGroup() != 0)
+            return tl::unexpected{ -1 };
+
+        auto pipe = mgr_.Pipeline();
+        auto acks = QueueAcks(pipe);
+        bool claim = ClaimDue();
+        PipelineResult<StreamClaim<T>> claimed;
+        if (claim)
+            claimed = pipe.XAUTOCLAIM<T>(stream_, group_, consumer_, options_.claim_idle, claim_cursor_, options_.count);
+        std::optional<int64_t> block;
+        if (!claim && options_.block > 0)
+            block = options_.block;
+        auto read = pipe.XREADGROUP<T>(group_, consumer_, options_.count, block, stream_);
+        pipe.Exec();
+        CheckAcks(pipe, acks);
+
+        // the entries XREADGROUP delivered are pending on this consumer whatever XAUTOCLAIM did, never drop them
+        std::vector<StreamEntry<T>> entries;
+        if (claim) {
+            auto result = pipe.Get(claimed);
+            if (result) {
+                claim_cursor_ = std::move(result->next);
+                // a pass over the whole pending list ends at "0-0", until then every Read goes on with it
+                if (claim_cursor_ == "0-0")
+                    last_claim_ = std::chrono::steady_clock::now();
+                entries = std::move(result->entries);
+            }
+            else {
+                ClaimFailed(pipe.ErrorReply(claimed));
+            }
+        }
+        auto result = pipe.Get(read);
+        if (!result) {
+            if (result.error() == REDIS_REPLY_NIL || !entries.empty())
+                return entries;
+            return tl::unexpected{ result.error() };
+        }
+        for (auto& [stream, fresh] : *result) {
+            if (stream != stream_)
+                continue;
+            if (entries.empty())
+                return std::move(fresh);
+            entries.insert(entries.end(), std::make_move_iterator(fresh.begin()), std::make_move_iterator(fresh.end()));
+        }
+        return entries;
+    }
+
+    // sent with the next Read() or Flush()
+    void Ack(std::string id) {
+        acks_.push_back(std::move(id));
+    }
+
+    // sends the queued acks now, returns how many of them were pending or -1
+    int64_t Flush() {
+        if (acks_.empty())
+            return 0;
+        auto pipe = mgr_.Pipeline();
+        auto acks = QueueAcks(pipe);
+        pipe.Exec();
+        return CheckAcks(pipe, acks);
+    }
+
+    size_t PendingAcks() const { return acks_.size() + sent_.size(); }
+
+private:
+    // BUSYGROUP, the group is there already, is fine. Any other error, WRONGTYPE or NOPERM, fails and is tried again next Read
+    int CreateGroup() {
+        auto pipe = mgr_.Pipeline();
+        auto created = pipe.XGROUP_CREATE(stream_, group_);
+        pipe.Exec();
+        auto _ = pipe.Get(created);
+        if (!_) {
+            std::string_view error = pipe.ErrorReply(created);
+            if (error.substr(0, 9) != "BUSYGROUP") {
+                LOG_ERROR("%s: XGROUP CREATE %s %s failed, %.*s", __FUNCTION__, stream_.c_str(), group_.c_str(),
+                    static_cast<int>(error.size()), error.data());
+                return -1;
+            }
+        }
+        group_ready_ = true;
+        return 0;
+    }
+
+    // a server before 6.2 has no XAUTOCLAIM, claiming stops for good. After other errors the pass starts over next interval
+    void ClaimFailed(std::string_view error) {
+        claim_cursor_ = "0-0";
+        last_claim_ = std::chrono::steady_clock::now();
+        if (error.find("unknown command") != std::string_view::npos) {
+            LOG_WARN("%s: no XAUTOCLAIM on the server, pending entries of dead consumers of %s are not claimed",
+                __FUNCTION__, stream_.c_str());
+            claim_disabled_ = true;
+        }
+    }
+
+    bool ClaimDue() {
+        if (options_.claim_idle <= 0 || claim_disabled_)
+            return false;
+        if (claim_cursor_ != "0-0")
+            return true;
+        return std::chrono::steady_clock::now() - last_claim_ >= std::chrono::milliseconds(options_.claim_interval);
+    }
+
+    // an XACK per ack_batch ids, the ids stay in sent_ until the reply is in
+    std::vector<PipelineResult<int64_t>> QueueAcks(RedisPipeline& pipe) {
+        std::vector<PipelineResult<int64_t>> results;
+        sent_.insert(sent_.end(), std::make_move_iterator(acks_.begin()), std::make_move_iterator(acks_.end()));
+        acks_.clear();
+        for (size_t start = 0; start < sent_.size(); start += options_.ack_batch) {
+            size_t end = std::min(sent_.size(), start + options_.ack_batch);
+            std::vector<std::string_view> ids(sent_.begin() + start, sent_.begin() + end);
+            results.push_back(pipe.XACK(stream_, group_, ids));
+        }
+        return results;
+    }
+
+    // XACK is idempotent, the ids of a batch lost with the connection are queued again
+    int64_t CheckAcks(RedisPipeline& pipe, const std::vector<PipelineResult<int64_t>>& results) {
+        int64_t acked = 0;
+        bool failed = false;
+        std::vector<std::string> retry;
+        for (size_t i = 0; i < results.size(); i++) {
+            auto result = pipe.Get(results[i]);
+            if (result) {
+                acked += *result;
+                continue;
+            }
+            failed = true;
+            if (result.error() != -1)
+                continue;
+            size_t start = i * options_.ack_batch;
+            size_t end = std::min(sent_.size(), start + options_.ack_batch);
+            retry.insert(retry.end(), std::make_move_iterator(sent_.begin() + start), std::make_move_iterator(sent_.begin() + end));
+        }
+        sent_.clear();
+        acks_.insert(acks_.begin(), std::make_move_iterator(retry.begin()), std::make_move_iterator(retry.end()));
+        return failed ? -1 : acked;
+    }
+
+    RedisMgr& mgr_;
+    std::string stream_;
+    std::string group_;
+    std::string consumer_;
+    StreamConsumerOptions options_;
+    bool group_ready_ = false;
+    bool claim_disabled_ = false;
+    std::vector<std::string> acks_;
+    std::vector<std::string> sent_;
+    std::string claim_cursor_ = "0-0";
+    std::chrono::steady_clock::time_point last_claim_{};
+};
+
+} // namespace rdsfmt
+
+#endif // !__REDISFMT_STREAM_H__
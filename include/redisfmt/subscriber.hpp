@@ -0,0 +1,483 @@
+#ifndef __REDISFMT_SUBSCRIBER_H__
+#define __REDISFMT_SUBSCRIBER_H__
+
+#include <sys/socket.h>
+
+#include "redisfmt/redisfmt.hpp"
+
+namespace rdsfmt {
+
+struct SubscriberOptions {
+    int workers = 1;            // threads running the handlers, the messages of a channel always go to the same one
+    size_t queue_size = 65536;  // messages waiting per worker, the reader stops reading while a queue is full
+    size_t batch = 256;         // messages a worker takes off its queue at once
+};
+
+struct SubscriberStats {
+    uint64_t received = 0;      // messages read from the connection
+    uint64_t delivered = 0;     // messages run through their handlers
+    uint64_t undecodable = 0;   // handler calls skipped because the payload did not convert
+    uint64_t stalls = 0;        // times the reader found a worker queue full
+    uint64_t connects = 0;      // subscriptions set up, the first one included
+};
+
+namespace detail {
+
+/*
+Ring of one producer and one consumer, without locks. head_ and tail_ only
+grow, the slot is the index modulo the power of two capacity. Each side keeps
+its own cache line.
+*/
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    // producer side, item is left alone when the ring is full
+    bool TryPush(T& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_cache_ == slots_.size()) {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if (tail - head_cache_ == slots_.size())
+                return false;
+        }
+        slots_[tail & mask_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side, moves up to max items to the end of out
+    size_t PopBatch(std::vector<T>& out, size_t max) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t count = std::min(tail_.load(std::memory_order_acquire) - head, max);
+        for (size_t i = 0; i < count; i++)
+            out.push_back(std::move(slots_[(head + i) & mask_]));
+        head_.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    bool Empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> slots_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> head_{ 0 };
+    alignas(64) std::atomic<size_t> tail_{ 0 };
+    alignas(64) size_t head_cache_ = 0;     // what the producer last saw of head_
+};
+
+// a message with the reply it points into
+struct Delivery {
+    RedisReply reply = nullptr;
+    std::string_view pattern;   // empty for a channel subscription
+    std::string_view channel;
+    redisReply* payload = nullptr;
+};
+
+struct MessageHandler {
+    virtual ~MessageHandler() = default;
+    // false when the payload did not convert
+    virtual bool Deliver(std::string_view channel, redisReply* payload) = 0;
+
+    uint64_t id = 0;
+};
+
+template <typename T, typename F>
+struct TypedHandler : MessageHandler {
+    explicit TypedHandler(F f) : handler(std::move(f)) {}
+
+    bool Deliver(std::string_view channel, redisReply* payload) override {
+        auto value = GetFromReply<T>(payload);
+        if (!value)
+            return false;
+        handler(channel, std::move(*value));
+        return true;
+    }
+
+    F handler;
+};
+
+// immutable, a subscription change builds a new one
+struct HandlerTable {
+    using Handlers = std::vector<std::shared_ptr<MessageHandler>>;
+    std::map<std::string, Handlers, std::less<>> channels;
+    std::map<std::string, Handlers, std::less<>> patterns;
+};
+
+/*
+A worker sleeps only after it has announced it in sleeping and found its queue
+still empty. The reader pushes a batch first and looks at sleeping after that,
+and both sides put a full fence in between, so one of them sees the other and
+no wakeup is lost.
+*/
+struct SubscriberWorker {
+    explicit SubscriberWorker(size_t capacity) : queue(capacity) {}
+
+    void Wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cv.notify_one();
+        }
+    }
+
+    void Idle(const std::atomic<bool>& stopping) {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv.wait(lock, [&] { return !queue.Empty() || stopping.load(); });
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    SpscQueue<Delivery> queue;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::atomic<bool> sleeping{ false };
+};
+}
+
+/*
+Pub/sub on a connection of its own. One reader thread reads the messages and
+hands them to the workers through lock free single producer queues, a worker
+takes them off in batches and runs the handlers, so a slow handler holds up
+only the channels of its worker. The payload is converted with GetFromReply<T>
+for every handler, a std::string_view points into the message and is valid
+during the call only. A pattern handler gets the channel the message was sent to.
+
+    RedisSubscriber subscriber;
+    subscriber.Subscribe<std::string_view>("invalidate", [](std::string_view channel, std::string_view key) {...});
+    subscriber.PSubscribe<int64_t>("score:*", [](std::string_view channel, int64_t score) {...});
+    subscriber.Start(param, { 4 });
+
+Subscriptions may change at any time. When the connection drops it reconnects
+after a second and subscribes everything again, messages published meanwhile
+are lost, pub/sub does not keep them. With protocol 3 the messages arrive as
+RESP3 pushes and are handled the same.
+*/
+class RedisSubscriber {
+public:
+    RedisSubscriber() : table_(std::make_shared<const detail::HandlerTable>()) {}
+    ~RedisSubscriber() { Stop(); }
+
+    int Start(const RedisInitParam& param, SubscriberOptions options = {}) {
+        RedisInitParam listen = param;
+        listen.context_count = 1;
+        listen.use_reply_arena = false;     // the replies outlive the next read on the worker threads
+        listen.heart_invervals = 0;
+        listen.near_cache_size = 0;
+        if (pool_.Initialize(listen) != 0) {
+            LOG_ERROR("%s: can not connect to %s:%d", __FUNCTION__, param.host.c_str(), param.port);
+            return -1;
+        }
+        options_ = options;
+        options_.workers = std::max(options_.workers, 1);
+        options_.batch = std::max<size_t>(options_.batch, 1);
+        stopping_ = false;
+        for (int i = 0; i < options_.workers; i++)
+            workers_.push_back(std::make_unique<detail::SubscriberWorker>(options_.queue_size));
+        for (auto& worker : workers_)
+            worker->thread = std::thread([this, w = worker.get()] { Work(*w); });
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_ = true;
+        }
+        reader_ = std::thread([this] { Run(); });
+        return 0;
+    }
+
+    // messages still queued are dropped
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_)
+                return;
+            running_ = false;
+            if (fd_ >= 0)
+                shutdown(fd_, SHUT_RDWR);
+        }
+        cv_.notify_all();
+        if (reader_.joinable())
+            reader_.join();
+        stopping_ = true;
+        for (auto& worker : workers_) {
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+            }
+            worker->cv.notify_one();
+            worker->thread.join();
+        }
+        workers_.clear();
+        pool_.UnInit();
+    }
+
+    // true while subscribed
+    bool Ready() const { return ready_.load(); }
+
+    // handler(std::string_view channel, T message), the id is for Unsubscribe
+    template <typename T, typename F>
+    uint64_t Subscribe(std::string_view channel, F&& handler) {
+        return Add(false, channel, std::make_shared<detail::TypedHandler<T, std::decay_t<F>>>(std::forward<F>(handler)));
+    }
+
+    template <typename T, typename F>
+    uint64_t PSubscribe(std::string_view pattern, F&& handler) {
+        return Add(true, pattern, std::make_shared<detail::TypedHandler<T, std::decay_t<F>>>(std::forward<F>(handler)));
+    }
+
+    // the channel is left once its last handler is gone, false for an unknown id
+    bool Unsubscribe(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto table = std::make_shared<detail::HandlerTable>(*table_);
+        for (bool pattern : { false, true }) {
+            auto& names = pattern ? table->patterns : table->channels;
+            for (auto it = names.begin(); it != names.end(); ++it) {
+                auto& handlers = it->second;
+                auto found = std::find_if(handlers.begin(), handlers.end(), [&](auto& h) { return h->id == id; });
+                if (found == handlers.end())
+                    continue;
+                handlers.erase(found);
+                if (handlers.empty()) {
+                    std::string name = it->first;
+                    names.erase(it);
+                    table_ = std::move(table);
+                    SendLocked(pattern ? "PUNSUBSCRIBE" : "UNSUBSCRIBE", name);
+                }
+                else {
+                    table_ = std::move(table);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    SubscriberStats Stats() const {
+        SubscriberStats stats;
+        stats.received = received_.load(std::memory_order_relaxed);
+        stats.delivered = delivered_.load(std::memory_order_relaxed);
+        stats.undecodable = undecodable_.load(std::memory_order_relaxed);
+        stats.stalls = stalls_.load(std::memory_order_relaxed);
+        stats.connects = connects_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    uint64_t Add(bool pattern, std::string_view name, std::shared_ptr<detail::MessageHandler> handler) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        handler->id = ++next_id_;
+        auto table = std::make_shared<detail::HandlerTable>(*table_);
+        auto& names = pattern ? table->patterns : table->channels;
+        auto it = names.find(name);
+        bool first = it == names.end();
+        if (first)
+            it = names.emplace(std::string(name), detail::HandlerTable::Handlers{}).first;
+        it->second.push_back(handler);
+        table_ = std::move(table);
+        if (first)
+            SendLocked(pattern ? "PSUBSCRIBE" : "SUBSCRIBE", name);
+        return handler->id;
+    }
+
+    std::shared_ptr<const detail::HandlerTable> Table() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return table_;
+    }
+
+    /*
+    The reader thread is blocked in a read on the context, so a subscription
+    change goes straight to the socket and the context is never touched by two
+    threads. When that fails the connection is dropped, the reconnect subscribes
+    what the table holds then.
+    */
+    void SendLocked(std::string_view command, std::string_view name) {
+        if (fd_ < 0)
+            return;
+        fmt::memory_buffer out;
+        detail::RespWriter(out).Command(command, name);
+        size_t sent = 0;
+        while (sent < out.size()) {
+            ssize_t n = send(fd_, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                LOG_WARN("%s: %.*s failed, resubscribing", __FUNCTION__, static_cast<int>(command.size()), command.data());
+                shutdown(fd_, SHUT_RDWR);
+                return;
+            }
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    void Run() {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!running_)
+                    break;
+            }
+            auto context = pool_.Get();
+            if (context && Subscribe(context)) {
+                ready_ = true;
+                Listen(context);
+            }
+            ready_ = false;
+            if (context)
+                context.SetContextDisable();
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            fd_ = -1;
+            cv_.wait_for(lock, std::chrono::seconds(1), [this] { return !running_; });
+        }
+    }
+
+    bool Subscribe(RedisPool::AutoContext& context) {
+        redisEnableKeepAlive(context);
+        struct timeval tv = { 0, 0 };
+        redisSetTimeout(context, tv);
+        // RESP3 pushes are read like any reply instead of going to a callback
+        redisSetPushCallback(context, nullptr);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_)
+            return false;
+        fmt::memory_buffer& out = context.Buffer();
+        out.clear();
+        std::vector<std::string_view> names;
+        for (bool pattern : { false, true }) {
+            names.clear();
+            for (auto& [name, handlers] : pattern ? table_->patterns : table_->channels)
+                names.push_back(name);
+            if (!names.empty())
+                detail::RespWriter(out).Command(pattern ? "PSUBSCRIBE" : "SUBSCRIBE", names);
+        }
+        if (out.size() > 0 && !(context.Send(out.data(), out.size()) && context.Flush())) {
+            LOG_ERROR("%s: subscribing failed, %s", __FUNCTION__, context->errstr);
+            return false;
+        }
+        fd_ = context->fd;
+        connects_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /*
+    Blocks for a message, then takes every message hiredis has already read
+    without another read on the socket. The workers are woken once per batch.
+    */
+    void Listen(RedisPool::AutoContext& context) {
+        std::vector<bool> pushed(workers_.size());
+        for (;;) {
+            RedisReply reply = context.Receive();
+            if (!reply)
+                return;
+            std::fill(pushed.begin(), pushed.end(), false);
+            while (reply) {
+                if (!Dispatch(std::move(reply), pushed))
+                    return;
+                void* next = nullptr;
+                if (redisGetReplyFromReader(context, &next) != REDIS_OK)
+                    return;
+                reply = next;
+            }
+            for (size_t i = 0; i < workers_.size(); i++) {
+                if (pushed[i])
+                    workers_[i]->Wake();
+            }
+        }
+    }
+
+    // ["message", channel, payload] or ["pmessage", pattern, channel, payload], false once stopped
+    bool Dispatch(RedisReply reply, std::vector<bool>& pushed) {
+        if ((reply->type != REDIS_REPLY_ARRAY && reply->type != REDIS_REPLY_PUSH) || reply->elements < 3)
+            return true;
+        for (size_t i = 0; i < reply->elements; i++) {
+            if (i + 1 < reply->elements && reply->element[i]->type != REDIS_REPLY_STRING)
+                return true;
+        }
+        std::string_view kind(reply->element[0]->str, reply->element[0]->len);
+        detail::Delivery delivery;
+        if (kind == "message" && reply->elements == 3) {
+            delivery.channel = std::string_view(reply->element[1]->str, reply->element[1]->len);
+            delivery.payload = reply->element[2];
+        }
+        else if (kind == "pmessage" && reply->elements == 4) {
+            delivery.pattern = std::string_view(reply->element[1]->str, reply->element[1]->len);
+            delivery.channel = std::string_view(reply->element[2]->str, reply->element[2]->len);
+            delivery.payload = reply->element[3];
+        }
+        else {
+            // subscribe and unsubscribe confirmations
+            return true;
+        }
+        received_.fetch_add(1, std::memory_order_relaxed);
+        size_t index = std::hash<std::string_view>{}(delivery.channel) % workers_.size();
+        delivery.reply = std::move(reply);
+        auto& worker = *workers_[index];
+        while (!worker.queue.TryPush(delivery)) {
+            // the worker is behind, reading on would only queue more
+            stalls_.fetch_add(1, std::memory_order_relaxed);
+            worker.Wake();
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_)
+                return false;
+        }
+        pushed[index] = true;
+        return true;
+    }
+
+    void Work(detail::SubscriberWorker& worker) {
+        std::vector<detail::Delivery> batch;
+        batch.reserve(options_.batch);
+        while (!stopping_.load()) {
+            batch.clear();
+            if (worker.queue.PopBatch(batch, options_.batch) == 0) {
+                worker.Idle(stopping_);
+                continue;
+            }
+            auto table = Table();
+            uint64_t undecodable = 0;
+            for (auto& delivery : batch) {
+                auto& names = delivery.pattern.empty() ? table->channels : table->patterns;
+                auto it = names.find(delivery.pattern.empty() ? delivery.channel : delivery.pattern);
+                if (it == names.end())
+                    continue;
+                for (auto& handler : it->second) {
+                    if (!handler->Deliver(delivery.channel, delivery.payload))
+                        undecodable++;
+                }
+            }
+            delivered_.fetch_add(batch.size(), std::memory_order_relaxed);
+            if (undecodable)
+                undecodable_.fetch_add(undecodable, std::memory_order_relaxed);
+        }
+    }
+
+    RedisPool pool_;
+    SubscriberOptions options_;
+    std::thread reader_;
+    std::vector<std::unique_ptr<detail::SubscriberWorker>> workers_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool running_ = false;
+    int fd_ = -1;
+    uint64_t next_id_ = 0;
+    std::shared_ptr<const detail::HandlerTable> table_;
+    std::atomic<bool> ready_{ false };
+    std::atomic<bool> stopping_{ false };
+    std::atomic<uint64_t> received_{ 0 };
+    std::atomic<uint64_t> delivered_{ 0 };
+    std::atomic<uint64_t> undecodable_{ 0 };
+    std::atomic<uint64_t> stalls_{ 0 };
+    std::atomic<uint64_t> connects_{ 0 };
+};
+
+} // namespace rdsfmt
+
+#endif // !__REDISFMT_SUBSCRIBER_H__
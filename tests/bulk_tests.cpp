@@ -0,0 +1,50 @@
+/*
+The parsers of the bulk loader: JSON argv lines and the length of a RESP
+command, including cut and malformed input.
+*/
+#include <deque>
+
+#include "redisfmt/bulk.hpp"
+#include "unit_test.hpp"
+
+using namespace rdsfmt;
+
+UNIT_TEST(json_argv) {
+    std::vector<std::string_view> argv;
+    std::deque<std::string> scratch;
+    auto args = [&] { return std::vector<std::string>(argv.begin(), argv.end()); };
+
+    CHECK(detail::ParseJsonArgv(R"(["SET", "k", "v"])", argv, scratch));
+    CHECK(args() == std::vector<std::string>({ "SET", "k", "v" }));
+    CHECK(detail::ParseJsonArgv(R"( ["INCRBY","n",-10, 2.5e3, true] )", argv, scratch));
+    CHECK(args() == std::vector<std::string>({ "INCRBY", "n", "-10", "2.5e3", "true" }));
+
+    // escapes are decoded, unicode into UTF-8, surrogate pairs included
+    CHECK(detail::ParseJsonArgv(R"(["SET","a\"b\\c\n","\u00e9\ud83d\ude00"])", argv, scratch));
+    CHECK(args() == std::vector<std::string>({ "SET", "a\"b\\c\n", "\xc3\xa9\xf0\x9f\x98\x80" }));
+    CHECK(detail::ParseJsonArgv(R"(["x\u0041","y\u0042"])", argv, scratch));
+    CHECK(args() == std::vector<std::string>({ "xA", "yB" }));
+
+    for (const char* bad : { "", "[]", "[\"a\"", "[\"a\",]", "[\"a\" \"b\"]", "[\"a\"] x", "[\"a\",null]",
+        "[\"\\q\"]", "[\"\\u12\"]", "[\"\\ud83d\"]", "[\"\\ud83d\\u0041\"]", "{\"a\":1}", "[\"a\\" }) {
+        CHECK(!detail::ParseJsonArgv(bad, argv, scratch));
+    }
+}
+
+UNIT_TEST(resp_command_size) {
+    std::string get = "*2\r\n$3\r\nGET\r\n$1\r\nk\r\n";
+    CHECK(detail::RespCommandSize(get) == get.size());
+    CHECK(detail::RespCommandSize(get + "*1\r\n$4\r\nPING\r\n") == get.size());
+    // binary safe, the length decides and not the bytes
+    std::string binary = std::string("*2\r\n$3\r\nGET\r\n$4\r\na\r\nb\r\n");
+    CHECK(detail::RespCommandSize(binary) == binary.size());
+    std::string empty = "*2\r\n$3\r\nGET\r\n$0\r\n\r\n";
+    CHECK(detail::RespCommandSize(empty) == empty.size());
+
+    for (size_t cut = 0; cut < get.size(); cut++)
+        CHECK(detail::RespCommandSize(std::string_view(get).substr(0, cut)) == 0);
+    for (const char* bad : { "*0\r\n", "*1\r\n+PING\r\n", "*1\r\n$4\r\nPINGX\r\n", "*x\r\n", "$3\r\nGET\r\n",
+        "*1\r\n$-1\r\n", "*1\r\n$4\nPING\r\n" }) {
+        CHECK(detail::RespCommandSize(bad) == 0);
+    }
+}
@@ -0,0 +1,82 @@
+/*
+The chunking of the container commands: how ForEachChunk splits a range, how
+MergeChunk folds the replies, and the reply of an empty container.
+*/
+#include <list>
+#include <map>
+#include <optional>
+
+#include "unit_test.hpp"
+
+using namespace rdsfmt;
+
+UNIT_TEST(for_each_chunk) {
+    std::vector<int> numbers(10);
+    for (int i = 0; i < 10; i++)
+        numbers[i] = i;
+    auto sizes = [&](const auto& range, size_t chunk_size) {
+        std::vector<size_t> result;
+        detail::ForEachChunk(range, chunk_size, [&](auto chunk) {
+            CHECK(static_cast<size_t>(std::distance(chunk.begin(), chunk.end())) == chunk.size());
+            result.push_back(chunk.size());
+        });
+        return result;
+    };
+    CHECK(sizes(numbers, 3) == std::vector<size_t>({ 3, 3, 3, 1 }));
+    CHECK(sizes(numbers, 5) == std::vector<size_t>({ 5, 5 }));
+    CHECK(sizes(numbers, 10) == std::vector<size_t>({ 10 }));
+    CHECK(sizes(numbers, 100) == std::vector<size_t>({ 10 }));
+    // 0 is one chunk, an empty range none at all
+    CHECK(sizes(numbers, 0) == std::vector<size_t>({ 10 }));
+    CHECK(sizes(std::vector<int>(), 3).empty());
+    CHECK(sizes(std::vector<int>(), 0).empty());
+
+    // the chunks cover the range once and in order, also without random access
+    std::list<int> list(numbers.begin(), numbers.end());
+    std::vector<int> seen;
+    detail::ForEachChunk(list, 4, [&](auto chunk) { seen.insert(seen.end(), chunk.begin(), chunk.end()); });
+    CHECK(seen == numbers);
+
+    // a chunk is written like the container, the pairs of MSET included
+    std::map<std::string, std::string> values{ { "a", "1" }, { "b", "2" }, { "c", "3" } };
+    std::vector<std::string> commands;
+    detail::ForEachChunk(values, 2, [&](auto chunk) {
+        fmt::memory_buffer out;
+        detail::RespWriter(out).Command("MSET", chunk);
+        commands.emplace_back(out.data(), out.size());
+    });
+    CHECK(commands.size() == 2);
+    CHECK(commands[0] == "*5\r\n$4\r\nMSET\r\n$1\r\na\r\n$1\r\n1\r\n$1\r\nb\r\n$1\r\n2\r\n");
+    CHECK(commands[1] == "*3\r\n$4\r\nMSET\r\n$1\r\nc\r\n$1\r\n3\r\n");
+}
+
+UNIT_TEST(merge_chunk) {
+    // DEL and SADD counts add up
+    tl::expected<int64_t, int> deleted = 2;
+    detail::MergeChunk(deleted, tl::expected<int64_t, int>(3));
+    CHECK(deleted.value_or(0) == 5);
+
+    // MGET replies are appended in the order of the keys
+    using Values = std::vector<std::optional<std::string>>;
+    tl::expected<Values, int> values = Values{ "a", std::nullopt };
+    detail::MergeChunk(values, tl::expected<Values, int>(Values{ "c" }));
+    CHECK(values && *values == (Values{ "a", std::nullopt, "c" }));
+
+    // MSET stays OK, a string is not appended
+    tl::expected<std::string, int> status = "OK";
+    detail::MergeChunk(status, tl::expected<std::string, int>("OK"));
+    CHECK(status.value_or("") == "OK");
+
+    // the first error stays, later chunks do not hide it
+    detail::MergeChunk(deleted, tl::expected<int64_t, int>(tl::unexpected{ REDIS_REPLY_ERROR }));
+    CHECK(!deleted && deleted.error() == REDIS_REPLY_ERROR);
+    detail::MergeChunk(deleted, tl::expected<int64_t, int>(4));
+    detail::MergeChunk(deleted, tl::expected<int64_t, int>(tl::unexpected{ -1 }));
+    CHECK(!deleted && deleted.error() == REDIS_REPLY_ERROR);
+}
+
+UNIT_TEST(empty_chunk) {
+    CHECK(detail::EmptyChunk<std::string>() == "OK");
+    CHECK(detail::EmptyChunk<int64_t>() == 0);
+    CHECK(detail::EmptyChunk<std::vector<std::optional<std::string>>>().empty());
+}
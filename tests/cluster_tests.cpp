@@ -0,0 +1,28 @@
+/*
+Slot routing of RedisClusterMgr: CRC16, HashSlot against the slots redis
+reports, and the hashtag rules.
+*/
+#include "redisfmt/cluster.hpp"
+#include "unit_test.hpp"
+
+using namespace rdsfmt;
+
+UNIT_TEST(slots) {
+    static_assert(detail::Crc16("123456789") == 0x31c3);
+    CHECK(detail::Crc16("") == 0);
+    // slots redis itself reports with CLUSTER KEYSLOT
+    CHECK(detail::HashSlot("foo") == 12182);
+    CHECK(detail::HashSlot("bar") == 5061);
+    CHECK(detail::HashSlot("hello") == 866);
+
+    CHECK(detail::HashTag("{user1000}.following") == "user1000");
+    CHECK(detail::HashTag("foo{}{bar}") == "foo{}{bar}");
+    CHECK(detail::HashTag("foo{{bar}}zap") == "{bar");
+    CHECK(detail::HashTag("foo{bar}{zap}") == "bar");
+    CHECK(detail::HashTag("{") == "{");
+    CHECK(detail::HashSlot("{user1000}.following") == detail::HashSlot("{user1000}.followers"));
+    CHECK(detail::HashSlot("{user1000}.following") == detail::HashSlot("user1000"));
+
+    for (int i = 0; i < 1000; i++)
+        CHECK(detail::HashSlot(fmt::format("key:{}", i)) < detail::kClusterSlots);
+}
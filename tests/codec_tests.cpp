@@ -0,0 +1,178 @@
+/*
+BinaryCodec, Compressed and PackedCodec: round trips, values written before a
+codec, and damaged or cut data that has to fail instead of reading past its end.
+*/
+#include <map>
+#include <random>
+
+#include "redisfmt/codec.hpp"
+#include "unit_test.hpp"
+
+using namespace rdsfmt;
+
+// Profile before level was added
+struct ProfileV1 {
+    std::string name;
+    int64_t score = 0;
+};
+REDIS_STRUCT(ProfileV1, name, score)
+
+// text that LZ4 shrinks, the kind of JSON values get stored as
+static std::string Json(size_t records) {
+    std::string text = "[";
+    for (size_t i = 0; i < records; i++)
+        text += fmt::format("{{\"id\":{},\"name\":\"user {}\",\"active\":{}}},", i, i % 97, i % 2 ? "true" : "false");
+    text.back() = ']';
+    return text;
+}
+
+static std::string Random(size_t size, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::string data(size, '\0');
+    for (auto& c : data)
+        c = static_cast<char>(rng());
+    return data;
+}
+
+UNIT_TEST(lz4) {
+    for (const std::string& data : { std::string(), std::string("a"), std::string("hello"), std::string(100000, 'x'),
+        Json(500), Random(5000, 1) }) {
+        fmt::memory_buffer block;
+        detail::Lz4Block::Compress(data, block);
+        std::string out;
+        CHECK(detail::Lz4Block::Decompress(std::string_view(block.data(), block.size()), data.size(), out));
+        CHECK(out == data);
+    }
+
+    std::string json = Json(500);
+    fmt::memory_buffer block;
+    detail::Lz4Block::Compress(json, block);
+    std::string_view compressed(block.data(), block.size());
+    CHECK(compressed.size() * 3 < json.size());
+
+    // a wrong size or a cut block is rejected, not read past its end
+    std::string out;
+    CHECK(!detail::Lz4Block::Decompress(compressed, json.size() - 1, out));
+    CHECK(!detail::Lz4Block::Decompress(compressed, json.size() + 1, out));
+    for (size_t cut = 0; cut < compressed.size(); cut += 7)
+        CHECK(!detail::Lz4Block::Decompress(compressed.substr(0, cut), json.size(), out));
+
+    // a flipped byte either fails or still gives exactly size bytes
+    std::mt19937 rng(2);
+    for (int i = 0; i < 2000; i++) {
+        std::string damaged(compressed);
+        damaged[rng() % damaged.size()] ^= static_cast<char>(1 + rng() % 255);
+        if (detail::Lz4Block::Decompress(damaged, json.size(), out))
+            CHECK(out.size() == json.size());
+    }
+}
+
+UNIT_TEST(binary_codec) {
+    auto round_trip = [](const auto& value) {
+        std::string data = EncodeWith<BinaryCodec>(value);
+        CHECK(!data.empty() && static_cast<uint8_t>(data[0]) == codec::kBinary);
+        std::decay_t<decltype(value)> decoded{};
+        return BinaryCodec::Decode(data, decoded) && decoded == value;
+    };
+    CHECK(round_trip(int64_t(0)));
+    CHECK(round_trip(int64_t(-1)));
+    CHECK(round_trip(std::numeric_limits<int64_t>::min()));
+    CHECK(round_trip(std::numeric_limits<uint64_t>::max()));
+    CHECK(round_trip(3.25));
+    CHECK(round_trip(true));
+    CHECK(round_trip(std::string("binary\0safe", 11)));
+    CHECK(round_trip(std::optional<int>()));
+    CHECK(round_trip(std::optional<std::string>("set")));
+    CHECK(round_trip(std::vector<std::string>{ "a", "", "ccc" }));
+    CHECK(round_trip(std::map<std::string, int>{ { "x", 1 }, { "y", -2 } }));
+
+    // small integers take a byte after the header
+    CHECK(EncodeWith<BinaryCodec>(int64_t(63)).size() == 2);
+    CHECK(EncodeWith<BinaryCodec>(int64_t(-64)).size() == 2);
+
+    Profile profile{ "ann", 1200, 7 };
+    std::string data = EncodeWith<BinaryCodec>(profile);
+    Profile decoded;
+    CHECK(BinaryCodec::Decode(data, decoded));
+    CHECK(decoded.name == "ann" && decoded.score == 1200 && decoded.level == 7);
+
+    // members added at the end stay default in old values and are skipped by old readers
+    Profile upgraded;
+    CHECK(BinaryCodec::Decode(EncodeWith<BinaryCodec>(ProfileV1{ "bob", 5 }), upgraded));
+    CHECK(upgraded.name == "bob" && upgraded.score == 5 && upgraded.level == 0);
+    ProfileV1 old;
+    CHECK(BinaryCodec::Decode(data, old));
+    CHECK(old.name == "ann" && old.score == 1200);
+
+    // values written before the codec are read as text
+    int64_t number = 0;
+    CHECK(BinaryCodec::Decode("42", number) && number == 42);
+    std::vector<int> list;
+    CHECK(!BinaryCodec::Decode("42", list));
+
+    // every cut of a container is rejected
+    std::vector<std::string> strings{ "first", "second", std::string(300, 'z') };
+    data = EncodeWith<BinaryCodec>(strings);
+    for (size_t cut = 1; cut < data.size(); cut++) {
+        std::vector<std::string> partial;
+        CHECK(!BinaryCodec::Decode(std::string_view(data).substr(0, cut), partial));
+    }
+
+    // a huge count in a few bytes does not allocate it
+    std::string bogus(1, static_cast<char>(codec::kBinary));
+    bogus += "\xff\xff\xff\xff\xff\xff\xff\xff\x7f";
+    CHECK(!BinaryCodec::Decode(bogus, strings));
+}
+
+UNIT_TEST(compressed) {
+    using Codec = Compressed<TextCodec>;
+    std::string json = Json(200);
+    std::string data = EncodeWith<Codec>(json);
+    CHECK(static_cast<uint8_t>(data[0]) == codec::kCompressed);
+    CHECK(data.size() < json.size());
+    std::string decoded;
+    CHECK(Codec::Decode(data, decoded) && decoded == json);
+
+    // below the threshold, or when it does not shrink, the text is kept as is
+    CHECK(EncodeWith<Codec>(std::string("short")) == "short");
+    std::string noise = Random(4096, 3);
+    noise[0] = 'n';
+    CHECK(EncodeWith<Codec>(noise) == noise);
+
+    // a first byte that looks like a header is escaped
+    std::string tricky("\xff" "data", 5);
+    data = EncodeWith<Codec>(tricky);
+    CHECK(static_cast<uint8_t>(data[0]) == codec::kStored);
+    CHECK(Codec::Decode(data, decoded) && decoded == tricky);
+
+    // plain values written before compression was turned on
+    CHECK(Codec::Decode("plain", decoded) && decoded == "plain");
+
+    // a damaged size or block fails instead of returning garbage
+    data = EncodeWith<Codec>(json);
+    CHECK(!Codec::Decode(std::string_view(data).substr(0, data.size() / 2), decoded));
+    std::string oversized(1, static_cast<char>(codec::kCompressed));
+    oversized += "\xff\xff\xff\xff\x0f";
+    CHECK(!Codec::Decode(oversized, decoded));
+}
+
+UNIT_TEST(packed) {
+    std::vector<Profile> profiles;
+    for (int i = 0; i < 200; i++)
+        profiles.push_back({ fmt::format("user {}", i % 10), i * 10, i % 5 });
+    std::string data = EncodeWith<PackedCodec>(profiles);
+    CHECK(static_cast<uint8_t>(data[0]) == codec::kCompressed);
+    std::vector<Profile> decoded;
+    CHECK(PackedCodec::Decode(data, decoded));
+    CHECK(decoded.size() == profiles.size());
+    CHECK(decoded.back().name == "user 9" && decoded.back().score == 1990 && decoded.back().level == 4);
+
+    // small values are binary but not compressed
+    data = EncodeWith<PackedCodec>(int64_t(7));
+    CHECK(static_cast<uint8_t>(data[0]) == codec::kBinary);
+    int64_t number = 0;
+    CHECK(PackedCodec::Decode(data, number) && number == 7);
+
+    for (size_t cut = 1; cut < 40; cut++)
+        CHECK(!PackedCodec::Decode(std::string_view(EncodeWith<PackedCodec>(profiles)).substr(0, cut), decoded));
+}
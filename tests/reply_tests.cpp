@@ -0,0 +1,102 @@
+/*
+The reply converters on reply trees built in memory: numbers in bulk strings,
+the RESP3 map, set, double, bool and big number, and the errors a value out of
+range or an empty string gives.
+*/
+#include <limits>
+#include <map>
+#include <set>
+
+#include "unit_test.hpp"
+
+using namespace rdsfmt;
+
+UNIT_TEST(reply_numbers) {
+    ReplyTree tree;
+    CHECK(GetFromReply<int>(tree.String("42")).value_or(0) == 42);
+    CHECK(GetFromReply<int>(tree.String("-7")).value_or(0) == -7);
+    CHECK(GetFromReply<int64_t>(tree.String("9223372036854775807")).value_or(0) ==
+        std::numeric_limits<int64_t>::max());
+    CHECK(GetFromReply<double>(tree.String("2.5")).value_or(0) == 2.5);
+    CHECK(GetFromReply<int>(tree.Integer(12)).value_or(0) == 12);
+    CHECK(GetFromReply<std::string>(tree.Integer(-3)).value_or("") == "-3");
+
+    // out of range, empty, trailing bytes or a fraction fail instead of giving a part of the number
+    CHECK(GetFromReply<int>(tree.String("99999999999")).error() == -1);
+    CHECK(GetFromReply<uint8_t>(tree.String("256")).error() == -1);
+    CHECK(GetFromReply<uint32_t>(tree.String("-1")).error() == -1);
+    CHECK(GetFromReply<int>(tree.String("")).error() == -1);
+    CHECK(GetFromReply<double>(tree.String("")).error() == -1);
+    CHECK(GetFromReply<int>(tree.String("12x")).error() == -1);
+    CHECK(GetFromReply<int>(tree.String(" 12")).error() == -1);
+    CHECK(GetFromReply<int64_t>(tree.String("1.5")).error() == -1);
+
+    CHECK(GetFromReply<int>(tree.Nil()).error() == REDIS_REPLY_NIL);
+    CHECK(GetFromReply<int>(tree.String("ERR wrong type", REDIS_REPLY_ERROR)).error() == REDIS_REPLY_ERROR);
+    CHECK(GetFromReply<std::string>(tree.String("OK", REDIS_REPLY_STATUS)).value_or("") == "OK");
+}
+
+UNIT_TEST(reply_resp3_scalars) {
+    ReplyTree tree;
+    // ZSCORE and ZINCRBY of RESP3
+    CHECK(GetFromReply<double>(tree.Double(2.5, "2.5")).value_or(0) == 2.5);
+    CHECK(GetFromReply<float>(tree.Double(0.25, "0.25")).value_or(0) == 0.25f);
+    CHECK(GetFromReply<std::string>(tree.Double(2.5, "2.5")).value_or("") == "2.5");
+    // an integer reads the text, so a fraction is an error like with the RESP2 bulk string
+    CHECK(GetFromReply<int64_t>(tree.Double(3, "3")).value_or(0) == 3);
+    CHECK(GetFromReply<int64_t>(tree.Double(2.5, "2.5")).error() == -1);
+    CHECK(GetFromReply<int>(tree.Double(1e20, "1e20")).error() == -1);
+
+    CHECK(GetFromReply<bool>(tree.Integer(1, REDIS_REPLY_BOOL)).value_or(false));
+    CHECK(!GetFromReply<bool>(tree.Integer(0, REDIS_REPLY_BOOL)).value_or(true));
+    CHECK(GetFromReply<int>(tree.Integer(1, REDIS_REPLY_BOOL)).value_or(0) == 1);
+
+    CHECK(GetFromReply<std::string>(tree.String("3492890328409238509324850943850943825024385", REDIS_REPLY_BIGNUM))
+        .value_or("") == "3492890328409238509324850943850943825024385");
+    CHECK(GetFromReply<int64_t>(tree.String("1234", REDIS_REPLY_BIGNUM)).value_or(0) == 1234);
+    CHECK(GetFromReply<int64_t>(tree.String("3492890328409238509324850943850943825024385", REDIS_REPLY_BIGNUM))
+        .error() == -1);
+}
+
+UNIT_TEST(reply_resp3_containers) {
+    ReplyTree tree;
+    // HGETALL of RESP3 is a map, laid out like the RESP2 array
+    auto* hash = tree.Array({ tree.String("name"), tree.String("ann"), tree.String("score"), tree.String("12"),
+        tree.String("level"), tree.String("3") }, REDIS_REPLY_MAP);
+    auto fields = GetFromReply<std::map<std::string, std::string>>(hash);
+    CHECK(fields && fields->size() == 3 && fields->at("score") == "12");
+    auto profile = GetFromReply<Profile>(hash);
+    CHECK(profile && profile->name == "ann" && profile->score == 12 && profile->level == 3);
+
+    // a value that is not a number leaves its member at the default, the others are read
+    auto* partial = tree.Array({ tree.String("name"), tree.String("bob"), tree.String("score"),
+        tree.String("99999999999999999999"), tree.String("unknown"), tree.String("x") }, REDIS_REPLY_MAP);
+    profile = GetFromReply<Profile>(partial);
+    CHECK(profile && profile->name == "bob" && profile->score == 0);
+    CHECK(GetFromReply<Profile>(tree.Array({}, REDIS_REPLY_MAP)).error() == -1);
+
+    // a value that does not convert drops its pair
+    auto* counts = tree.Array({ tree.String("a"), tree.String("1"), tree.String("b"), tree.String("x") },
+        REDIS_REPLY_MAP);
+    auto numbers = GetFromReply<std::map<std::string, int>>(counts);
+    CHECK(numbers && *numbers == (std::map<std::string, int>{ { "a", 1 } }));
+
+    // ZRANGE WITHSCORES of RESP3, [member, score] pairs with double scores
+    auto* ranked = tree.Array({ tree.Array({ tree.String("m1"), tree.Double(1.5, "1.5") }),
+        tree.Array({ tree.String("m2"), tree.Double(2, "2") }) });
+    auto scores = GetFromReply<std::vector<std::pair<std::string, double>>>(ranked);
+    CHECK(scores && scores->size() == 2 && scores->at(0).first == "m1" && scores->at(0).second == 1.5 &&
+        scores->at(1).second == 2);
+
+    // SMEMBERS of RESP3 is a set
+    auto* members = tree.Array({ tree.String("b"), tree.String("a"), tree.String("b") }, REDIS_REPLY_SET);
+    auto set = GetFromReply<std::set<std::string>>(members);
+    CHECK(set && *set == (std::set<std::string>{ "a", "b" }));
+    auto list = GetFromReply<std::vector<std::string>>(members);
+    CHECK(list && list->size() == 3 && list->front() == "b");
+
+    // MGET keeps the place of a nil with std::optional
+    auto* values = tree.Array({ tree.String("1"), tree.Nil(), tree.String("x") });
+    auto optionals = GetFromReply<std::vector<std::optional<int>>>(values);
+    CHECK(optionals && optionals->size() == 3 && optionals->at(0) == 1 && !optionals->at(1) && !optionals->at(2));
+}
@@ -0,0 +1,54 @@
+/*
+RespWriter: the bytes of commands with literal, numeric, container, option,
+struct and encoded arguments, and of the constant prefix MakeRespCommand builds.
+*/
+#include <functional>
+#include <map>
+
+#include "redisfmt/codec.hpp"
+#include "unit_test.hpp"
+
+using namespace rdsfmt;
+using namespace std::string_literals;
+
+static std::string Resp(const std::function<void(detail::RespWriter&)>& write) {
+    fmt::memory_buffer out;
+    detail::RespWriter writer(out);
+    write(writer);
+    return std::string(out.data(), out.size());
+}
+
+UNIT_TEST(resp_writer) {
+    CHECK(Resp([](auto& w) { w.Command("SET", "k", 10); }) == "*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$2\r\n10\r\n");
+    CHECK(Resp([](auto& w) { w.Command("SCRIPT LOAD", "return 1"); }) ==
+        "*3\r\n$6\r\nSCRIPT\r\n$4\r\nLOAD\r\n$8\r\nreturn 1\r\n");
+
+    // the constant prefix of a fixed arity command is the same bytes
+    static constexpr auto set = detail::MakeRespCommand<std::string_view, int>("SET");
+    CHECK(Resp([](auto& w) { w.Command(set, std::string_view("k"), 10); }) == "*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$2\r\n10\r\n");
+    static constexpr auto del = detail::MakeRespCommand<std::vector<std::string>>("DEL");
+    CHECK(Resp([](auto& w) { w.Command(del, std::vector<std::string>{ "a", "bb" }); }) ==
+        "*3\r\n$3\r\nDEL\r\n$1\r\na\r\n$2\r\nbb\r\n");
+
+    CHECK(Resp([](auto& w) { w.Command("SET", "a\0b"s, ""); }) ==
+        "*3\r\n$3\r\nSET\r\n$3\r\na\0b\r\n$0\r\n\r\n"s);
+    CHECK(Resp([](auto& w) { w.Command("X", -7, uint64_t(18446744073709551615ULL), true, 'c'); }) ==
+        "*5\r\n$1\r\nX\r\n$2\r\n-7\r\n$20\r\n18446744073709551615\r\n$4\r\ntrue\r\n$1\r\nc\r\n");
+
+    // containers and pairs expand in place, an option without value is left out
+    std::map<std::string, int> fields{ { "f1", 1 }, { "f2", 2 } };
+    CHECK(Resp([&](auto& w) { w.Command("HSET", "h", fields); }) ==
+        "*6\r\n$4\r\nHSET\r\n$1\r\nh\r\n$2\r\nf1\r\n$1\r\n1\r\n$2\r\nf2\r\n$1\r\n2\r\n");
+    CHECK(Resp([](auto& w) { w.Command("SET", "k", "v", RedisOp::EX()); }) == "*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$1\r\nv\r\n");
+    CHECK(Resp([](auto& w) { w.Command("SET", "k", "v", RedisOp::EX(60)); }) ==
+        "*5\r\n$3\r\nSET\r\n$1\r\nk\r\n$1\r\nv\r\n$2\r\nEX\r\n$2\r\n60\r\n");
+
+    // a struct is written as field value pairs
+    CHECK(Resp([](auto& w) { w.Command("HSET", "p", Profile{ "ann", 5, 1 }); }) ==
+        "*8\r\n$4\r\nHSET\r\n$1\r\np\r\n$4\r\nname\r\n$3\r\nann\r\n$5\r\nscore\r\n$1\r\n5\r\n$5\r\nlevel\r\n$1\r\n1\r\n");
+
+    // an encoded argument is one bulk string of its codec
+    std::string packed = EncodeWith<BinaryCodec>(int64_t(5));
+    CHECK(Resp([](auto& w) { w.Command("SET", "k", Encode<BinaryCodec>(int64_t(5))); }) ==
+        "*3\r\n$3\r\nSET\r\n$1\r\nk\r\n$2\r\n" + packed + "\r\n");
+}
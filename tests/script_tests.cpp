@@ -0,0 +1,24 @@
+/*
+Script hashing: Sha1 against the FIPS 180 test vectors and the digest
+MakeScript computes at compile time for EVALSHA.
+*/
+#include "unit_test.hpp"
+
+using namespace rdsfmt;
+
+UNIT_TEST(sha1) {
+    auto hex = [](std::string_view data) {
+        auto digest = detail::Sha1::Hex(data);
+        return std::string(digest.data(), digest.size());
+    };
+    CHECK(hex("") == "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+    CHECK(hex("abc") == "a9993e364706816aba3e25717850c26c9cd0d89d");
+    // 56 bytes, the length no longer fits in the first block
+    CHECK(hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") == "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+    CHECK(hex(std::string(1000, 'a')) == "291e9a6c66994949b57ba5e650361e98fc36b1ba");
+
+    // the same digest as SCRIPT LOAD, computed at compile time
+    static constexpr RedisScript script = MakeScript("return 1");
+    CHECK(script.Sha() == "e0e1f9fabfc9d4800c877a703b823ac0578ff8db");
+    CHECK(script.body == "return 1");
+}
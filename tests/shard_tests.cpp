@@ -0,0 +1,70 @@
+/*
+HashRing of RedisShardMgr: balance, the keys that move when a shard is added
+or removed, weights and hashtags.
+*/
+#include <map>
+
+#include "redisfmt/shard.hpp"
+#include "unit_test.hpp"
+
+using namespace rdsfmt;
+
+UNIT_TEST(hash_ring) {
+    auto make_ring = [](const std::vector<std::pair<std::string, int>>& shards) {
+        std::vector<std::shared_ptr<detail::Shard>> list;
+        for (auto& [name, weight] : shards) {
+            auto shard = std::make_shared<detail::Shard>();
+            shard->name = name;
+            shard->weight = weight;
+            list.push_back(shard);
+        }
+        return detail::HashRing(std::move(list));
+    };
+    constexpr size_t kKeys = 20000;
+    auto owners = [&](const detail::HashRing& ring) {
+        std::vector<std::string> result;
+        for (size_t i = 0; i < kKeys; i++)
+            result.push_back(ring.Shards()[ring.Locate(fmt::format("key:{}", i))]->name);
+        return result;
+    };
+
+    auto four = make_ring({ { "a", 1 }, { "b", 1 }, { "c", 1 }, { "d", 1 } });
+    auto before = owners(four);
+    std::map<std::string, size_t> counts;
+    for (auto& name : before)
+        counts[name]++;
+    CHECK(counts.size() == 4);
+    for (auto& [_, count] : counts)
+        CHECK(count > kKeys / 8 && count < kKeys * 3 / 8);
+
+    // a new shard takes about a fifth of the keys and only moves keys to itself
+    auto five = make_ring({ { "a", 1 }, { "b", 1 }, { "c", 1 }, { "d", 1 }, { "e", 1 } });
+    auto after = owners(five);
+    size_t moved = 0;
+    for (size_t i = 0; i < kKeys; i++) {
+        if (before[i] != after[i]) {
+            moved++;
+            CHECK(after[i] == "e");
+        }
+    }
+    CHECK(moved > kKeys / 8 && moved < kKeys * 3 / 10);
+
+    // removing a shard only moves its own keys
+    auto three = make_ring({ { "a", 1 }, { "b", 1 }, { "c", 1 } });
+    auto removed = owners(three);
+    for (size_t i = 0; i < kKeys; i++) {
+        if (before[i] != "d")
+            CHECK(removed[i] == before[i]);
+    }
+
+    // weight 2 owns about twice the keys
+    auto weighted = make_ring({ { "a", 2 }, { "b", 1 } });
+    size_t heavy = 0;
+    for (auto& name : owners(weighted))
+        heavy += name == "a";
+    CHECK(heavy > kKeys * 55 / 100 && heavy < kKeys * 78 / 100);
+
+    // a hashtag keeps keys on one shard
+    for (int i = 0; i < 100; i++)
+        CHECK(four.Locate(fmt::format("{{order:{}}}:items", i)) == four.Locate(fmt::format("{{order:{}}}:total", i)));
+}
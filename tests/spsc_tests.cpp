@@ -0,0 +1,76 @@
+/*
+SpscQueue, the ring between the reader thread of RedisSubscriber and a worker:
+capacity, a full ring, batches, and the order across two threads.
+*/
+#include <memory>
+#include <thread>
+
+#include "redisfmt/subscriber.hpp"
+#include "unit_test.hpp"
+
+using namespace rdsfmt;
+
+UNIT_TEST(spsc_queue) {
+    // the capacity is rounded up to a power of two, at least 2
+    auto capacity = [](size_t size) {
+        detail::SpscQueue<int> queue(size);
+        size_t pushed = 0;
+        for (int i = 0; i < 100 && queue.TryPush(i); i++)
+            pushed++;
+        return pushed;
+    };
+    CHECK(capacity(0) == 2);
+    CHECK(capacity(2) == 2);
+    CHECK(capacity(3) == 4);
+    CHECK(capacity(16) == 16);
+    CHECK(capacity(17) == 32);
+
+    // a full ring leaves the item with the producer
+    detail::SpscQueue<std::unique_ptr<int>> queue(4);
+    CHECK(queue.Empty());
+    for (int i = 0; i < 4; i++) {
+        auto item = std::make_unique<int>(i);
+        CHECK(queue.TryPush(item) && !item);
+    }
+    auto rejected = std::make_unique<int>(4);
+    CHECK(!queue.TryPush(rejected) && rejected && *rejected == 4);
+
+    // batches come out in order, up to max at a time
+    std::vector<std::unique_ptr<int>> out;
+    CHECK(queue.PopBatch(out, 3) == 3);
+    CHECK(queue.TryPush(rejected) && !rejected);
+    CHECK(queue.PopBatch(out, 10) == 2);
+    CHECK(queue.PopBatch(out, 10) == 0);
+    CHECK(queue.Empty());
+    CHECK(out.size() == 5);
+    for (size_t i = 0; i < out.size(); i++)
+        CHECK(out[i] && *out[i] == static_cast<int>(i));
+}
+
+UNIT_TEST(spsc_queue_threads) {
+    constexpr uint64_t kItems = 200000;
+    detail::SpscQueue<uint64_t> queue(64);
+    std::thread producer([&] {
+        for (uint64_t i = 0; i < kItems; i++) {
+            uint64_t item = i;
+            while (!queue.TryPush(item))
+                std::this_thread::yield();
+        }
+    });
+    // every item once, in the order pushed, while the ring wraps many times
+    std::vector<uint64_t> batch;
+    uint64_t next = 0;
+    bool ordered = true;
+    while (next < kItems) {
+        batch.clear();
+        if (queue.PopBatch(batch, 16) == 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        for (uint64_t item : batch)
+            ordered = ordered && item == next++;
+    }
+    producer.join();
+    CHECK(ordered);
+    CHECK(queue.Empty());
+}
@@ -0,0 +1,65 @@
+/*
+The stream replies on reply trees built in memory: entries of XREADGROUP with
+their fields, the nil fields of an entry deleted while pending, and XAUTOCLAIM.
+*/
+#include <map>
+
+#include "redisfmt/stream.hpp"
+#include "unit_test.hpp"
+
+using namespace rdsfmt;
+
+using Fields = std::map<std::string, std::string>;
+
+static redisReply* Entry(ReplyTree& tree, std::string_view id, std::string_view name, std::string_view score) {
+    return tree.Array({ tree.String(id), tree.Array({ tree.String("name"), tree.String(name),
+        tree.String("score"), tree.String(score) }) });
+}
+
+UNIT_TEST(stream_entry) {
+    ReplyTree tree;
+    auto entry = GetFromReply<StreamEntry<Fields>>(Entry(tree, "1-0", "ann", "5"));
+    CHECK(entry && entry->id == "1-0" && entry->error == 0 && entry->fields.at("name") == "ann");
+    auto profile = GetFromReply<StreamEntry<Profile>>(Entry(tree, "1-1", "bob", "7"));
+    CHECK(profile && profile->id == "1-1" && profile->fields.name == "bob" && profile->fields.score == 7);
+
+    // XREADGROUP of pending entries gives nil fields for one deleted since, the id is kept to XACK it
+    auto deleted = GetFromReply<StreamEntry<Profile>>(tree.Array({ tree.String("2-0"), tree.Nil() }));
+    CHECK(deleted && deleted->id == "2-0" && deleted->error == REDIS_REPLY_NIL && deleted->fields.name.empty());
+
+    // anything but [id, fields] is not an entry
+    CHECK(GetFromReply<StreamEntry<Fields>>(tree.Array({ tree.String("3-0") })).error() == -1);
+    CHECK(GetFromReply<StreamEntry<Fields>>(tree.Array({ tree.Integer(3), tree.Array({}) })).error() == -1);
+    CHECK(GetFromReply<StreamEntry<Fields>>(tree.Array({ tree.String("3-0"), tree.Array({}), tree.Nil() }))
+        .error() == -1);
+
+    // XREADGROUP, an array of [stream, entries] in RESP2 and a map in RESP3
+    auto* entries = tree.Array({ Entry(tree, "4-0", "a", "1"), tree.Array({ tree.String("4-1"), tree.Nil() }) });
+    for (int type : { REDIS_REPLY_ARRAY, REDIS_REPLY_MAP }) {
+        auto* streams = type == REDIS_REPLY_ARRAY ? tree.Array({ tree.Array({ tree.String("events"), entries }) })
+            : tree.Array({ tree.String("events"), entries }, REDIS_REPLY_MAP);
+        auto read = GetFromReply<StreamRead<Profile>>(streams);
+        CHECK(read && read->size() == 1 && read->at(0).first == "events");
+        CHECK(read && read->at(0).second.size() == 2 && read->at(0).second[1].error == REDIS_REPLY_NIL);
+    }
+}
+
+UNIT_TEST(stream_claim) {
+    ReplyTree tree;
+    // redis 7: next cursor, claimed entries, ids no longer in the stream
+    auto claim = GetFromReply<StreamClaim<Profile>>(tree.Array({ tree.String("5-0"),
+        tree.Array({ Entry(tree, "1-0", "ann", "5"), Entry(tree, "2-0", "bob", "6") }),
+        tree.Array({ tree.String("3-0") }) }));
+    CHECK(claim && claim->next == "5-0" && claim->entries.size() == 2 && claim->entries[1].fields.score == 6);
+    CHECK(claim && claim->deleted == std::vector<std::string>({ "3-0" }));
+
+    // redis 6.2 has no deleted ids and leaves a nil in place of a deleted entry
+    claim = GetFromReply<StreamClaim<Profile>>(tree.Array({ tree.String("0-0"),
+        tree.Array({ tree.Nil(), Entry(tree, "4-0", "cy", "1") }) }));
+    CHECK(claim && claim->next == "0-0" && claim->entries.size() == 1 && claim->entries[0].id == "4-0");
+    CHECK(claim && claim->deleted.empty());
+
+    CHECK(GetFromReply<StreamClaim<Profile>>(tree.Array({ tree.String("0-0") })).error() == -1);
+    CHECK(GetFromReply<StreamClaim<Profile>>(tree.Array({ tree.Nil(), tree.Array({}) })).error() == -1);
+    CHECK(!GetFromReply<StreamClaim<Profile>>(tree.Array({ tree.String("0-0"), tree.Nil() })));
+}
@@ -0,0 +1,125 @@
+#ifndef __REDISFMT_UNIT_TEST_H__
+#define __REDISFMT_UNIT_TEST_H__
+
+/*
+The harness of the unit tests. Every tests/<name>_tests.cpp registers its
+cases with UNIT_TEST(name), tests/unit_tests.cpp runs them:
+
+    UNIT_TEST(lz4) {
+        CHECK(...);
+    }
+
+A failed CHECK prints the condition and lets the case go on.
+*/
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "redisfmt/redisfmt.hpp"
+
+namespace unit_test {
+
+struct Case {
+    const char* name;
+    void (*run)();
+};
+
+inline std::vector<Case>& Cases() {
+    static std::vector<Case> cases;
+    return cases;
+}
+
+inline int& Failures() {
+    static int failures = 0;
+    return failures;
+}
+
+struct Register {
+    Register(const char* name, void (*run)()) { Cases().push_back({ name, run }); }
+};
+
+}   // namespace unit_test
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            unit_test::Failures()++; \
+        } \
+    } while (0)
+
+#define UNIT_TEST(name) \
+    static void UnitTest_##name(); \
+    static unit_test::Register unit_test_register_##name(#name, UnitTest_##name); \
+    static void UnitTest_##name()
+
+// a struct the codec and encoder tests share
+struct Profile {
+    std::string name;
+    int64_t score = 0;
+    int level = 0;
+};
+REDIS_STRUCT(Profile, name, score, level)
+
+template <typename Codec, typename T>
+std::string EncodeWith(const T& value) {
+    fmt::memory_buffer out;
+    Codec::Encode(value, out);
+    return std::string(out.data(), out.size());
+}
+
+/*
+A reply tree in memory, laid out the way the hiredis reader leaves it, for the
+converters without a server. The tree owns every node and string:
+
+    ReplyTree tree;
+    auto* map = tree.Array({ tree.String("a"), tree.String("1") }, REDIS_REPLY_MAP);
+    auto value = GetFromReply<std::map<std::string, int>>(map);
+*/
+class ReplyTree {
+public:
+    redisReply* String(std::string_view str, int type = REDIS_REPLY_STRING) {
+        redisReply* reply = Node(type);
+        strings_.emplace_back(str);
+        reply->str = strings_.back().data();
+        reply->len = str.size();
+        return reply;
+    }
+
+    redisReply* Integer(long long integer, int type = REDIS_REPLY_INTEGER) {
+        redisReply* reply = Node(type);
+        reply->integer = integer;
+        return reply;
+    }
+
+    // hiredis keeps the text of a RESP3 double next to its value
+    redisReply* Double(double dval, std::string_view text) {
+        redisReply* reply = String(text, REDIS_REPLY_DOUBLE);
+        reply->dval = dval;
+        return reply;
+    }
+
+    redisReply* Nil() { return Node(REDIS_REPLY_NIL); }
+
+    redisReply* Array(std::vector<redisReply*> elements, int type = REDIS_REPLY_ARRAY) {
+        redisReply* reply = Node(type);
+        elements_.push_back(std::move(elements));
+        reply->element = elements_.back().data();
+        reply->elements = elements_.back().size();
+        return reply;
+    }
+
+private:
+    redisReply* Node(int type) {
+        redisReply& reply = nodes_.emplace_back();
+        reply.type = type;
+        return &reply;
+    }
+
+    std::deque<redisReply> nodes_;
+    std::deque<std::string> strings_;
+    std::deque<std::vector<redisReply*>> elements_;
+};
+
+#endif
@@ -0,0 +1,21 @@
+/*
+Unit tests of the parts that need no redis server, each tests/<name>_tests.cpp
+registers its cases with UNIT_TEST.
+
+unit_tests [filter]     runs the tests whose name contains filter
+*/
+#include <string_view>
+
+#include "unit_test.hpp"
+
+int main(int argc, char** argv) {
+    const char* filter = argc > 1 ? argv[1] : nullptr;
+    for (auto& test : unit_test::Cases()) {
+        if (filter && std::string_view(test.name).find(filter) == std::string_view::npos)
+            continue;
+        int failures = unit_test::Failures();
+        test.run();
+        std::printf("%-20s %s\n", test.name, unit_test::Failures() == failures ? "ok" : "FAILED");
+    }
+    return unit_test::Failures() == 0 ? 0 : 1;
+}
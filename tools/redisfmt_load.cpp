@@ -0,0 +1,97 @@
+/*
+Bulk ingest from files, redis-cli --pipe from the redisfmt side.
+
+redisfmt-load [--host=127.0.0.1 --port=6379 --auth=... --db=0]
+    [--format=tsv|jsonl|resp] [--window=10000] [--chunk=65536] file...
+
+Without --format it follows the extension, .jsonl/.json and .resp, anything
+else is TSV. Errors are printed with their record number, the exit code is 1
+when any record failed.
+*/
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "redisfmt/bulk.hpp"
+
+using namespace rdsfmt;
+
+static bool EndsWith(const std::string& text, std::string_view suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool ParseFormat(const std::string& name, BulkFormat& format) {
+    if (name == "tsv") format = BulkFormat::TSV;
+    else if (name == "jsonl") format = BulkFormat::JSONL;
+    else if (name == "resp") format = BulkFormat::RESP;
+    else return false;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    RedisInitParam param;
+    param.host = "127.0.0.1";
+    param.port = 6379;
+    param.context_count = 1;
+    param.slow_log_threshold = 0;
+    BulkOptions options;
+    std::string format_name;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (name == "--host") param.host = value;
+        else if (name == "--port") param.port = std::atoi(value.c_str());
+        else if (name == "--auth") param.auth = value;
+        else if (name == "--db") param.db_index = std::atoi(value.c_str());
+        else if (name == "--format") format_name = value;
+        else if (name == "--window") options.window = static_cast<size_t>(std::max(std::atoll(value.c_str()), 1LL));
+        else if (name == "--chunk") options.chunk_bytes = static_cast<size_t>(std::max(std::atoll(value.c_str()), 1LL));
+        else if (arg.compare(0, 2, "--") == 0) {
+            fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 2;
+        }
+        else files.push_back(arg);
+    }
+    BulkFormat forced = BulkFormat::TSV;
+    if (files.empty() || (!format_name.empty() && !ParseFormat(format_name, forced))) {
+        fprintf(stderr, "usage: redisfmt-load [--host= --port= --auth= --db= --format=tsv|jsonl|resp "
+            "--window= --chunk=] file...\n");
+        return 2;
+    }
+
+    RedisMgr mgr;
+    if (mgr.Initialize(param) != 0) {
+        fprintf(stderr, "can not connect to %s:%d\n", param.host.c_str(), param.port);
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto loader = mgr.BulkLoad(options);
+    for (auto& file : files) {
+        BulkFormat format = forced;
+        if (format_name.empty()) {
+            format = EndsWith(file, ".jsonl") || EndsWith(file, ".json") ? BulkFormat::JSONL
+                : EndsWith(file, ".resp") ? BulkFormat::RESP : BulkFormat::TSV;
+        }
+        if (!LoadFile(loader, file, format))
+            fprintf(stderr, "%s: load stopped early\n", file.c_str());
+        if (loader.Progress().error != 0)
+            break;
+    }
+    BulkResult result = loader.Finish();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (auto& error : result.errors)
+        fprintf(stderr, "record %zu: %s\n", error.record, error.message.c_str());
+    if (result.failed > result.errors.size())
+        fprintf(stderr, "... %zu more errors\n", result.failed - result.errors.size());
+    printf("records: %zu, ok: %zu, errors: %zu, %.2fs, %.0f records/s\n", result.records, result.ok, result.failed,
+        seconds, seconds > 0 ? static_cast<double>(result.records) / seconds : 0.0);
+    mgr.UnInit();
+    return result.failed == 0 ? 0 : 1;
+}